@@ -33,20 +33,37 @@ class Customer {
    */
   using RecvHandle = std::function<void(const Message& recved)>;
 
+  /**
+   * \brief the handle for all the messages received since its last call
+   * \param recved the received messages, in the order they came
+   */
+  using BatchRecvHandle = std::function<void(const std::vector<Message>& recved)>;
+
   /**
    * \brief constructor
    * \param app_id the globally unique id indicating the application the postoffice
    *               serving for
    * \param customer_id the locally unique id indicating the customer of a postoffice
    * \param recv_handle the functino for processing a received message
+   * \param batch_handle optional. if given, it processes the received
+   *                     messages instead of recv_handle, as many at once as
+   *                     are queued
    */
-  Customer(int app_id, int customer_id, const RecvHandle& recv_handle, Postoffice* postoffice);
+  Customer(int app_id, int customer_id, const RecvHandle& recv_handle, Postoffice* postoffice,
+           const BatchRecvHandle& batch_handle = nullptr);
 
   /**
    * \brief desconstructor
    */
   ~Customer();
 
+  /**
+   * \brief stop receiving messages, once the ones queued are handled. Then
+   * no handle of this customer runs anymore, though requests can still be
+   * sent and waited for. The destructor calls it
+   */
+  void Stop();
+
   /**
    * \brief return the globally unique application id
    */
@@ -73,22 +90,76 @@ class Customer {
   void WaitRequest(int timestamp);
 
   /**
-   * \brief return the number of responses received for the request. threadsafe
+   * \brief return true if the request is finished, without blocking. threadsafe
+   * \param timestamp the timestamp of the request
+   */
+  bool TestRequest(int timestamp);
+
+  /**
+   * \brief wait until all the requests are finished. threadsafe
+   * \param timestamps the timestamps of the requests
+   */
+  void WaitAll(const std::vector<int>& timestamps);
+
+  /**
+   * \brief wait until any of the requests is finished. threadsafe
+   * \param timestamps the timestamps of the requests, should not be empty
+   * \return the timestamp of a finished request
+   */
+  int WaitAny(const std::vector<int>& timestamps);
+
+  /**
+   * \brief return the number of responses received for an unfinished
+   * request. threadsafe
    * \param timestamp the timestamp of the request
    */
   int NumResponse(int timestamp);
 
   /**
    * \brief add a number of responses to timestamp
+   *
+   * num is negative when a response is replaced by several, such as a
+   * request resent to other servers.
    */
   void AddResponse(int timestamp, int num = 1);
 
+  /**
+   * \brief handle small messages on the thread of \ref Van that received them,
+   * instead of the thread of this customer
+   *
+   * A data message with at most max_bytes of data is handled at once if no
+   * other message is queued or being handled, so messages are still handled
+   * one at a time and in order. It saves the handoff between the threads,
+   * which dominates the latency of small requests, but holds up the receiving
+   * of other messages meanwhile. The handle must then be quick, and must not
+   * wait for another message such as a response. Responses rejected by a
+   * rebalance are always queued, as resending them waits for the new key
+   * ranges. The messages must be accepted by a single thread, as \ref Van
+   * does. threadsafe
+   * \param max_bytes the largest data size handled inline, -1 to handle all
+   * the messages on the thread of this customer, the default
+   */
+  void set_inline_handling(int64_t max_bytes) { inline_max_bytes_ = max_bytes; }
+
   /**
    * \brief accept a received message from \ref Van. threadsafe
    * \param recved the received the message
    */
   inline void Accept(const Message& recved) {
-    recv_queue_.Push(recved);
+    Message msg(recved);
+    Accept(std::move(msg));
+  }
+
+  /**
+   * \brief accept a received message from \ref Van without copying it. threadsafe
+   * \param recved the received the message, left empty on return
+   */
+  inline void Accept(Message&& recved) {
+    if (inline_max_bytes_.load(std::memory_order_relaxed) >= 0 && AcceptInline(&recved)) {
+      return;
+    }
+    num_queued_.fetch_add(1, std::memory_order_relaxed);
+    recv_queue_.Push(std::move(recved));
   }
 
  private:
@@ -97,19 +168,71 @@ class Customer {
    */
   void Receiving();
 
+  /**
+   * \brief the thread function with a batch handle
+   */
+  void ReceivingBatches();
+
+  /**
+   * \brief handle a message on the calling thread if set_inline_handling
+   * allows it
+   * \return false if the message is left to queue
+   */
+  bool AcceptInline(Message* recved);
+
   int app_id_;
 
   int customer_id_;
 
   RecvHandle recv_handle_;
+  BatchRecvHandle batch_handle_;
   Postoffice* postoffice_;
 
   ThreadsafeQueue<Message> recv_queue_;
   std::unique_ptr<std::thread> recv_thread_;
+  /** \brief the messages accepted and not handled yet by recv_thread_ */
+  std::atomic<int> num_queued_{0};
+  /** \brief see set_inline_handling */
+  std::atomic<int64_t> inline_max_bytes_{-1};
+  /** \brief the message handed to batch_handle_ by AcceptInline */
+  std::vector<Message> inline_msgs_;
+
+  /** \brief a thread blocked in WaitRequest or WaitAny */
+  struct Waiter {
+    std::condition_variable cond;
+    bool done = false;
+  };
+
+  /**
+   * \brief the state of a request.
+   *
+   * requests are tracked in a ring indexed by timestamp. a slot is reused by a
+   * later timestamp once its request is finished, so the tracker only holds
+   * the requests in flight instead of every request ever sent.
+   */
+  struct Tracker {
+    int timestamp = -1;
+    int num_expected = 0;
+    int num_received = 0;
+    /** \brief the threads to wake up when the request is finished */
+    std::vector<Waiter*> waiters;
+    bool finished() const { return num_received >= num_expected; }
+  };
+
+  /** \brief returns the tracker of an unfinished request, or nullptr */
+  Tracker* FindTracker(int timestamp);
+  /** \brief adds responses to a request and wakes up its waiters if finished */
+  void AddResponseLocked(int timestamp, int num);
+  /** \brief enlarges the ring so that it can hold the timestamp */
+  void GrowTracker(int timestamp);
+
+  /** \brief the initial number of slots of the ring */
+  static const size_t kInitTrackerSize = 1024;
 
   std::mutex tracker_mu_;
-  std::condition_variable tracker_cond_;
-  std::vector<std::pair<int, int>> tracker_;
+  std::vector<Tracker> tracker_;
+  /** \brief the timestamp of the next request */
+  int next_timestamp_ = 0;
 
   DISALLOW_COPY_AND_ASSIGN(Customer);
 };
@@ -0,0 +1,120 @@
+/**
+ *  Copyright (c) 2015 by Contributors
+ * \file   key_dedup.h
+ * \brief  find the distinct keys of a key list with duplicates
+ */
+#ifndef PS_INTERNAL_KEY_DEDUP_H_
+#define PS_INTERNAL_KEY_DEDUP_H_
+#include <algorithm>
+#include <array>
+#include <cstring>
+#include <functional>
+#include <limits>
+#include <thread>
+#include <vector>
+#include "ps/base.h"
+
+namespace ps {
+
+/** \brief the default max number of keys counted by one thread */
+static const size_t kDedupGrainSize = 1 << 18;
+
+/**
+ * \brief sort keys by a least significant digit radix sort, moving the ids
+ * along with them
+ *
+ * The sort is stable and uses 8-bit digits. A digit shared by all keys is
+ * skipped, so ids packed at the low end of the key space take few passes.
+ * Key lists above the grainsize are counted and scattered by several threads.
+ *
+ * \param keys n keys, sorted in place
+ * \param ids n ids, moved along with the keys
+ * \param grainsize max number of keys counted by one thread
+ */
+inline void RadixSortKeys(Key* keys, uint32_t* ids, size_t n,
+                          size_t grainsize = kDedupGrainSize) {
+  if (n < 2) return;
+  // hardware_concurrency() reads sysfs, so ask only once
+  static const size_t max_threads = std::max(1u, std::thread::hardware_concurrency());
+  const size_t num_threads = std::min(max_threads, n / grainsize + 1);
+  auto run = [num_threads](const std::function<void(size_t)>& f) {
+    std::vector<std::thread> threads;
+    for (size_t t = 1; t < num_threads; ++t) threads.emplace_back(f, t);
+    f(0);
+    for (auto& thr : threads) thr.join();
+  };
+
+  Key diff = 0;
+  for (size_t i = 1; i < n; ++i) diff |= keys[i] ^ keys[0];
+  std::vector<Key> key_buf(n);
+  std::vector<uint32_t> id_buf(n);
+  Key* src_keys = keys;
+  uint32_t* src_ids = ids;
+  Key* dst_keys = key_buf.data();
+  uint32_t* dst_ids = id_buf.data();
+  // counts[t][d] is the number of keys with digit d among the keys of thread t,
+  // then where thread t puts the next of them
+  std::vector<std::array<size_t, 256>> counts(num_threads);
+  for (int shift = 0; shift < 64; shift += 8) {
+    if (((diff >> shift) & 0xff) == 0) continue;
+    run([&](size_t t) {
+      size_t begin = n / num_threads * t;
+      size_t end = t + 1 == num_threads ? n : n / num_threads * (t + 1);
+      auto& count = counts[t];
+      count.fill(0);
+      for (size_t i = begin; i < end; ++i) ++count[(src_keys[i] >> shift) & 0xff];
+    });
+    // digit by digit, then thread by thread, so that the sort stays stable
+    size_t offset = 0;
+    for (size_t d = 0; d < 256; ++d) {
+      for (size_t t = 0; t < num_threads; ++t) {
+        size_t count = counts[t][d];
+        counts[t][d] = offset;
+        offset += count;
+      }
+    }
+    run([&](size_t t) {
+      size_t begin = n / num_threads * t;
+      size_t end = t + 1 == num_threads ? n : n / num_threads * (t + 1);
+      auto& pos = counts[t];
+      for (size_t i = begin; i < end; ++i) {
+        size_t j = pos[(src_keys[i] >> shift) & 0xff]++;
+        dst_keys[j] = src_keys[i];
+        dst_ids[j] = src_ids[i];
+      }
+    });
+    std::swap(src_keys, dst_keys);
+    std::swap(src_ids, dst_ids);
+  }
+  if (src_keys != keys) {
+    memcpy(keys, src_keys, n * sizeof(Key));
+    memcpy(ids, src_ids, n * sizeof(uint32_t));
+  }
+}
+
+/**
+ * \brief find the distinct keys of a key list
+ *
+ * \param keys n keys in any order, possibly with duplicates
+ * \param unique at least n entries, filled with the distinct keys in
+ * increasing order
+ * \param index n entries, keys[i] == unique[index[i]]
+ * \return the number of distinct keys
+ */
+inline size_t DedupKeys(const Key* keys, size_t n, Key* unique, uint32_t* index) {
+  CHECK_LE(n, std::numeric_limits<uint32_t>::max());
+  if (n == 0) return 0;
+  std::vector<uint32_t> ids(n);
+  for (size_t i = 0; i < n; ++i) ids[i] = i;
+  memcpy(unique, keys, n * sizeof(Key));
+  RadixSortKeys(unique, ids.data(), n);
+  size_t num = 0;
+  for (size_t j = 0; j < n; ++j) {
+    if (j == 0 || unique[j] != unique[num - 1]) unique[num++] = unique[j];
+    index[ids[j]] = num - 1;
+  }
+  return num;
+}
+
+}  // namespace ps
+#endif  // PS_INTERNAL_KEY_DEDUP_H_
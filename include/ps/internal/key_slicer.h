@@ -0,0 +1,353 @@
+/**
+ *  Copyright (c) 2015 by Contributors
+ * \file   key_slicer.h
+ * \brief  partitioning a sorted key list by the server key ranges
+ */
+#ifndef PS_INTERNAL_KEY_SLICER_H_
+#define PS_INTERNAL_KEY_SLICER_H_
+#include <algorithm>
+#include <cstring>
+#include <limits>
+#include <numeric>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+#include "ps/base.h"
+#include "ps/range.h"
+
+namespace ps {
+
+/**
+ * \brief an immutable boundary table of the server key ranges
+ *
+ * Server i owns the keys in [bound(i), bound(i+1)). The table is built once
+ * when the key ranges are known, so slicing a request does not need to touch
+ * or check the ranges again.
+ */
+class KeySlicer {
+ public:
+  /**
+   * \param ranges the key ranges of the servers, must be contiguous
+   */
+  explicit KeySlicer(const std::vector<Range>& ranges) {
+    bounds_.reserve(ranges.size() + 1);
+    for (size_t i = 0; i < ranges.size(); ++i) {
+      if (i) CHECK_EQ(ranges[i-1].end(), ranges[i].begin());
+      bounds_.push_back(ranges[i].begin());
+    }
+    bounds_.push_back(ranges.empty() ? 0 : ranges.back().end());
+  }
+
+  /** \brief the number of servers */
+  size_t num_servers() const { return bounds_.size() - 1; }
+
+  /** \brief the first key of server i, or the end of the last range */
+  Key bound(size_t i) const { return bounds_[i]; }
+
+  /**
+   * \brief find the keys of every server
+   *
+   * \param keys the keys, sorted in increasing order
+   * \param n the number of keys
+   * \param pos num_servers()+1 entries. the keys of server i are
+   * [pos[i], pos[i+1])
+   */
+  void FindKeyPositions(const Key* keys, size_t n, size_t* pos) const {
+    pos[0] = LowerBound(keys, 0, n, bounds_[0]);
+    pos[num_servers()] = LowerBound(keys, pos[0], n, bounds_.back());
+    FindKeyPositions(keys, 1, num_servers(), pos);
+  }
+
+  /**
+   * \brief find the values of every server
+   *
+   * Key lists above the grainsize are summed by several threads.
+   *
+   * \param lens the value length of every key
+   * \param pos the key positions returned by \ref FindKeyPositions
+   * \param val_pos num_servers()+1 entries. the values of server i are
+   * [val_pos[i], val_pos[i+1])
+   * \param grainsize max number of keys summed by one thread
+   */
+  void FindValuePositions(const int* lens, const size_t* pos, size_t* val_pos,
+                          size_t grainsize = kSliceGrainSize) const {
+    const size_t num = num_servers();
+    const size_t n = pos[num];
+    // hardware_concurrency() reads sysfs, so ask only once
+    static const size_t max_threads = std::max(1u, std::thread::hardware_concurrency());
+    size_t num_threads = std::min(max_threads, n / grainsize + 1);
+    if (num_threads == 1) {
+      val_pos[0] = std::accumulate(lens, lens + pos[0], size_t(0));
+      for (size_t i = 0; i < num; ++i) {
+        val_pos[i + 1] = std::accumulate(lens + pos[i], lens + pos[i + 1], val_pos[i]);
+      }
+      return;
+    }
+
+    // sums[t][i] is the length of server i's values within the keys of thread t
+    std::vector<std::vector<size_t>> sums(num_threads, std::vector<size_t>(num + 1, 0));
+    auto sum = [lens, pos, num, n, num_threads, &sums](size_t t) {
+      size_t begin = n / num_threads * t;
+      size_t end = t + 1 == num_threads ? n : n / num_threads * (t + 1);
+      // the server owning key begin, sums[t][num] holds the keys before pos[0]
+      size_t i = std::upper_bound(pos, pos + num + 1, begin) - pos;
+      while (begin < end) {
+        size_t stop = std::min(end, i <= num ? pos[i] : n);
+        sums[t][i == 0 ? num : i - 1] += std::accumulate(lens + begin, lens + stop, size_t(0));
+        begin = stop;
+        ++i;
+      }
+    };
+    std::vector<std::thread> threads;
+    for (size_t t = 1; t < num_threads; ++t) threads.emplace_back(sum, t);
+    sum(0);
+    for (auto& thr : threads) thr.join();
+
+    val_pos[0] = 0;
+    for (size_t t = 0; t < num_threads; ++t) val_pos[0] += sums[t][num];
+    for (size_t i = 0; i < num; ++i) {
+      size_t len = 0;
+      for (size_t t = 0; t < num_threads; ++t) len += sums[t][i];
+      val_pos[i + 1] = val_pos[i] + len;
+    }
+  }
+
+  /** \brief the default max number of keys summed by one thread */
+  static const size_t kSliceGrainSize = 1 << 20;
+
+ private:
+  /** \brief the first position in [lo, hi) whose key is not less than bound */
+  static size_t LowerBound(const Key* keys, size_t lo, size_t hi, Key bound) {
+    if (lo == hi) return lo;
+    // branchless binary search, the compiler turns the select into a cmov
+    const Key* base = keys + lo;
+    size_t len = hi - lo;
+    while (len > 1) {
+      size_t half = len / 2;
+      // both candidates of the next step, a mispredicted branch would have
+      // loaded one of them speculatively
+      __builtin_prefetch(base + half / 2);
+      __builtin_prefetch(base + half + half / 2);
+      base = base[half] < bound ? base + half : base;
+      len -= half;
+    }
+    return (base - keys) + (*base < bound);
+  }
+
+  /**
+   * \brief find pos[first, last) given pos[first-1] and pos[last]
+   *
+   * The middle boundary is searched first, so every search is confined to
+   * the keys between two known positions, and servers without keys cost
+   * nothing.
+   */
+  void FindKeyPositions(const Key* keys, size_t first, size_t last, size_t* pos) const {
+    if (first >= last) return;
+    size_t lo = pos[first - 1], hi = pos[last];
+    if (lo == hi) {
+      std::fill(pos + first, pos + last, lo);
+      return;
+    }
+    size_t mid = (first + last) / 2;
+    pos[mid] = LowerBound(keys, lo, hi, bounds_[mid]);
+    FindKeyPositions(keys, first, mid, pos);
+    FindKeyPositions(keys, mid + 1, last, pos);
+  }
+
+  std::vector<Key> bounds_;
+};
+
+/**
+ * \brief a version of the server key ranges with its boundary table, never
+ * changed once installed
+ */
+struct KeyRangeTable {
+  KeyRangeTable(const std::vector<Range>& ranges, int version)
+      : ranges(ranges), slicer(ranges), version(version) {}
+  std::vector<Range> ranges;
+  KeySlicer slicer;
+  /** \brief 0 for the default ranges, increased by every change */
+  int version;
+};
+
+/** \brief max number of (key, weight) samples a node sends to the scheduler */
+const size_t kMaxKeyLoadSamples = 1 << 16;
+
+/**
+ * \brief split [0, kMaxKey) into ranges carrying about the same load
+ *
+ * Every boundary is placed at the key where the accumulated load crosses the
+ * next equal share, so a key is never split and a key heavier than a share
+ * makes its server hotter than the others.
+ *
+ * \param load (key, weight) samples of the key space, such as the bytes sent
+ * to every key. they need not be sorted or unique
+ * \param num_servers the number of ranges
+ * \return the ranges, which are the default equal-sized ones if the load is
+ * empty
+ */
+inline std::vector<Range> WeightedKeyRanges(std::vector<std::pair<Key, uint64_t>> load,
+                                            int num_servers) {
+  CHECK_GT(num_servers, 0);
+  std::sort(load.begin(), load.end());
+  size_t size = 0;
+  for (size_t i = 0; i < load.size(); ++i) {
+    if (size && load[size - 1].first == load[i].first) {
+      load[size - 1].second += load[i].second;
+    } else {
+      load[size++] = load[i];
+    }
+  }
+  load.resize(size);
+  double total = 0;
+  for (const auto& l : load) total += l.second;
+
+  std::vector<Key> bounds(1, 0);
+  size_t j = 0;
+  double sum = 0;
+  for (int i = 1; i < num_servers; ++i) {
+    Key bound = kMaxKey / num_servers * i;
+    if (total > 0) {
+      double target = total * i / num_servers;
+      while (j < load.size() && sum + load[j].second <= target) sum += load[j++].second;
+      if (j == load.size()) {
+        bound = load.back().first + 1;
+      } else if (target - sum > sum + load[j].second - target) {
+        // the key crossing the share is closer to it if kept on the left
+        sum += load[j].second;
+        bound = load[j++].first + 1;
+      } else {
+        bound = load[j].first;
+      }
+    }
+    // every server owns at least one key
+    bound = std::max(bound, bounds.back() + 1);
+    bound = std::min(bound, kMaxKey - (num_servers - i));
+    bounds.push_back(bound);
+  }
+  bounds.push_back(total > 0 ? kMaxKey : kMaxKey / num_servers * num_servers);
+
+  std::vector<Range> ranges;
+  for (int i = 0; i < num_servers; ++i) ranges.push_back(Range(bounds[i], bounds[i+1]));
+  return ranges;
+}
+
+/**
+ * \brief merge neighbouring samples until about max_size of them are left
+ *
+ * The weight of a bucket of merged samples is put on its first key, so
+ * \ref WeightedKeyRanges places a boundary at most one bucket away from
+ * where it would with all samples.
+ */
+inline std::vector<std::pair<Key, uint64_t>> CompactKeyLoad(
+    std::vector<std::pair<Key, uint64_t>> load, size_t max_size) {
+  if (load.size() <= max_size) return load;
+  std::sort(load.begin(), load.end());
+  double total = 0;
+  for (const auto& l : load) total += l.second;
+  const double bucket = total / max_size;
+  std::vector<std::pair<Key, uint64_t>> compact;
+  double sum = 0;
+  for (const auto& l : load) {
+    if (compact.empty() || (sum >= bucket && compact.back().first != l.first)) {
+      compact.push_back(l);
+      sum = l.second;
+    } else {
+      compact.back().second += l.second;
+      sum += l.second;
+    }
+  }
+  return compact;
+}
+
+/**
+ * \brief the server of a key when keys are routed by hash
+ *
+ * The key is mixed by the finalizer of splitmix64, then mapped to
+ * [0, num_servers) by a multiply-shift instead of a modulo.
+ */
+inline size_t HashKeyToServer(Key key, size_t num_servers) {
+  uint64_t h = key;
+  h = (h ^ (h >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  h = (h ^ (h >> 27)) * 0x94d049bb133111ebULL;
+  h ^= h >> 31;
+  return static_cast<size_t>((static_cast<unsigned __int128>(h) * num_servers) >> 64);
+}
+
+/**
+ * \brief group keys by their server with a counting sort on \ref HashKeyToServer
+ *
+ * Two linear passes, the first counts the keys of every server and the
+ * second scatters them. Keys of a server keep their relative order, and
+ * neither the order nor the uniqueness of the keys matters.
+ *
+ * \param keys the keys, in any order
+ * \param n the number of keys
+ * \param num_servers the number of servers
+ * \param offsets num_servers+1 entries. the keys of server i are
+ * [offsets[i], offsets[i+1]) of the scattered keys
+ * \param perm n entries. perm[j] is the position in keys of the j-th
+ * scattered key, so a value pulled for it goes back to perm[j]
+ * \param scattered n entries, the scattered keys
+ */
+inline void HashScatterKeys(const Key* keys, size_t n, size_t num_servers,
+                            size_t* offsets, uint32_t* perm, Key* scattered) {
+  CHECK_LE(n, static_cast<size_t>(std::numeric_limits<uint32_t>::max()));
+  std::vector<uint32_t> server(n);
+  std::fill(offsets, offsets + num_servers + 1, 0);
+  for (size_t i = 0; i < n; ++i) {
+    server[i] = HashKeyToServer(keys[i], num_servers);
+    ++offsets[server[i] + 1];
+  }
+  for (size_t i = 0; i < num_servers; ++i) offsets[i + 1] += offsets[i];
+  std::vector<size_t> next(offsets, offsets + num_servers);
+  for (size_t i = 0; i < n; ++i) {
+    size_t j = next[server[i]]++;
+    perm[j] = i;
+    scattered[j] = keys[i];
+  }
+}
+
+/** \brief serialize (key, weight) samples into a message body */
+inline std::string EncodeKeyLoad(const std::vector<std::pair<Key, uint64_t>>& load) {
+  std::string body(load.size() * 2 * sizeof(uint64_t), '\0');
+  char* p = &body[0];
+  for (const auto& l : load) {
+    memcpy(p, &l.first, sizeof(uint64_t));
+    memcpy(p + sizeof(uint64_t), &l.second, sizeof(uint64_t));
+    p += 2 * sizeof(uint64_t);
+  }
+  return body;
+}
+
+/** \brief append the samples serialized by \ref EncodeKeyLoad to load */
+inline void DecodeKeyLoad(const std::string& body,
+                          std::vector<std::pair<Key, uint64_t>>* load) {
+  CHECK_EQ(body.size() % (2 * sizeof(uint64_t)), 0U);
+  for (size_t i = 0; i < body.size(); i += 2 * sizeof(uint64_t)) {
+    std::pair<Key, uint64_t> l;
+    memcpy(&l.first, body.data() + i, sizeof(uint64_t));
+    memcpy(&l.second, body.data() + i + sizeof(uint64_t), sizeof(uint64_t));
+    load->push_back(l);
+  }
+}
+
+/** \brief serialize key ranges into a message body */
+inline std::string EncodeKeyRanges(const std::vector<Range>& ranges) {
+  std::vector<std::pair<Key, uint64_t>> pairs;
+  for (const auto& r : ranges) pairs.emplace_back(r.begin(), r.end());
+  return EncodeKeyLoad(pairs);
+}
+
+/** \brief deserialize the ranges serialized by \ref EncodeKeyRanges */
+inline std::vector<Range> DecodeKeyRanges(const std::string& body) {
+  std::vector<std::pair<Key, uint64_t>> pairs;
+  DecodeKeyLoad(body, &pairs);
+  std::vector<Range> ranges;
+  for (const auto& p : pairs) ranges.push_back(Range(p.first, p.second));
+  return ranges;
+}
+
+}  // namespace ps
+#endif  // PS_INTERNAL_KEY_SLICER_H_
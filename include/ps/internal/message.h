@@ -146,7 +146,7 @@ struct Control {
     if (empty()) return "";
     std::vector<std::string> cmds = {
       "EMPTY", "TERMINATE", "ADD_NODE", "BARRIER", "ACK", "HEARTBEAT", "BOOTSTRAP", "ADDR_REQUEST",
-      "ADDR_RESOLVED", "INSTANCE_BARRIER"
+      "ADDR_RESOLVED", "INSTANCE_BARRIER", "KEY_RANGES", "REBALANCE", "KEY_LOAD", "MIGRATE"
     };
     std::stringstream ss;
     ss << "cmd=" << cmds[cmd];
@@ -161,7 +161,7 @@ struct Control {
   }
   /** \brief all commands */
   enum Command { EMPTY, TERMINATE, ADD_NODE, BARRIER, ACK, HEARTBEAT, BOOTSTRAP, ADDR_REQUEST,
-                 ADDR_RESOLVED, INSTANCE_BARRIER};
+                 ADDR_RESOLVED, INSTANCE_BARRIER, KEY_RANGES, REBALANCE, KEY_LOAD, MIGRATE};
   /** \brief the command */
   Command cmd;
   /** \brief node infos */
@@ -199,6 +199,11 @@ struct Meta {
          << ", simple_app=" << simple_app
          << ", push=" << push
          << ", sid=" << sid;
+      if (key_range_version) ss << ", key_range_version=" << key_range_version;
+      if (batch) ss << ", batch=" << batch;
+      if (push_pull) ss << ", push_pull=" << push_pull;
+      if (clock) ss << ", clock=" << clock;
+      if (versioned) ss << ", versioned=" << versioned;
     }
     if (head != kEmpty) ss << ", head=" << head;
     if (control.empty() && !simple_app) ss << ", key=" << key; // valid data msg
@@ -246,16 +251,81 @@ struct Meta {
   /** \brief the byte size */
   int data_size = 0;
   /** \brief the key */
-  uint64_t key;
+  uint64_t key = 0;
   /** \brief the address */
   uint64_t addr = 0;
   /** \brief the value length */
-  int val_len;
+  int val_len = 0;
   /** \brief the optional 4-bytes field */
-  int option;
+  int option = 0;
   /** \brief the sequence id (used by ucx) */
+  int sid = 0;
+  /**
+   * \brief the version of the server key ranges a request was sliced by. a
+   * response with a nonzero version was rejected by a server already using
+   * that newer version
+   */
+  int key_range_version = 0;
+  /**
+   * \brief whether the data holds several requests or responses coalesced by
+   * \ref KVWorker::set_coalescing, described by a fourth array
+   */
+  bool batch = false;
+  /**
+   * \brief whether a push request wants the values after the push in its
+   * response, see \ref KVWorker::ZPushPull
+   */
+  bool push_pull = false;
+  /**
+   * \brief the iteration clock of the worker sending a request, see
+   * \ref KVWorker::Clock and \ref KVServer::set_staleness
+   */
+  int clock = 0;
+  /**
+   * \brief whether a pull carries the versions of the keys cached by the
+   * worker, and its response the versions of the values, see
+   * \ref KVWorker::CachedPull
+   */
+  bool versioned = false;
+};
+/**
+ * \brief a read-only view of a meta in the compact wire format. it points into
+ * the received buffer, so decoding it never allocates
+ */
+struct MetaView {
+  int head;
+  int app_id;
+  int customer_id;
+  int timestamp;
+  bool request;
+  bool push;
+  bool simple_app;
+  /** \brief the body, not null terminated */
+  const char* body;
+  int body_size;
+  /** \brief one byte per data type */
+  const uint8_t* data_type;
+  int data_type_size;
+  DeviceType src_dev_type;
+  int src_dev_id;
+  DeviceType dst_dev_type;
+  int dst_dev_id;
+  /** \brief the encoded control, nullptr if the control is empty */
+  const char* control;
+  int control_size;
+  int data_size;
+  uint64_t key;
+  uint64_t addr;
+  int val_len;
+  int option;
   int sid;
+  int key_range_version;
+  bool batch;
+  bool push_pull;
+  int clock;
+  bool versioned;
 };
+
 /**
  * \brief messages that communicated among nodes.
  */
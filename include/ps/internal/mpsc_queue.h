@@ -0,0 +1,271 @@
+/**
+ *  Copyright (c) 2015 by Contributors
+ * \file   mpsc_queue.h
+ * \brief  an unbounded lock-free queue with many producers and one consumer
+ */
+#ifndef PS_INTERNAL_MPSC_QUEUE_H_
+#define PS_INTERNAL_MPSC_QUEUE_H_
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <new>
+#include <thread>
+#include <type_traits>
+#include <utility>
+#include <vector>
+#ifdef __linux__
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+#include "ps/base.h"
+
+namespace ps {
+
+/**
+ * \brief an unbounded queue which many threads push to without locks, and one
+ * thread pops from
+ *
+ * The values live in segments of slots, which are linked as the queue grows.
+ * A push claims a slot with a single fetch_add on the tail word, which packs
+ * the tail segment with the next slot in it, constructs the value in the slot
+ * and marks it ready. The push finding the tail segment full links the next
+ * segment, every other one waits for the link without touching the full
+ * segment. Only the consumer frees a segment, once it popped all its slots
+ * and found the next one, so a producer always pushes to a live segment. The
+ * last segment freed is kept to be reused, so a queue in a steady state does
+ * not allocate.
+ *
+ * A consumer finding the queue empty spins for a while, then sleeps on a futex
+ * until the next push. Pushes skip the wakeup while the consumer is awake.
+ *
+ * The methods popping are not threadsafe. Consumers taking turns must
+ * serialize them, as \ref ThreadsafeQueue does.
+ */
+template <typename T>
+class MPSCQueue {
+ public:
+  MPSCQueue() {
+    head_ = NewSegment();
+    tail_.store(Pack(head_, 0));
+  }
+
+  ~MPSCQueue() {
+    // the values which were not popped
+    while (Slot* slot = HeadSlot()) {
+      if (!slot->ready.load(std::memory_order_acquire)) break;
+      slot->get()->~T();
+      ++head_idx_;
+    }
+    delete head_;
+    delete spare_.load();
+  }
+
+  /**
+   * \brief push a value to the tail. threadsafe
+   */
+  template <typename V>
+  void Push(V&& value) {
+    while (true) {
+      uint64_t tail = tail_.fetch_add(1, std::memory_order_acq_rel);
+      Segment* seg = SegmentOf(tail);
+      uint64_t idx = IndexOf(tail);
+      if (idx < kSegmentSize) {
+        Publish(&seg->slots[idx], std::forward<V>(value));
+        return;
+      }
+      if (idx == kSegmentSize) {
+        // link the next segment, and take its first slot. seg stays alive
+        // until the consumer finds the link
+        Segment* next = spare_.exchange(nullptr, std::memory_order_acq_rel);
+        if (!next) next = NewSegment();
+        new (&next->slots[0].value) T(std::forward<V>(value));
+        next->slots[0].ready.store(true, std::memory_order_relaxed);
+        seg->next.store(next);
+        tail_first_.store(tail_first_.load(std::memory_order_relaxed) + kSegmentSize,
+                          std::memory_order_relaxed);
+        tail_.store(Pack(next, 1), std::memory_order_release);
+        Wake();
+        return;
+      }
+      // a segment at the same address may already be reused, with free slots
+      for (int spin = 0; ; ++spin) {
+        uint64_t now = tail_.load(std::memory_order_acquire);
+        if (SegmentOf(now) != seg || IndexOf(now) < kSegmentSize) break;
+        if (spin > 64) std::this_thread::yield();
+      }
+    }
+  }
+
+  /**
+   * \brief pop the head value if there is one
+   * \return false if the queue is empty
+   */
+  bool TryPop(T* value) {
+    Slot* slot = HeadSlot();
+    if (!slot || !slot->ready.load(std::memory_order_acquire)) return false;
+    *value = std::move(*slot->get());
+    slot->get()->~T();
+    slot->ready.store(false, std::memory_order_relaxed);
+    ++head_idx_;
+    popped_.store(popped_.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+    return true;
+  }
+
+  /**
+   * \brief wait until the queue is not empty, then pop the head value
+   * \param spin how long to spin before sleeping
+   */
+  void WaitAndPop(T* value, std::chrono::nanoseconds spin) {
+    while (!TryPop(value)) Wait(spin);
+  }
+
+  /**
+   * \brief wait until the queue is not empty, then pop all its values
+   * \param values the poped values are appended to it
+   * \param spin how long to spin before sleeping
+   */
+  void PopBatch(std::vector<T>* values, std::chrono::nanoseconds spin) {
+    T value;
+    WaitAndPop(&value, spin);
+    values->push_back(std::move(value));
+    while (TryPop(&value)) values->push_back(std::move(value));
+  }
+
+  /**
+   * \brief the number of values pushed and not popped, including the ones
+   * still being pushed. threadsafe, but only a snapshot
+   */
+  size_t Size() const {
+    while (true) {
+      uint64_t tail = tail_.load(std::memory_order_acquire);
+      if (IndexOf(tail) > kSegmentSize) {
+        // the next segment is being linked
+        std::this_thread::yield();
+        continue;
+      }
+      uint64_t first = tail_first_.load(std::memory_order_acquire);
+      if (SegmentOf(tail_.load(std::memory_order_acquire)) != SegmentOf(tail)) continue;
+      uint64_t pushed = first + IndexOf(tail);
+      uint64_t popped = popped_.load(std::memory_order_relaxed);
+      return pushed > popped ? pushed - popped : 0;
+    }
+  }
+
+ private:
+  struct Slot {
+    std::atomic<bool> ready{false};
+    typename std::aligned_storage<sizeof(T), alignof(T)>::type value;
+    T* get() { return reinterpret_cast<T*>(&value); }
+  };
+  /** \brief about 64KB of slots, at least 16 */
+  static constexpr uint64_t kSegmentSize =
+      std::max<uint64_t>(16, (1 << 16) / sizeof(Slot));
+  struct Segment {
+    Slot slots[kSegmentSize];
+    std::atomic<Segment*> next{nullptr};
+  };
+
+  // the tail word is the segment address shifted over the slot index, which
+  // leaves room for as many pushes as there are threads past the last slot
+  static_assert(sizeof(void*) == 8, "the tail word packs a 48-bit address");
+  static_assert(kSegmentSize < (1 << 15), "the slot index takes 16 bits");
+  static uint64_t Pack(Segment* seg, uint64_t idx) {
+    return (reinterpret_cast<uint64_t>(seg) << 16) | idx;
+  }
+  static Segment* SegmentOf(uint64_t tail) { return reinterpret_cast<Segment*>(tail >> 16); }
+  static uint64_t IndexOf(uint64_t tail) { return tail & 0xffff; }
+
+  static Segment* NewSegment() {
+    Segment* seg = new Segment();
+    CHECK_EQ(reinterpret_cast<uint64_t>(seg) >> 48, 0U) << "address above 48 bits";
+    return seg;
+  }
+
+  template <typename V>
+  void Publish(Slot* slot, V&& value) {
+    new (&slot->value) T(std::forward<V>(value));
+    // seq_cst, so that either the consumer going to sleep sees the value, or
+    // Wake sees the consumer asleep
+    slot->ready.store(true);
+    Wake();
+  }
+
+  /** \brief the slot of the head value, nullptr if the next segment is not
+   * linked yet */
+  Slot* HeadSlot() {
+    if (head_idx_ == kSegmentSize) {
+      Segment* next = head_->next.load();
+      if (!next) return nullptr;
+      Segment* done = head_;
+      head_ = next;
+      head_idx_ = 0;
+      done->next.store(nullptr, std::memory_order_relaxed);
+      delete spare_.exchange(done, std::memory_order_acq_rel);
+    }
+    return &head_->slots[head_idx_];
+  }
+
+  bool HeadReady() {
+    Slot* slot = HeadSlot();
+    return slot && slot->ready.load();
+  }
+
+  /** \brief spin, then sleep until a value is pushed */
+  void Wait(std::chrono::nanoseconds spin) {
+    auto deadline = std::chrono::steady_clock::now() + spin;
+    while (!HeadReady()) {
+      if (std::chrono::steady_clock::now() < deadline) {
+        std::this_thread::yield();
+        continue;
+      }
+      sleeping_.store(1);
+      if (HeadReady()) {
+        sleeping_.store(0, std::memory_order_relaxed);
+        return;
+      }
+#ifdef __linux__
+      syscall(SYS_futex, reinterpret_cast<int*>(&sleeping_), FUTEX_WAIT_PRIVATE, 1,
+              nullptr, nullptr, 0);
+#else
+      std::this_thread::sleep_for(std::chrono::microseconds(50));
+#endif
+    }
+  }
+
+  void Wake() {
+    if (sleeping_.load() && sleeping_.exchange(0)) {
+#ifdef __linux__
+      syscall(SYS_futex, reinterpret_cast<int*>(&sleeping_), FUTEX_WAKE_PRIVATE, 1,
+              nullptr, nullptr, 0);
+#endif
+    }
+  }
+
+  // the fields written by producers, by the consumer and by both are kept apart
+  // by padding rather than alignas, as queues are also allocated by new
+  char pad0_[64];
+  /** \brief the tail word, see Pack */
+  std::atomic<uint64_t> tail_;
+  /** \brief the number of slots before the tail segment */
+  std::atomic<uint64_t> tail_first_{0};
+  /** \brief a segment popped empty, to be reused */
+  std::atomic<Segment*> spare_{nullptr};
+  char pad1_[64];
+  /** \brief 1 while the consumer sleeps on it */
+  std::atomic<int> sleeping_{0};
+  static_assert(sizeof(std::atomic<int>) == sizeof(int), "futex word");
+  char pad2_[64];
+  /** \brief the consumer's position, and the number of values popped */
+  Segment* head_;
+  uint64_t head_idx_ = 0;
+  std::atomic<uint64_t> popped_{0};
+  char pad3_[64];
+};
+
+template <typename T>
+constexpr uint64_t MPSCQueue<T>::kSegmentSize;
+
+}  // namespace ps
+#endif  // PS_INTERNAL_MPSC_QUEUE_H_
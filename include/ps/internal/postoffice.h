@@ -4,11 +4,14 @@
 #ifndef PS_INTERNAL_POSTOFFICE_H_
 #define PS_INTERNAL_POSTOFFICE_H_
 #include <mutex>
+#include <atomic>
 #include <algorithm>
+#include <memory>
 #include <vector>
 #include "ps/range.h"
 #include "ps/internal/env.h"
 #include "ps/internal/customer.h"
+#include "ps/internal/key_slicer.h"
 #include "ps/internal/van.h"
 namespace ps {
 
@@ -91,6 +94,9 @@ class Postoffice {
   void RemoveCustomer(Customer* customer);
   /**
    * \brief get the customer by id, threadsafe
+   *
+   * customers with small ids are resolved without lock and allocation, which
+   * is the case for every data message received by the van
    * \param app_id the application id
    * \param customer_id the customer id
    * \param timeout timeout in sec
@@ -112,6 +118,59 @@ class Postoffice {
    * \brief return the key ranges of all server GROUP nodes
    */
   const std::vector<Range>& GetServerKeyRanges();
+  /**
+   * \brief return the boundary table of \ref GetServerKeyRanges, used to
+   * slice the requests of a worker
+   */
+  const KeySlicer& GetServerKeySlicer();
+  /**
+   * \brief return the current key ranges with their boundary table and version
+   */
+  const KeyRangeTable& GetKeyRangeTable();
+  /**
+   * \brief return the key ranges of a version installed on this node, nullptr
+   * if there is none. the table stays valid until \ref Finalize
+   */
+  const KeyRangeTable* GetKeyRangeTable(int version);
+  /**
+   * \brief replace the key ranges of the servers on this node
+   *
+   * Every node must install the same ranges before the first request, such
+   * as ranges built by \ref WeightedKeyRanges from a known key histogram.
+   * \param ranges num_servers() contiguous ranges
+   * \param version the version of the ranges, larger than the current one.
+   * 0 to take the next version of this node
+   */
+  void SetServerKeyRanges(const std::vector<Range>& ranges, int version = 0);
+  /**
+   * \brief block until the key ranges of this node have at least a version
+   */
+  void WaitKeyRangeVersion(int version);
+  /**
+   * \brief partition the key space by the load of the workers
+   *
+   * Every worker instance reports the load it expects, such as the bytes it
+   * will push to every key. The scheduler merges the reports, computes the
+   * ranges with \ref WeightedKeyRanges and sends them to all workers and
+   * servers. It blocks until the ranges of this node are installed, so it
+   * should be called before the first request.
+   * \param load (key, weight) samples of the key space
+   */
+  void PartitionServerKeyRanges(const std::vector<std::pair<Key, uint64_t>>& load);
+  /**
+   * \brief partition the key space again by the load the servers observed,
+   * moving the key-value pairs of an app to their new servers
+   *
+   * The scheduler collects the load of the servers, computes new ranges and
+   * sends them to the servers, which move the pairs with the handles of
+   * \ref KVServer::set_migrate_handle. Once every server holds its new pairs,
+   * the workers switch to the new ranges. Requests sliced by the old ranges
+   * meanwhile are rejected by the servers and resent by the workers. It
+   * blocks until the workers have the new ranges. Concurrent calls join the
+   * one in progress.
+   * \param app_id the app whose servers move their pairs
+   */
+  void RebalanceServerKeyRanges(int app_id);
   /**
    * \brief the template of a callback
    */
@@ -181,6 +240,13 @@ class Postoffice {
   static inline int ServerRankToID(int rank) {
     return rank * 2 + 8;
   }
+  /**
+   * \brief whether a node id is the id of a server
+   * \param id the node id
+   */
+  static inline bool IsServerID(int id) {
+    return id >= 8 && id % 2 == 0;
+  }
   /**
    * \brief convert from a node id into a server or worker rank
    * \param id the node id
@@ -287,9 +353,27 @@ class Postoffice {
   mutable std::mutex mu_;
   // app_id -> (customer_id -> customer pointer)
   std::unordered_map<int, std::unordered_map<int, Customer*>> customers_;
+  // a read-mostly copy of customers_ for small ids, indexed by
+  // [app_id][customer_id]. written under mu_, read without lock
+  static const int kMaxFastAppId = 32;
+  static const int kMaxFastCustomerId = 64;
+  static bool IsFastCustomer(int app_id, int customer_id) {
+    return app_id >= 0 && app_id < kMaxFastAppId &&
+           customer_id >= 0 && customer_id < kMaxFastCustomerId;
+  }
+  std::atomic<Customer*> fast_customers_[kMaxFastAppId][kMaxFastCustomerId];
   std::unordered_map<int, std::vector<int>> node_ids_;
+  /** \brief install a new key range table, called with server_key_ranges_mu_ held */
+  void InstallKeyRangeTable(const std::vector<Range>& ranges, int version);
   std::mutex server_key_ranges_mu_;
-  std::vector<Range> server_key_ranges_;
+  // the current table, read without lock. written under server_key_ranges_mu_
+  std::atomic<KeyRangeTable*> server_key_ranges_{nullptr};
+  // every installed table, a reader may still hold a reference to an old one
+  std::vector<std::unique_ptr<KeyRangeTable>> key_range_tables_;
+  // whether the ranges from the scheduler arrived, guarded by barrier_mu_
+  bool key_ranges_done_ = false;
+  // whether the rebalance requested by this node is done, guarded by barrier_mu_
+  bool rebalance_done_ = false;
   bool is_worker_, is_server_, is_scheduler_;
   int num_servers_, num_workers_, group_size_;
 
@@ -7,22 +7,29 @@
 #include <mutex>
 #include <condition_variable>
 #include <memory>
+#include <utility>
+#include <vector>
 #include "ps/base.h"
-#include "spsc_queue.h"
+#include "mpsc_queue.h"
 
 namespace ps {
 
 /**
  * \brief thread-safe queue allowing push and waited pop
+ *
+ * With DMLC_LOCKLESS_QUEUE=1 pushes take no lock, see \ref MPSCQueue. The
+ * consumers then spin for DMLC_POLLING_IN_NANOSECOND before sleeping, and
+ * take turns on a mutex, which costs nothing to the usual single consumer.
  */
 template<typename T> class ThreadsafeQueue {
  public:
-  ThreadsafeQueue() : lockless_queue_(32768) {
+  ThreadsafeQueue() {
     auto lockless_str = getenv("DMLC_LOCKLESS_QUEUE");
     lockless_ = lockless_str ? atoi(lockless_str) : false;
     auto polling_str = getenv("DMLC_POLLING_IN_NANOSECOND");
     int polling_duration_int = polling_str ? atoi(polling_str) : 1000;
     polling_duration_ = std::chrono::nanoseconds(polling_duration_int);
+    if (lockless_) lockless_queue_.reset(new MPSCQueue<T>());
   }
 
   ~ThreadsafeQueue() { }
@@ -31,15 +38,32 @@ template<typename T> class ThreadsafeQueue {
    * \brief push an value into the end. threadsafe.
    * \param new_value the value
    */
-  void Push(T new_value) {
+  void Push(const T& new_value) {
     if (lockless_) {
-      PushLockless(std::move(new_value));
+      lockless_queue_->Push(new_value);
+      return;
+    }
+    mu_.lock();
+    queue_.push(new_value);
+    bool waiting = waiting_ > 0;
+    mu_.unlock();
+    if (waiting) cond_.notify_one();
+  }
+
+  /**
+   * \brief move an value into the end. threadsafe.
+   * \param new_value the value
+   */
+  void Push(T&& new_value) {
+    if (lockless_) {
+      lockless_queue_->Push(std::move(new_value));
       return;
     }
     mu_.lock();
     queue_.push(std::move(new_value));
+    bool waiting = waiting_ > 0;
     mu_.unlock();
-    cond_.notify_all();
+    if (waiting) cond_.notify_one();
   }
 
   /**
@@ -48,58 +72,53 @@ template<typename T> class ThreadsafeQueue {
    */
   void WaitAndPop(T* value) {
     if (lockless_) {
-      WaitAndPopLockless(value);
+      std::lock_guard<std::mutex> lk(read_mu_);
+      lockless_queue_->WaitAndPop(value, polling_duration_);
       return;
     }
     std::unique_lock<std::mutex> lk(mu_);
-    cond_.wait(lk, [this]{return !queue_.empty();});
+    Wait(&lk);
     *value = std::move(queue_.front());
     queue_.pop();
   }
 
+  /**
+   * \brief wait until the queue is not empty, then pop all its elements.
+   * threadsafe
+   * \param values the poped values are appended to it
+   */
+  void PopBatch(std::vector<T>* values) {
+    if (lockless_) {
+      std::lock_guard<std::mutex> lk(read_mu_);
+      lockless_queue_->PopBatch(values, polling_duration_);
+      return;
+    }
+    std::unique_lock<std::mutex> lk(mu_);
+    Wait(&lk);
+    while (!queue_.empty()) {
+      values->push_back(std::move(queue_.front()));
+      queue_.pop();
+    }
+  }
+
   /**
    * \brief peek queue size
    */
   int Size() {
     if (lockless_) {
-      return SizeLockless();
+      return lockless_queue_->Size();
     }
     std::unique_lock<std::mutex> lk(mu_);
     return queue_.size();
   }
 
  private:
-
-  // lockless impl
-  void PushLockless(T new_value) {
-    write_mu_.lock();
-    lockless_queue_.push(std::move(new_value));
-    write_mu_.unlock();
-  }
-
-  void WaitAndPopLockless(T* value) {
-    auto t = std::chrono::high_resolution_clock::now() + polling_duration_;
-    for (;;) {
-      read_mu_.lock();
-      if (lockless_queue_.front()) {
-        *value = *(lockless_queue_.front());
-        lockless_queue_.pop();
-        read_mu_.unlock();
-        break;
-      }
-      read_mu_.unlock();
-      if (std::chrono::high_resolution_clock::now() < t) {
-        std::this_thread::yield();
-      } else {
-        std::this_thread::sleep_for(std::chrono::microseconds(1));
-      }
-    }
-  }
-
-  int SizeLockless() {
-    std::unique_lock<std::mutex> lk_read(read_mu_);
-    std::unique_lock<std::mutex> lk_write(write_mu_);
-    return lockless_queue_.size();
+  // the cv implementation counts the consumers waiting, so that pushes only
+  // notify when one does
+  void Wait(std::unique_lock<std::mutex>* lk) {
+    ++waiting_;
+    cond_.wait(*lk, [this]{return !queue_.empty();});
+    --waiting_;
   }
 
   bool lockless_;
@@ -108,11 +127,11 @@ template<typename T> class ThreadsafeQueue {
   mutable std::mutex mu_;
   std::queue<T> queue_;
   std::condition_variable cond_;
+  int waiting_ = 0;
 
   // lockless implementation
   mutable std::mutex read_mu_;
-  mutable std::mutex write_mu_;
-  rigtorp::SPSCQueue<T> lockless_queue_;
+  std::unique_ptr<MPSCQueue<T>> lockless_queue_;
   std::chrono::nanoseconds polling_duration_;
 
 };
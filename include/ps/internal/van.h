@@ -15,6 +15,7 @@
 #include <vector>
 #include "ps/base.h"
 #include "ps/internal/message.h"
+#include "ps/internal/threadsafe_queue.h"
 namespace ps {
 class Resender;
 class Postoffice;
@@ -105,6 +106,26 @@ class Van {
    */
   virtual int RecvMsg(Message *msg) = 0;
 
+  /**
+   * \brief block until received a message, like RecvMsg, but the van may leave
+   * the meta of a data message packed, to be decoded by DecodeMsg on a thread
+   * of PS_RECV_THREADS. The sender, recver, app_id and customer_id of a packed
+   * message are set, the rest of its meta is empty
+   * \param packed set to whether the meta was left packed
+   * \return the number of bytes received. -1 if failed or timeout
+   */
+  virtual int RecvPackedMsg(Message *msg, bool *packed) {
+    *packed = false;
+    return RecvMsg(msg);
+  }
+
+  /**
+   * \brief decode a message left packed by RecvPackedMsg
+   */
+  virtual void DecodeMsg(Message *msg) {
+    LOG(FATAL) << GetType() << " does not leave messages packed";
+  }
+
   /**
    * \brief send a mesage
    * \return the number of bytes sent
@@ -155,6 +176,45 @@ class Van {
    */
   void UnpackMeta(const char *meta_buf, int buf_size, Meta *meta);
 
+  /**
+   * \brief upper bound of the compact encoding size of meta
+   */
+  int GetCompactMetaMaxLen(const Meta &meta);
+
+  /**
+   * \brief encode meta in the compact format: a version byte, flags,
+   * presence bits and varints for the fields that are set.
+   * \param meta_buf must hold at least GetCompactMetaMaxLen(meta) bytes
+   * \return the encoded size
+   */
+  int PackCompactMeta(const Meta &meta, char *meta_buf);
+
+  /**
+   * \brief encode meta in the compact format into a thread-local buffer,
+   * which is valid until the next call on the same thread
+   */
+  const char *PackCompactMeta(const Meta &meta, int *buf_size);
+
+  /**
+   * \brief decode a compact meta without allocating
+   * \return the number of bytes consumed, which may be less than buf_size
+   */
+  int UnpackCompactMeta(const char *meta_buf, int buf_size, MetaView *view);
+
+  /**
+   * \brief decode a compact meta
+   * \return the number of bytes consumed, which may be less than buf_size
+   */
+  int UnpackCompactMeta(const char *meta_buf, int buf_size, Meta *meta);
+
+  /**
+   * \brief read the app_id and customer_id of a compact meta, which come
+   * first, without decoding the rest
+   * \return false for a control message, whose meta has to be decoded to
+   * route it
+   */
+  bool PeekCompactMeta(const char *meta_buf, int buf_size, int *app_id, int *customer_id);
+
   bool IsValidPushpull(const Message &msg);
 
   Node scheduler_;
@@ -168,6 +228,15 @@ class Van {
   /** thread function for receving */
   void Receiving();
 
+  /** thread function for the control messages */
+  void ProcessingControl();
+
+  /** thread function for the data messages of some customers */
+  void ProcessingData(int index);
+
+  /** process a data message, or a rebalance command for an app */
+  void ProcessDataPlaneMsg(Message *msg);
+
   /** thread function for heartbeat */
   void Heartbeat();
 
@@ -188,12 +257,39 @@ class Van {
   int num_workers_ = 0;
   /** the thread for receiving messages */
   std::unique_ptr<std::thread> receiver_thread_;
+  /** the control messages, such as barriers and heartbeats, which are handled
+   * apart from the data so that a burst of data does not hold them up */
+  ThreadsafeQueue<Message> control_queue_;
+  std::unique_ptr<std::thread> control_thread_;
+  /** a data message for a data thread, whose meta may still be packed, see
+   * RecvPackedMsg */
+  struct DataMsg {
+    Message msg;
+    bool packed = false;
+  };
+  /** the data messages of every data thread, by customer. the receiving thread
+   * handles them itself if PS_RECV_THREADS is not set */
+  std::vector<std::unique_ptr<ThreadsafeQueue<DataMsg>>> data_queues_;
+  std::vector<std::thread> data_threads_;
   /** the thread for sending heartbeat */
   std::unique_ptr<std::thread> heartbeat_thread_;
   // the count of instance barrier requests, used for instance-level barrier
   std::vector<int> barrier_count_;
   // the id of (group) barrier request senders, used for group-level barrier
   std::unordered_map<int, std::vector<int>> group_barrier_requests_;
+  // the load reported by the workers and the number of reports, used by the
+  // scheduler to partition the key space
+  std::vector<std::pair<Key, uint64_t>> key_load_;
+  int key_load_reports_ = 0;
+  // the rebalance in progress at the scheduler: the workers waiting for it,
+  // the app whose pairs move, the load and the max key range version reported
+  // by the servers, the new ranges and the servers yet to respond
+  std::vector<int> rebalance_requesters_;
+  int rebalance_app_id_ = 0;
+  std::vector<std::pair<Key, uint64_t>> rebalance_load_;
+  int rebalance_version_ = 0;
+  std::vector<Range> rebalance_ranges_;
+  int rebalance_pending_ = 0;
 
   /** msg resender */
   Resender *resender_ = nullptr;
@@ -227,6 +323,26 @@ class Van {
   */
   void ProcessInstanceBarrierCommand(Message *msg);
 
+  /**
+   * \brief processing logic of KeyRanges message. the scheduler merges the
+   * load of every worker instance and sends the ranges to every node
+   */
+  void ProcessKeyRangesCommand(Message *msg);
+
+  /**
+   * \brief processing logic of Rebalance, KeyLoad and Migrate messages. the
+   * scheduler collects the load of the servers, has them move their pairs to
+   * the new ranges, and then sends the ranges to the workers. servers pass
+   * the messages to the app whose pairs move
+   */
+  void ProcessRebalanceCommand(Message *msg);
+
+  /**
+   * \brief send a message to every node of a group
+   * \return the number of nodes the message is sent to
+   */
+  int SendToGroup(Message *msg, int group);
+
   /**
    * \brief processing logic of AddNode message (run on each node)
    */
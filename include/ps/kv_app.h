@@ -5,10 +5,24 @@
 #ifndef PS_KV_APP_H_
 #define PS_KV_APP_H_
 #include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <limits>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
 #include <utility>
 #include <vector>
 #include "ps/base.h"
 #include "ps/simple_app.h"
+#include "ps/internal/key_dedup.h"
+#include "ps/internal/threadsafe_queue.h"
+#ifdef __linux__
+#include <pthread.h>
+#endif
 #include <fstream>
 #include <iostream>
 #include <stdlib.h>
@@ -49,6 +63,55 @@ struct KVPairs {
   SArray<int> lens;
 };
 
+/**
+ * \brief the words describing every request, or response, of a batch
+ *
+ * A batch message holds the keys, values and lengths of its requests one
+ * after another, and a fourth array with kPartSize words for each of them. See
+ * \ref KVWorker::set_coalescing
+ */
+enum BatchPartField {
+  kPartTimestamp, kPartCmd, kPartNumKeys, kPartNumVals, kPartNumLens,
+  kPartValLen, kPartAddr, kPartSize
+};
+
+/** \brief dst[i] += src[i] for i < k, a loop the compiler vectorizes */
+template <typename Val>
+inline void AddValues(Val* __restrict__ dst, const Val* __restrict__ src, size_t k) {
+  for (size_t i = 0; i < k; ++i) dst[i] += src[i];
+}
+
+/**
+ * \brief dst[i] = srcs[0][i] + ... + srcs[num-1][i] for i < k, added to dst[i]
+ * if accumulate
+ *
+ * Up to three sources are added in one pass, so dst is read and written once
+ * per three sources rather than once per source. Floating point sums may
+ * round differently than adding the sources one by one.
+ */
+template <typename Val>
+inline void SumValues(Val* __restrict__ dst, const Val* const* srcs, size_t num,
+                      size_t k, bool accumulate) {
+  size_t j = 0;
+  if (!accumulate && num) {
+    if (num == 1) {
+      memcpy(dst, srcs[0], k * sizeof(Val));
+      return;
+    }
+    const Val* __restrict__ a = srcs[0];
+    const Val* __restrict__ b = srcs[1];
+    for (size_t i = 0; i < k; ++i) dst[i] = a[i] + b[i];
+    j = 2;
+  }
+  for (; j + 3 <= num; j += 3) {
+    const Val* __restrict__ a = srcs[j];
+    const Val* __restrict__ b = srcs[j + 1];
+    const Val* __restrict__ c = srcs[j + 2];
+    for (size_t i = 0; i < k; ++i) dst[i] += a[i] + b[i] + c[i];
+  }
+  for (; j < num; ++j) AddValues(dst, srcs[j], k);
+}
+
 /**
  * \brief A worker node that can \ref Push (\ref Pull) key-value pairs to (from) server
  * nodes
@@ -59,6 +122,11 @@ struct KVPairs {
  * 2. Zero-copy versions: \ref ps::KVWorker::ZPush,
  * \ref ps::KVWorker::ZPull *
  *
+ * 3. Keys in any order and with duplicates: \ref ps::KVWorker::SparsePush,
+ * \ref ps::KVWorker::SparsePull
+ *
+ * 4. Push and pull in one round trip: \ref ps::KVWorker::ZPushPull
+ *
  * \tparam Val the type of value, which should be primitive types such as
  * int32_t and float
  */
@@ -109,6 +177,7 @@ class KVWorker : public SimpleApp {
 
   /** \brief deconstructor */
   virtual ~KVWorker() {
+    set_coalescing(0);
     delete obj_;
     obj_ = nullptr;
   }
@@ -178,6 +247,11 @@ class KVWorker : public SimpleApp {
    * data size of a key does not change during push or pull, you can verify
    * it by checking whether \a lens of the key is equal to the fixed size.    *
    *
+   * If \a vals is already sized, and \a lens is either not set or already
+   * sized with the expected lengths, each server's values are copied into
+   * place as soon as its response arrives, instead of being merged when the
+   * last response arrives.
+   *
    * @param keys a list of keys, must be unique and sorted in increasing order
    * @param vals the buffer for the pulled values. It can be 0 size.
    * @param lens optional buffer for the value length. If set, it can be 0 size.
@@ -207,6 +281,32 @@ class KVWorker : public SimpleApp {
    */
   void Wait(int timestamp) { obj_->WaitRequest(timestamp); }
 
+  /**
+   * \brief returns true if the request with the timestamp is finished,
+   * without blocking
+   *
+   * \param timestamp the timestamp returned by the push or pull
+   */
+  bool Test(int timestamp) { return obj_->TestRequest(timestamp); }
+
+  /**
+   * \brief waits until all the requests are finished
+   *
+   * \param timestamps the timestamps returned by the push or pull
+   */
+  void WaitAll(const std::vector<int>& timestamps) { obj_->WaitAll(timestamps); }
+
+  /**
+   * \brief waits until any of the requests is finished
+   *
+   * Only the threads waiting for a finished request are waken up, so many
+   * threads can wait for different requests of the same worker.
+   *
+   * \param timestamps the timestamps returned by the push or pull
+   * \return the timestamp of a finished request
+   */
+  int WaitAny(const std::vector<int>& timestamps) { return obj_->WaitAny(timestamps); }
+
   /**
    * \brief zero-copy Push
    *
@@ -220,13 +320,13 @@ class KVWorker : public SimpleApp {
             const SArray<int>& lens = {},
             int cmd = 0,
             const Callback& cb = nullptr) {
-    int ts = obj_->NewRequest(kServerGroup);
-    AddCallback(ts, cb);
+    Request* req = NewRequest(cb);
+    int ts = req->timestamp;
     KVPairs<Val> kvs;
     kvs.keys = keys;
     kvs.vals = vals;
     kvs.lens = lens;
-    Send(ts, true, cmd, kvs);
+    Send(req, true, false, cmd, kvs);
     return ts;
   }
 
@@ -245,6 +345,102 @@ class KVWorker : public SimpleApp {
             const Callback& cb = nullptr) {
     return Pull_(keys, vals, lens, cmd, cb);
   }
+
+  /**
+   * \brief zero-copy push, and pull of the values after the push in the same
+   * round trip
+   *
+   * Every server's request handle sees a push with \ref KVMeta::push_pull set,
+   * and answers it with the values of the keys once the push is applied,
+   * which may be after the pushes of the other workers. The pulled values are
+   * placed into \a outs as for \ref ZPull. It is never coalesced, see \ref
+   * set_coalescing.
+   *
+   * @param keys a list of keys, must be unique and sorted in increasing order
+   * @param vals the values to push
+   * @param outs the buffer for the pulled values, it can be 0 size
+   * @param lens optional. if not empty, the lengths of the pushed values.
+   * filled with the lengths of the pulled values
+   * @param cmd an optional command sent to the servers
+   * @param cb the callback which is called when the values are pulled
+   * @return the timestamp of this request
+   */
+  int ZPushPull(const SArray<Key>& keys,
+                const SArray<Val>& vals,
+                SArray<Val>* outs,
+                SArray<int>* lens = nullptr,
+                int cmd = 0,
+                const Callback& cb = nullptr) {
+    KVPairs<Val> push;
+    push.vals = vals;
+    if (lens) push.lens = *lens;
+    return Pull_(keys, outs, lens, cmd, cb, &push);
+  }
+
+  /**
+   * \brief pushes values of keys which need not be sorted or unique, such as
+   * the gradients of an embedding lookup batch
+   *
+   * The values of duplicate keys are summed locally, and every distinct key is
+   * sent once. All values have the same length `k=vals.size()/keys.size()`.
+   * Unlike \ref ZPush, the keys and values can be changed once it returns.
+   */
+  int SparsePush(const SArray<Key>& keys,
+                 const SArray<Val>& vals,
+                 int cmd = 0,
+                 const Callback& cb = nullptr) {
+    const size_t n = keys.size();
+    SArray<Key> unique(n);
+    std::vector<uint32_t> index(n);
+    size_t num = DedupKeys(keys.data(), n, unique.data(), index.data());
+    unique.resize(num);
+    const size_t k = n ? vals.size() / n : 0;
+    CHECK_EQ(k * n, vals.size());
+    SArray<Val> sum(num * k);
+    for (size_t i = 0; i < n; ++i) {
+      AddValues(sum.data() + index[i] * k, vals.data() + i * k, k);
+    }
+    return ZPush(unique, sum, {}, cmd, cb);
+  }
+
+  /**
+   * \brief pulls the values of keys which need not be sorted or unique, such
+   * as the ids of an embedding lookup batch
+   *
+   * Every distinct key is pulled once, and its value is copied to every
+   * position the key appears at. All values must have the same length k.
+   * \a vals is resized to `keys.size()*k` if empty. Otherwise it must hold
+   * that many values, and the responses are placed as they arrive.
+   */
+  int SparsePull(const SArray<Key>& keys,
+                 SArray<Val>* vals,
+                 int cmd = 0,
+                 const Callback& cb = nullptr) {
+    CHECK_NOTNULL(vals);
+    const size_t n = keys.size();
+    SArray<Key> unique(n);
+    std::shared_ptr<std::vector<uint32_t>> index(new std::vector<uint32_t>(n));
+    size_t num = DedupKeys(keys.data(), n, unique.data(), index->data());
+    unique.resize(num);
+    std::shared_ptr<SArray<Val>> unique_vals(new SArray<Val>());
+    if (!vals->empty() && n) unique_vals->resize(num * (vals->size() / n));
+    return Pull_(unique, unique_vals.get(), static_cast<SArray<int>*>(nullptr), cmd,
+                 [vals, unique_vals, index, num, cb]() {
+      // copy the value of every distinct key to all its positions
+      const size_t n = index->size();
+      const size_t k = num ? unique_vals->size() / num : 0;
+      if (vals->empty()) {
+        vals->resize(n * k);
+      } else {
+        CHECK_GE(vals->size(), n * k);
+      }
+      for (size_t i = 0; i < n; ++i) {
+        memcpy(vals->data() + i * k, unique_vals->data() + (*index)[i] * k,
+               k * sizeof(Val));
+      }
+      if (cb) cb();
+    });
+  }
   using SlicedKVs = std::vector<std::pair<bool, KVPairs<Val>>>;
   /**
    * \brief a slicer partitions a key-value list according to the key ranges
@@ -262,57 +458,335 @@ class KVWorker : public SimpleApp {
    */
   void set_slicer(const Slicer& slicer) {
     CHECK(slicer); slicer_ = slicer;
+    hash_slicing_ = false;
+  }
+
+  /**
+   * \brief route every key to a server by its hash instead of by the key
+   * ranges, so the keys of a request need not be sorted or unique
+   *
+   * The keys are grouped by server in one linear pass without a comparison
+   * sort, see \ref HashScatterKeys, and pulled values are put back in the
+   * order of the keys. A server gets its keys in the order they appear in the
+   * request. A later \ref set_slicer replaces it. It cannot be used with
+   * \ref Rebalance, which moves key ranges.
+   */
+  void set_hash_slicer() {
+    using namespace std::placeholders;
+    slicer_ = std::bind(&KVWorker<Val>::HashSlicer, this, _1, _2, _3, true,
+                        nullptr, nullptr);
+    hash_slicing_ = true;
+  }
+
+  /**
+   * \brief coalesce the small requests sent to the same server
+   *
+   * A request to a server waits up to \a window_us for other requests to the
+   * same server, and they are sent together in one message. The server
+   * handles each of them as if it came alone, and sends their responses back
+   * in one message. This trades a little latency for fewer messages when many
+   * small requests are in flight. Set it before sending requests, and only
+   * with values in CPU memory.
+   *
+   * \param window_us the longest a request waits in microseconds, 0 sends
+   * every request at once
+   * \param max_bytes a batch is sent at once when its keys, values and lengths
+   * reach this size
+   */
+  void set_coalescing(int window_us, size_t max_bytes = 1 << 16);
+
+  /**
+   * \brief partition the key space again by the load the servers observed
+   *
+   * The servers move their key-value pairs with the handles of
+   * \ref KVServer::set_migrate_handle while the requests in flight are resent
+   * to their new servers. It blocks until the new ranges are used by all
+   * workers. See \ref Postoffice::RebalanceServerKeyRanges.
+   */
+  void Rebalance() {
+    CHECK(!hash_slicing_) << "keys routed by hash are not in key ranges";
+    postoffice_->RebalanceServerKeyRanges(obj_->app_id());
+  }
+
+  /**
+   * \brief ends an iteration of this worker
+   *
+   * Requests are tagged with the number of iterations the worker ended, which
+   * servers with \ref KVServer::set_staleness use to hold back pulls of fast
+   * workers. Call it once the pushes of an iteration are sent. It tells every
+   * server, after the requests sent before it.
+   *
+   * @param cb the callback which is called when every server knows the clock
+   * @return the timestamp of this request
+   */
+  int Clock(const Callback& cb = nullptr);
+
+  /** \brief the number of times \ref Clock was called */
+  int clock() const { return clock_.load(std::memory_order_relaxed); }
+
+  /**
+   * \brief keep the values pulled by \ref CachedPull, with the versions the
+   * servers gave them
+   *
+   * A cached key is used without asking the servers while it was pulled, or
+   * found unchanged, at most \a staleness clocks ago, see \ref Clock. Past
+   * that, its version goes to its server, which only sends the values back if
+   * they changed. The servers need \ref KVServer::set_versioning.
+   *
+   * \param max_bytes the most bytes of values kept, the least recently used
+   * keys are dropped beyond it
+   * \param staleness the clocks a cached key is used for without asking, -1
+   * always asks
+   */
+  void set_cache(size_t max_bytes, int staleness) {
+    std::lock_guard<std::mutex> lk(cache_mu_);
+    cache_max_bytes_ = max_bytes;
+    cache_staleness_ = staleness;
+    EvictCache();
   }
 
+  /**
+   * \brief pulls through the cache of \ref set_cache
+   *
+   * Works like \ref ZPull, except that the values of keys cached recently
+   * enough are taken from the cache, and that a server only sends the values
+   * which changed since they were cached.
+   */
+  int CachedPull(const SArray<Key>& keys,
+                 SArray<Val>* vals,
+                 SArray<int>* lens = nullptr,
+                 int cmd = 0,
+                 const Callback& cb = nullptr);
+
  private:
 
 
+  /**
+   * \brief the state of a push or pull in flight
+   *
+   * requests live in a ring indexed by timestamp, and a request object is
+   * reused once its callback has run. the receive thread finds the request of
+   * a response without lock, and the last response runs the callback.
+   */
+  struct Request {
+    /** \brief the timestamp, -1 if the request object is free */
+    std::atomic<int> timestamp{-1};
+    /** \brief the number of servers which have not responded yet */
+    std::atomic<int> num_pending{0};
+    /** \brief run when all the servers have responded */
+    Callback callback;
+    /** \brief the kv slices received from the servers, for pull */
+    std::vector<KVPairs<Val>> kvs;
+
+    /**
+     * \brief the destination of a pull whose responses are copied into place
+     * as they arrive, see PlacePull. nullptr if the callback merges them.
+     */
+    Val* pull_vals = nullptr;
+    size_t pull_vals_size = 0;
+    /** \brief the expected lengths, nullptr if the values have a fixed length */
+    const int* pull_lens = nullptr;
+    const Key* pull_keys = nullptr;
+    size_t pull_keys_size = 0;
+    /** \brief the offsets of each server's slice in keys and in vals */
+    std::vector<std::pair<size_t, size_t>> pull_offsets;
+    /** \brief the number of keys placed so far */
+    size_t num_placed_keys = 0;
+    /** \brief a response could not be placed, the callback merges them all */
+    bool place_failed = false;
+
+    /**
+     * \brief for keys routed by hash, the offsets of each server's keys in
+     * the scattered keys and the position of every scattered key in the
+     * request, see HashScatterKeys. empty otherwise
+     */
+    std::vector<size_t> hash_offsets;
+    std::vector<uint32_t> hash_perm;
+
+    /** \brief whether it is a CachedPull */
+    bool cached = false;
+    /** \brief for CachedPull, the versions of kvs, empty if a server sent
+     * none */
+    std::vector<SArray<uint64_t>> versions;
+  };
+
+  /** \brief a power of 2 sized ring of requests, indexed by timestamp */
+  struct RequestTable {
+    explicit RequestTable(size_t size) : mask(size - 1), slots(size, nullptr) {}
+    size_t mask;
+    std::vector<Request*> slots;
+  };
+
   /**
    * \brief internal pull, C/D can be either SArray or std::vector
+   * @param push the values and lengths pushed by a push-pull, nullptr for a
+   * pull
    */
   template <typename C, typename D>
   int Pull_(const SArray<Key>& keys, C* vals, D* lens,
-            int cmd, const Callback& cb);
+            int cmd, const Callback& cb, const KVPairs<Val>* push = nullptr);
   /**
-   * \brief add a callback for a request. threadsafe.
-   * @param cb callback
-   * @param timestamp the timestamp of the request
+   * \brief start a new request. threadsafe.
+   * @param cb the callback of the request, can be empty
+   * @return the request, whose timestamp is only valid until it is sent
    */
-  void AddCallback(int timestamp, const Callback& cb) {
-    if (!cb) return;
-    std::lock_guard<std::mutex> lk(mu_);
-    callbacks_[timestamp] = cb;
-  }
-
+  Request* NewRequest(const Callback& cb);
+  /**
+   * \brief find the request of a response
+   * @param timestamp the timestamp of the response
+   */
+  Request* FindRequest(int timestamp);
+  /**
+   * \brief enlarge the ring so that the requests in flight and the new
+   * timestamp do not share a slot. must hold mu_
+   */
+  void GrowRequestTable(int timestamp);
   /**
-   * \brief run and delete the callback
-   * \param timestamp the timestamp of the callback
+   * \brief count responses of a request, and finish it with the last one
+   * @param num the number of responses
    */
-  void RunCallback(int timestamp);
+  void AddResponse(Request* req, int num);
+  /**
+   * \brief compute where the slice of each server goes in the pull destination
+   * @param keys the pulled keys
+   * @param sliced the slices sent to the servers
+   */
+  void PlanPull(Request* req, const SArray<Key>& keys, const SlicedKVs& sliced);
+  /**
+   * \brief copy the response of a server into the pull destination
+   * @param server the server group rank
+   * @param kvs the response
+   */
+  void PlacePull(Request* req, int server, const KVPairs<Val>& kvs);
   /**
    * \brief send the kv list to all servers
-   * @param timestamp the timestamp of the request
+   * @param req the request
    * @param push whether or not it is a push request
+   * @param pull whether or not the responses carry values, true for a pull
+   * or a push-pull
    * @param cmd command
    */
-  void Send(int timestamp, bool push, int cmd, KVPairs<Val>& kvs);
+  void Send(Request* req, bool push, bool pull, int cmd, KVPairs<Val>& kvs);
+  /**
+   * \brief send the non-empty slices to their servers
+   * @param version the version of the key ranges the slices are cut by
+   * @param versions for CachedPull, the cached versions of the keys of every
+   * slice
+   */
+  void SendSlices(int timestamp, bool push, bool pull, int cmd, int version,
+                  SlicedKVs* sliced,
+                  const std::vector<SArray<uint64_t>>* versions = nullptr);
+  /**
+   * \brief send a slice rejected by a server to the servers of the newer key
+   * ranges the server uses
+   * @param version the key range version of the server
+   * @param kvs the rejected slice returned by the server
+   */
+  void Resend(Request* req, int timestamp, bool push, bool pull, int cmd,
+              int version, const KVPairs<Val>& kvs);
   /** \brief internal receive handle */
   void Process(const Message& msg);
+  /** \brief process the responses of a batch, one by one */
+  void ProcessBatch(const Message& msg);
+  /** \brief keep a pulled response, placing it if possible */
+  void AddPulled(Request* req, int server, KVPairs<Val>&& kvs);
+  /** \brief queue a request to a server, see \ref set_coalescing */
+  void Coalesce(int server, const Message& msg, const KVPairs<Val>& kvs);
+  /** \brief the message of the requests queued for a server. needs batch_mu_ */
+  Message TakeBatch(int server, bool push);
+  /** \brief the thread sending the batches whose window ended */
+  void FlushBatches();
   /** \brief default kv slicer */
   void DefaultSlicer(const KVPairs<Val>& send,
                      const std::vector<Range>& ranges,
                      SlicedKVs* sliced);
+  /**
+   * \brief kv slicer routing by hash, see \ref set_hash_slicer
+   * @param with_vals whether to scatter the values, false for pull
+   * @param offsets the offsets of each server's keys, can be nullptr
+   * @param perm the position of every scattered key in send, can be nullptr
+   */
+  void HashSlicer(const KVPairs<Val>& send, const std::vector<Range>& ranges,
+                  SlicedKVs* sliced, bool with_vals,
+                  std::vector<size_t>* offsets, std::vector<uint32_t>* perm);
+  /**
+   * \brief put the responses of a pull routed by hash back in the order of
+   * the keys
+   */
+  template <typename C, typename D>
+  void MergeHashPull(Request* req, const SArray<Key>& keys, C* vals, D* lens);
 
-  /** \brief data buffer for received kvs for each timestamp */
-  std::unordered_map<int, std::vector<KVPairs<Val>>> recv_kvs_;
-  /** \brief callbacks for each timestamp */
-  std::unordered_map<int, Callback> callbacks_;
-  /** \brief lock */
+  /** \brief the initial number of slots of the request table */
+  static const size_t kInitRequestTableSize = 1024;
+  /** \brief the current request table, read by the receive thread without lock */
+  std::atomic<RequestTable*> requests_{nullptr};
+  /**
+   * \brief all the request tables ever used. a replaced table is kept alive
+   * since the receive thread may still be reading it
+   */
+  std::vector<std::unique_ptr<RequestTable>> request_tables_;
+  /** \brief owns every request object */
+  std::vector<std::unique_ptr<Request>> request_pool_;
+  /** \brief free request objects not placed in the current table */
+  std::vector<Request*> free_requests_;
+  /** \brief lock for starting requests */
   std::mutex mu_;
   /** \brief lock for profile logging */
   std::mutex log_mu_;
   /** \brief kv list slicer */
   Slicer slicer_;
+  /** \brief whether slicer_ routes by hash */
+  bool hash_slicing_ = false;
+  /** \brief the iteration clock, see Clock */
+  std::atomic<int> clock_{0};
+
+  /** \brief the version of a key which is not cached */
+  static const uint64_t kNoVersion = std::numeric_limits<uint64_t>::max();
+  struct CacheEntry {
+    SArray<Val> vals;
+    /** \brief the version given by the server */
+    uint64_t version;
+    /** \brief the clock the values were last known to be current at */
+    int clock;
+    std::list<Key>::iterator lru;
+  };
+  /** \brief store the values pulled for a key. needs cache_mu_ */
+  void CacheValues(Key key, const SArray<Val>& vals, uint64_t version, int clock);
+  /** \brief drop the least recently used keys beyond the limit. needs cache_mu_ */
+  void EvictCache();
+  /** \brief the cache of set_cache */
+  std::unordered_map<Key, CacheEntry> cache_;
+  /** \brief the cached keys, the most recently used first */
+  std::list<Key> cache_lru_;
+  size_t cache_bytes_ = 0;
+  size_t cache_max_bytes_ = 0;
+  int cache_staleness_ = -1;
+  std::mutex cache_mu_;
+
+  /** \brief the requests to a server waiting to be sent in one message */
+  struct Batch {
+    /** \brief kPartSize words per request, see BatchPartField */
+    SArray<int64_t> parts;
+    SArray<Key> keys;
+    SArray<Val> vals;
+    SArray<int> lens;
+    /** \brief the key range version of the requests */
+    int version = 0;
+    /** \brief the clock of the requests */
+    int clock = 0;
+    size_t bytes = 0;
+    /** \brief when the first request has waited long enough */
+    std::chrono::steady_clock::time_point deadline;
+  };
+  /** \brief the longest a request waits in a batch, 0 if not coalescing */
+  int coalesce_us_ = 0;
+  size_t coalesce_bytes_ = 0;
+  /** \brief the pull and push batches of server i are 2*i and 2*i+1 */
+  std::vector<Batch> batches_;
+  std::mutex batch_mu_;
+  std::condition_variable batch_cond_;
+  std::thread batch_thread_;
+  bool batch_stop_ = false;
 
   int instance_idx_;
 };
@@ -323,6 +797,11 @@ struct KVMeta {
   int cmd;
   /** \brief whether or not this is a push request */
   bool push;
+  /**
+   * \brief whether a push wants the values after the push in its response,
+   * see \ref KVWorker::ZPushPull
+   */
+  bool push_pull = false;
   /** \brief sender's node id */
   int sender;
   /** \brief the associated timestamp */
@@ -337,6 +816,24 @@ struct KVMeta {
   int val_len;
   /** \brief the option */
   int option;
+  /** \brief the batch a coalesced request came in, -1 if it came alone */
+  int batch = -1;
+  /** \brief the position of a coalesced request in its batch */
+  int batch_part = -1;
+  /** \brief the iteration clock of the sender, see \ref KVWorker::Clock */
+  int clock = 0;
+  /**
+   * \brief whether the pull came from \ref KVWorker::CachedPull, its
+   * response then carries the versions of the keys
+   */
+  bool versioned = false;
+  /**
+   * \brief with \ref KVServer::set_versioning, the keys of a push, whose
+   * versions move once it is answered, or the keys of a versioned pull
+   */
+  SArray<Key> version_keys;
+  /** \brief the versions of the keys of a versioned pull when it arrived */
+  SArray<uint64_t> versions;
 };
 
 /**
@@ -355,18 +852,21 @@ class KVServer : public SimpleApp {
     CHECK(postoffice_) << is_scheduler << " " << instance_idx;
     instance_idx_ = instance_idx;
     using namespace std::placeholders;
-    this->obj_ = new Customer(app_id, app_id, std::bind(&KVServer::Process, this, _1), postoffice_);
+    this->obj_ = new Customer(app_id, app_id, std::bind(&KVServer::Process, this, _1), postoffice_,
+                              std::bind(&KVServer::ProcessMessages, this, _1));
   }
 
   /** \brief deconstructor */
   virtual ~KVServer() {
+    // no request is processed on the thread of obj_ from here on. the ones
+    // still batched, queued or running respond through obj_
+    obj_->Stop();
+    Drain();
+    set_executor(0);
     delete obj_;
     obj_ = nullptr;
-    auto iter = server_key_map.begin();
-    while(iter != server_key_map.end()) {
-      delete &iter->second;
-      server_key_map.erase(iter++);
-    }
+    // the map owns its pairs
+    server_key_map.clear();
   }
 
   /**
@@ -384,7 +884,35 @@ class KVServer : public SimpleApp {
   }
 
   /**
-   * \brief response to the push/pull request
+   * \brief the handle to process several push/pull requests at once
+   * \param reqs the meta-info and kv pairs of every request, in the order
+   * they came
+   * \param server this pointer
+   */
+  using BatchReqHandle = std::function<void(
+      const std::vector<std::pair<KVMeta, KVPairs<Val>>>& reqs, KVServer* server)>;
+  /**
+   * \brief hand the requests to a batch handle, instead of the request handle
+   *
+   * Every time the receiving thread wakes up, it takes all the messages queued
+   * meanwhile, and the requests among them go to the handle in one call. A
+   * handle can then merge the pushes of many workers to a key in a single
+   * pass, as \ref KVServerSyncHandle does. Every request still gets its own
+   * \ref Response. Requests are not batched while the server is idle, so the
+   * latency of a lone request stays the same. Pushed values in buffers given
+   * to \ref RegisterRecvBufferWithRank may be overwritten by a later push of
+   * the same batch. It does not go with \ref set_executor. Set it before
+   * requests arrive.
+   */
+  void set_batch_request_handle(const BatchReqHandle& batch_request_handle) {
+    CHECK(batch_request_handle) << "invalid batch request handle";
+    CHECK(executors_.empty()) << "a batch request handle does not go with set_executor";
+    batch_request_handle_ = batch_request_handle;
+  }
+
+  /**
+   * \brief response to the push/pull request. it can be called from any
+   * thread, and after the request handle returned
    * \param req the meta-info of the request
    * \param res the kv pairs that will send back to the worker
    */
@@ -402,17 +930,202 @@ class KVServer : public SimpleApp {
   void RegisterRecvBufferWithRank(int worker_rank, SArray<Key>& keys, const SArray<Val>& vals,
                                   const SArray<int>& lens = {}, int cmd = 0);
 
+  /**
+   * \brief the handle to take the key-value pairs in a key range out of this
+   * server, which are moved to another server
+   * \param range the keys to move
+   * \param kvs the pairs in range, to be filled. keys sorted in increasing order
+   */
+  using ExportHandle = std::function<void(const Range& range, KVPairs<Val>* kvs)>;
+  /**
+   * \brief the handle to store the key-value pairs moved from another server
+   */
+  using ImportHandle = std::function<void(const KVPairs<Val>& kvs)>;
+  /**
+   * \brief set the handles moving key-value pairs between servers, which
+   * enables \ref KVWorker::Rebalance. they run in the thread of the request
+   * handle, the bytes of every key pushed or pulled are counted meanwhile
+   */
+  void set_migrate_handle(const ExportHandle& export_handle,
+                          const ImportHandle& import_handle) {
+    CHECK(export_handle && import_handle) << "invalid migrate handle";
+    export_handle_ = export_handle;
+    import_handle_ = import_handle;
+  }
+
+  /**
+   * \brief hold back the pulls of workers running ahead of the others, by the
+   * clocks of \ref KVWorker::Clock
+   *
+   * A pull or push-pull from a worker at clock c is handed to the request
+   * handle once every worker reached clock c - staleness, and at once if they
+   * already did. 0 is bulk synchronous (BSP), a positive bound is stale
+   * synchronous (SSP), and -1, the default, is asynchronous (ASP). A
+   * rebalance returns the requests held back to their workers, which send
+   * them again by the new key ranges. Set it before requests arrive.
+   */
+  void set_staleness(int staleness) { staleness_ = staleness; }
+
+  /**
+   * \brief count the pushes of every key as its version, which lets
+   * \ref KVWorker::CachedPull skip the values that did not change. Set it
+   * before requests arrive.
+   *
+   * A push counts once it is answered, so the request handle must answer a
+   * push only after its values are stored. A pull is answered with the
+   * versions of its keys when it arrived, which are never newer than the
+   * values it gets, however late the handle answers it.
+   */
+  void set_versioning(bool versioning) { versioning_ = versioning; }
+
+  /**
+   * \brief run the request handle on a pool of threads, instead of the thread
+   * receiving the requests
+   *
+   * Every key belongs to one of the threads. A request is handled by a thread
+   * of its keys once each of their threads handled the requests which came
+   * before it, so the requests sharing a key are handled in the order they
+   * came, one at a time. Requests without common threads are handled at the
+   * same time, so the request handle must be safe to call for requests of
+   * disjoint keys at once, as \ref KVServerSyncHandle is. Pushed values in
+   * buffers given to \ref RegisterRecvBufferWithRank may be overwritten by the
+   * next push before a thread gets to them. Set it before requests arrive.
+   *
+   * \param num_threads the number of threads, 0 handles the requests on the
+   * receiving thread
+   * \param first_core thread i is pinned to core first_core + i, modulo the
+   * number of cores. -1 leaves them to the OS
+   */
+  void set_executor(int num_threads, int first_core = -1);
+
   /** \brief the offset in the instance group */
   int instance_idx_;
 
  private:
   /** \brief internal receive handle */
   void Process(const Message& msg);
+  /** \brief internal receive handle for the messages queued at once */
+  void ProcessMessages(const std::vector<Message>& msgs);
+  /** \brief hand the requests kept by Run to the batch request handle */
+  void FlushRequests();
+  /** \brief pass a request to the request handle, or hold it back, see
+   * set_staleness */
+  void Handle(const KVMeta& meta, const KVPairs<Val>& data);
+  /** \brief move the clock of a worker, and handle the requests it released */
+  void AdvanceClock(int sender, int clock);
+  /** \brief the keys of a CachedPull whose versions changed, false if none,
+   * and their versions in its meta, read under one lock */
+  bool FindChanged(const Message& msg, KVMeta* meta, KVPairs<Val>* data);
+  /** \brief keep the keys of a push in its meta, see set_versioning */
+  void TagVersions(KVMeta* meta, const SArray<Key>& keys);
+  /** \brief the versions a response to a versioned pull carries */
+  SArray<uint64_t> ResponseVersions(const KVMeta& req, const SArray<Key>& keys);
+  /** \brief call the request handle, or queue the request for set_executor
+   * or the batch request handle */
+  void Run(const KVMeta& meta, const KVPairs<Val>& data);
+  /** \brief the loop of an executor thread */
+  void Execute(int index);
+  /** \brief wait until the executor or the batch request handle handled all
+   * the queued requests */
+  void Drain();
+  /** \brief report the load or move the pairs for a rebalance */
+  void ProcessRebalance(const Message& msg);
+  /** \brief store the pairs moved from another server */
+  void Import(const Message& msg);
+  /** \brief tell the scheduler once all the moved pairs are here */
+  void CheckMigrated();
+  /** \brief return a request sliced by older key ranges to the worker */
+  void Reject(const Message& msg, int version);
+  /** \brief return the requests held back to the workers, as they may touch
+   * pairs which are about to move */
+  void RejectHeld(int version);
+  /** \brief hand the requests of a batch to the request handle one by one */
+  void ProcessBatch(const Message& msg, const KVMeta& meta);
+  /** \brief keep the response to a request of a batch, and send them all once
+   * every request got its response. a rejected request was answered on its
+   * own, and is left out */
+  void RespondBatch(const KVMeta& req, const KVPairs<Val>& res, bool rejected = false);
+  /** \brief count the bytes of every key, if migration is enabled */
+  void CountLoad(const KVPairs<Val>& kvs);
   /** \brief request handle */
   ReqHandle request_handle_;
+  BatchReqHandle batch_request_handle_;
+  /** \brief the requests for the next call of batch_request_handle_. touched
+   * only by the thread of Process */
+  std::vector<std::pair<KVMeta, KVPairs<Val>>> batched_;
+  ExportHandle export_handle_;
+  ImportHandle import_handle_;
+  /** \brief the bytes of every key since the last rebalance */
+  std::unordered_map<Key, uint64_t> key_load_;
+  std::mutex load_mu_;
+  /** \brief the key range version whose pairs are moving in, 0 if none */
+  int migrating_version_ = 0;
+  /** \brief the number of servers whose pairs arrived, per key range version */
+  std::unordered_map<int, int> imports_;
+
+  /** \brief the responses to the requests of a batch */
+  struct ResponseBatch {
+    int recver;
+    int customer_id;
+    int timestamp;
+    bool push;
+    /** \brief the words describing the requests */
+    SArray<int64_t> parts;
+    std::vector<KVPairs<Val>> responses;
+    std::vector<bool> rejected;
+    size_t pending;
+  };
+  /** \brief the batches waiting for responses, by id */
+  std::unordered_map<int, ResponseBatch> response_batches_;
+  int next_batch_ = 0;
+  std::mutex batch_mu_;
 
   std::unordered_map<Key, KVPairs<Val> > server_key_map;
 
+  /** \brief the bound of set_staleness, -1 if not tracking clocks */
+  int staleness_ = -1;
+  /** \brief the clock of every worker by rank, and the smallest of them.
+   * touched only by the thread of Process */
+  std::vector<int> clocks_;
+  int min_clock_ = 0;
+  /** \brief the requests held back, in the order they came */
+  std::vector<std::pair<KVMeta, KVPairs<Val>>> held_;
+  /** \brief whether key_versions_ counts the pushes, see set_versioning */
+  bool versioning_ = false;
+  std::unordered_map<Key, uint64_t> key_versions_;
+  std::mutex version_mu_;
+
+  /**
+   * \brief a request whose keys go to several executor threads. it is queued
+   * to each of them, and the last one to get to it handles it, while the
+   * others wait. the requests are queued by one thread, so they are in the
+   * same order in every queue
+   */
+  struct Joint {
+    std::mutex mu;
+    std::condition_variable cond;
+    /** \brief the threads yet to get to the request */
+    int pending = 0;
+    bool done = false;
+  };
+  /** \brief a request for an executor thread */
+  struct Task {
+    KVMeta meta;
+    KVPairs<Val> data;
+    /** \brief set if the request is queued to other threads as well */
+    std::shared_ptr<Joint> joint;
+    /** \brief ends the thread */
+    bool stop = false;
+  };
+  /** \brief the queue of every executor thread, see set_executor */
+  std::vector<std::unique_ptr<ThreadsafeQueue<Task>>> tasks_;
+  std::vector<std::thread> executors_;
+  /** \brief the requests queued or being handled by the executor */
+  std::atomic<int> num_tasks_{0};
+  /** \brief signaled once num_tasks_ drops to 0, see Drain */
+  std::mutex drain_mu_;
+  std::condition_variable drain_cond_;
+
   /** \brief lock */
   std::mutex mu_;
   /** \brief lock for profile logging */
@@ -435,14 +1148,16 @@ struct KVServerDefaultHandle {
     KVPairs<Val> res;
     if (req_meta.push) {
       CHECK_EQ(n, req_data.vals.size());
-    } else {
+    }
+    if (!req_meta.push || req_meta.push_pull) {
       res.keys = req_data.keys; res.vals.resize(n);
     }
     for (size_t i = 0; i < n; ++i) {
       Key key = req_data.keys[i];
       if (req_meta.push) {
         store[key] += req_data.vals[i];
-      } else {
+      }
+      if (res.vals.size()) {
         res.vals[i] = store[key];
       }
     }
@@ -451,6 +1166,270 @@ struct KVServerDefaultHandle {
   std::unordered_map<Key, Val> store;
 };
 
+/**
+ * \brief a handle summing the pushes of all workers, key by key
+ *
+ * Every key goes through rounds. A round ends once the key got one push from
+ * each of the \a num_workers workers, and the sum becomes the value of the
+ * key. A pull, or the pull half of a \ref KVWorker::ZPushPull, of a key the
+ * worker pushed in the round in progress, or of a key without a finished
+ * round, is parked until the round ends. Otherwise it is answered at once with
+ * the value of the last round. A pull of several keys waits for all of them.
+ *
+ * The first push of a round is copied into the round buffer of the key and
+ * the others are added to it, so a round takes one pass over every push. As
+ * a batch request handle, see \ref KVServer::set_batch_request_handle, the
+ * pushes to a key in a batch are summed at once by \ref SumValues. The
+ * buffers are allocated at the first round and swapped at the end of every
+ * round, unless a response still sends the older one. The pushed values are
+ * not referenced after the handle returns, so they may live in a buffer given
+ * to \ref KVServer::RegisterRecvBufferWithRank.
+ *
+ * The keys are spread over shards with a lock each, so requests of different
+ * keys can be handled at once, see \ref KVServer::set_executor. The length of
+ * a key may not change. The copies of a handle share its state.
+ */
+template <typename Val>
+class KVServerSyncHandle {
+ public:
+  /** \param num_workers the number of pushes of a round, usually NumWorkers() */
+  explicit KVServerSyncHandle(int num_workers) : state_(new State(num_workers)) {
+    CHECK_GT(num_workers, 0);
+  }
+
+  void operator()(
+      const KVMeta& req_meta, const KVPairs<Val>& req_data, KVServer<Val>* server) {
+    bool pull = !req_meta.push || req_meta.push_pull;
+    // the pulls answered by this request
+    std::vector<std::shared_ptr<PendingPull>> ready;
+    if (req_meta.push) Push(req_data, RankOf(req_meta), &ready);
+    if (pull) AddPull(req_meta, req_data.keys, &ready);
+    if (!pull) server->Response(req_meta);
+    for (const auto& p : ready) server->Response(p->meta, Collect(p->keys));
+  }
+
+  /**
+   * \brief the batch request handle, see \ref KVServer::set_batch_request_handle.
+   * The pushes to a key between two pulls are summed in one pass
+   */
+  void operator()(const std::vector<std::pair<KVMeta, KVPairs<Val>>>& reqs,
+                  KVServer<Val>* server) {
+    std::vector<std::shared_ptr<PendingPull>> ready;
+    // the pushes since the last pull, which keep the order of pushes and
+    // pulls to a key
+    std::vector<const std::pair<KVMeta, KVPairs<Val>>*> pushes;
+    for (const auto& req : reqs) {
+      const KVMeta& meta = req.first;
+      if (meta.push) pushes.push_back(&req);
+      if (!meta.push || meta.push_pull) {
+        PushAll(pushes, &ready);
+        pushes.clear();
+        AddPull(meta, req.second.keys, &ready);
+      }
+    }
+    PushAll(pushes, &ready);
+    for (const auto& req : reqs) {
+      if (req.first.push && !req.first.push_pull) server->Response(req.first);
+    }
+    for (const auto& p : ready) server->Response(p->meta, Collect(p->keys));
+  }
+
+ private:
+  /** \brief a pull waiting for the rounds of its keys to end */
+  struct PendingPull {
+    KVMeta meta;
+    SArray<Key> keys;
+    /** \brief the number of keys still in a round */
+    std::atomic<size_t> waiting{0};
+  };
+  struct KeyState {
+    /** \brief the sum of the round in progress */
+    SArray<Val> merged;
+    /** \brief the sum of the last round */
+    SArray<Val> value;
+    /** \brief the number of pushes in the round in progress */
+    int num_pushed = 0;
+    /** \brief by worker rank, whether it pushed in the round in progress */
+    std::vector<bool> pushed;
+    std::vector<std::shared_ptr<PendingPull>> pulls;
+  };
+  struct Shard {
+    std::mutex mu;
+    std::unordered_map<Key, KeyState> store;
+  };
+  static const int kNumShards = 64;
+  struct State {
+    explicit State(int n) : num_workers(n), shards(kNumShards) {}
+    const int num_workers;
+    std::vector<Shard> shards;
+  };
+
+  Shard& ShardOf(Key key) { return state_->shards[HashKeyToServer(key, kNumShards)]; }
+
+  int RankOf(const KVMeta& meta) const {
+    int rank = Postoffice::IDtoRank(meta.sender);
+    CHECK_LT(rank, state_->num_workers) << "request from worker " << meta.sender;
+    return rank;
+  }
+
+  /** \brief the value length of every key of a push */
+  static void CheckLens(const KVPairs<Val>& data, size_t* k) {
+    size_t n = data.keys.size();
+    *k = 0;
+    if (data.lens.empty()) {
+      *k = n ? data.vals.size() / n : 0;
+      CHECK_EQ(*k * n, data.vals.size());
+    } else {
+      CHECK_EQ(data.lens.size(), n);
+    }
+  }
+
+  /** \brief add a push of a worker to the rounds of its keys */
+  void Push(const KVPairs<Val>& data, int rank,
+            std::vector<std::shared_ptr<PendingPull>>* ready) {
+    size_t k;
+    CheckLens(data, &k);
+    const Val* src = data.vals.data();
+    for (size_t i = 0; i < data.keys.size(); ++i) {
+      size_t len = data.lens.empty() ? k : data.lens[i];
+      AddPushes(data.keys[i], &src, &rank, 1, len, ready);
+      src += len;
+    }
+  }
+
+  /** \brief add pushes to the rounds of their keys, the pushes to a key at once */
+  void PushAll(const std::vector<const std::pair<KVMeta, KVPairs<Val>>*>& pushes,
+               std::vector<std::shared_ptr<PendingPull>>* ready) {
+    if (pushes.size() < 2) {
+      if (pushes.size()) Push(pushes[0]->second, RankOf(pushes[0]->first), ready);
+      return;
+    }
+    // the values pushed to every key and their workers, in the order they came
+    std::unordered_map<Key, size_t> slots;
+    std::vector<Key> keys;
+    std::vector<size_t> lens;
+    std::vector<std::vector<const Val*>> srcs;
+    std::vector<std::vector<int>> ranks;
+    for (const auto* req : pushes) {
+      const auto& data = req->second;
+      int rank = RankOf(req->first);
+      size_t k;
+      CheckLens(data, &k);
+      const Val* src = data.vals.data();
+      for (size_t i = 0; i < data.keys.size(); ++i) {
+        size_t len = data.lens.empty() ? k : data.lens[i];
+        auto slot = slots.emplace(data.keys[i], keys.size());
+        if (slot.second) {
+          keys.push_back(data.keys[i]);
+          lens.push_back(len);
+          srcs.emplace_back();
+          ranks.emplace_back();
+        }
+        CHECK_EQ(lens[slot.first->second], len) << "key " << data.keys[i] << " changed length";
+        srcs[slot.first->second].push_back(src);
+        ranks[slot.first->second].push_back(rank);
+        src += len;
+      }
+    }
+    for (size_t i = 0; i < keys.size(); ++i) {
+      AddPushes(keys[i], srcs[i].data(), ranks[i].data(), srcs[i].size(), lens[i], ready);
+    }
+  }
+
+  /** \brief add num pushes of a key, from the workers of ranks, to its rounds */
+  void AddPushes(Key key, const Val* const* srcs, const int* ranks, size_t num,
+                 size_t len, std::vector<std::shared_ptr<PendingPull>>* ready) {
+    auto& shard = ShardOf(key);
+    std::lock_guard<std::mutex> lk(shard.mu);
+    auto& st = shard.store[key];
+    if (st.pushed.empty()) st.pushed.resize(state_->num_workers, false);
+    while (num) {
+      size_t m = std::min<size_t>(num, state_->num_workers - st.num_pushed);
+      if (st.num_pushed == 0) {
+        // a response may still be sending the buffer
+        if (st.merged.size() != len || st.merged.ptr().use_count() > 1) {
+          st.merged.reset(new Val[len], len, [](Val* p) { delete [] p; });
+        }
+        SumValues(st.merged.data(), srcs, m, len, false);
+      } else {
+        CHECK_EQ(st.merged.size(), len) << "key " << key << " changed length";
+        SumValues(st.merged.data(), srcs, m, len, true);
+      }
+      for (size_t j = 0; j < m; ++j) st.pushed[ranks[j]] = true;
+      srcs += m;
+      ranks += m;
+      num -= m;
+      st.num_pushed += m;
+      if (st.num_pushed == state_->num_workers) {
+        std::swap(st.merged, st.value);
+        st.num_pushed = 0;
+        st.pushed.assign(state_->num_workers, false);
+        for (auto& p : st.pulls) {
+          if (--p->waiting == 0) ready->push_back(p);
+        }
+        st.pulls.clear();
+      }
+    }
+  }
+
+  /** \brief answer a pull, or park it until the rounds of its keys end */
+  void AddPull(const KVMeta& meta, const SArray<Key>& keys,
+               std::vector<std::shared_ptr<PendingPull>>* ready) {
+    auto pending = std::make_shared<PendingPull>();
+    pending->meta = meta;
+    pending->keys = keys;
+    // held until every key is looked at
+    pending->waiting = 1;
+    int rank = RankOf(meta);
+    for (Key key : keys) {
+      auto& shard = ShardOf(key);
+      std::lock_guard<std::mutex> lk(shard.mu);
+      // a key nobody pushed yet waits for its first round
+      auto& st = shard.store[key];
+      if (st.pushed.empty()) st.pushed.resize(state_->num_workers, false);
+      // a worker ahead of the others may have started the next round
+      if (st.pushed[rank] || st.value.empty()) {
+        ++pending->waiting;
+        st.pulls.push_back(pending);
+      }
+    }
+    if (--pending->waiting == 0) ready->push_back(pending);
+  }
+
+  /** \brief the values of the last rounds of some keys */
+  KVPairs<Val> Collect(const SArray<Key>& keys) {
+    std::vector<SArray<Val>> values(keys.size());
+    for (size_t i = 0; i < keys.size(); ++i) {
+      auto& shard = ShardOf(keys[i]);
+      std::lock_guard<std::mutex> lk(shard.mu);
+      values[i] = shard.store[keys[i]].value;
+    }
+    KVPairs<Val> res;
+    res.keys = keys;
+    res.lens.resize(keys.size());
+    if (keys.size() == 1) {
+      // no copy for the common single key pull
+      res.vals = values[0];
+      res.lens[0] = res.vals.size();
+      return res;
+    }
+    size_t total = 0;
+    for (size_t i = 0; i < keys.size(); ++i) {
+      res.lens[i] = values[i].size();
+      total += values[i].size();
+    }
+    res.vals.resize(total);
+    Val* dst = res.vals.data();
+    for (const auto& value : values) {
+      memcpy(dst, value.data(), value.size() * sizeof(Val));
+      dst += value.size();
+    }
+    return res;
+  }
+
+  std::shared_ptr<State> state_;
+};
+
 
 ///////////////////////////////////////////////////////////////////////////////
 
@@ -500,6 +1479,18 @@ void KVServer<Val>::Process(const Message& msg) {
   if (msg.meta.simple_app) {
     SimpleApp::Process(msg); return;
   }
+  if (!msg.meta.control.empty()) {
+    ProcessRebalance(msg); return;
+  }
+  if (Postoffice::IsServerID(msg.meta.sender)) {
+    Import(msg); return;
+  }
+  // the keys may have moved to another server. a request without keys only
+  // carries a clock
+  int version = postoffice_->GetKeyRangeTable().version;
+  if (msg.meta.key_range_version < version && msg.data.size()) {
+    Reject(msg, version); return;
+  }
   // server group support
   int instance_worker_id = msg.meta.sender;
   int group_worker_rank = postoffice_->InstanceIDtoGroupRank(instance_worker_id);
@@ -508,6 +1499,7 @@ void KVServer<Val>::Process(const Message& msg) {
   KVMeta meta;
   meta.cmd       = msg.meta.head;
   meta.push      = msg.meta.push;
+  meta.push_pull = msg.meta.push_pull;
   meta.sender    = group_worker_id;
   meta.timestamp = msg.meta.timestamp;
   meta.customer_id = msg.meta.customer_id;
@@ -515,10 +1507,25 @@ void KVServer<Val>::Process(const Message& msg) {
   meta.addr      = msg.meta.addr;
   meta.val_len   = msg.meta.val_len;
   meta.option    = msg.meta.option;
+  meta.clock     = msg.meta.clock;
+  meta.versioned = msg.meta.versioned;
+  if (msg.meta.batch) {
+    ProcessBatch(msg, meta); return;
+  }
+  if (msg.data.empty()) {
+    // see KVWorker::Clock
+    Response(meta);
+    if (staleness_ >= 0) AdvanceClock(meta.sender, meta.clock);
+    return;
+  }
 
   KVPairs<Val> data;
   int n = msg.data.size();
-  if (n) {
+  if (msg.meta.versioned) {
+    if (!FindChanged(msg, &meta, &data)) {
+      Response(meta); return;
+    }
+  } else if (n) {
     CHECK_GE(n, 2);
     data.keys = msg.data[0];
     data.vals = msg.data[1];
@@ -528,92 +1535,568 @@ void KVServer<Val>::Process(const Message& msg) {
       CHECK_EQ(data.lens.size(), data.keys.size());
     }
   }
-  CHECK(request_handle_);
+  if (meta.push) CountLoad(data);
+  if (versioning_) TagVersions(&meta, data.keys);
+  Handle(meta, data);
+}
 
-  request_handle_(meta, data, this);
+template <typename Val>
+void KVServer<Val>::ProcessMessages(const std::vector<Message>& msgs) {
+  for (const auto& msg : msgs) Process(msg);
+  FlushRequests();
 }
 
 template <typename Val>
-void KVServer<Val>::Response(const KVMeta& req, const KVPairs<Val>& res) {
-  // server instance group support
-  int group_worker_id = req.sender;
-  int group_worker_rank = postoffice_->IDtoRank(group_worker_id);
-  int instance_worker_id = postoffice_->GroupWorkerRankToInstanceID(group_worker_rank, instance_idx_);
-  // PS_VLOG(3) << "server instance " << instance_idx_ << " response to " << instance_worker_id;
+void KVServer<Val>::FlushRequests() {
+  if (batched_.empty()) return;
+  batch_request_handle_(batched_, this);
+  batched_.clear();
+}
 
-  Message msg;
-  msg.meta.app_id = obj_->app_id();
-  msg.meta.customer_id = req.customer_id;
-  msg.meta.request     = false;
-  msg.meta.push        = req.push;
-  msg.meta.head        = req.cmd;
-  msg.meta.timestamp   = req.timestamp;
-  msg.meta.recver      = instance_worker_id;
-  msg.meta.key         = req.key;
-  msg.meta.addr        = req.addr;
-  msg.meta.val_len     = req.val_len;
-  msg.meta.option      = req.option;
-  if (res.keys.size()) {
-    msg.AddData(res.keys);
-    msg.AddData(res.vals);
-    if (res.lens.size()) {
-      msg.AddData(res.lens);
+template <typename Val>
+bool KVServer<Val>::FindChanged(const Message& msg, KVMeta* meta, KVPairs<Val>* data) {
+  CHECK(versioning_) << "CachedPull needs KVServer::set_versioning";
+  CHECK_EQ(msg.data.size(), (size_t)3);
+  SArray<Key> keys(msg.data[0]);
+  SArray<uint64_t> versions(msg.data[2]);
+  CHECK_EQ(keys.size(), versions.size());
+  {
+    // the versions sent back are the ones the keys were picked by, before the
+    // handle reads the values, which may be queued or held back while later
+    // pushes are answered
+    std::lock_guard<std::mutex> lk(version_mu_);
+    for (size_t i = 0; i < keys.size(); ++i) {
+      auto it = key_versions_.find(keys[i]);
+      uint64_t version = it == key_versions_.end() ? 0 : it->second;
+      if (version == versions[i]) continue;
+      data->keys.push_back(keys[i]);
+      meta->versions.push_back(version);
     }
   }
-  postoffice_->van()->Send(msg);
+  if (data->keys.size() == keys.size()) data->keys = keys;
+  meta->version_keys = data->keys;
+  return data->keys.size();
 }
 
 template <typename Val>
-void KVWorker<Val>::DefaultSlicer(
+void KVServer<Val>::TagVersions(KVMeta* meta, const SArray<Key>& keys) {
+  // the versions of a versioned pull were read by FindChanged
+  if (meta->push) meta->version_keys = keys;
+}
+
+template <typename Val>
+SArray<uint64_t> KVServer<Val>::ResponseVersions(const KVMeta& req, const SArray<Key>& keys) {
+  CHECK_EQ(req.version_keys.size(), req.versions.size());
+  if (keys.size() == req.version_keys.size() &&
+      std::equal(keys.begin(), keys.end(), req.version_keys.begin())) {
+    return req.versions;
+  }
+  // the handle answered other keys than asked, 0 makes the worker ask again
+  std::unordered_map<Key, uint64_t> asked;
+  for (size_t i = 0; i < req.version_keys.size(); ++i) {
+    asked[req.version_keys[i]] = req.versions[i];
+  }
+  SArray<uint64_t> versions(keys.size());
+  for (size_t i = 0; i < keys.size(); ++i) {
+    auto it = asked.find(keys[i]);
+    versions[i] = it == asked.end() ? 0 : it->second;
+  }
+  return versions;
+}
+
+template <typename Val>
+void KVServer<Val>::Handle(const KVMeta& meta, const KVPairs<Val>& data) {
+  CHECK(request_handle_ || batch_request_handle_);
+  if (staleness_ < 0) {
+    Run(meta, data); return;
+  }
+  AdvanceClock(meta.sender, meta.clock);
+  if ((!meta.push || meta.push_pull) && meta.clock - min_clock_ > staleness_) {
+    held_.emplace_back(meta, data);
+    return;
+  }
+  Run(meta, data);
+}
+
+template <typename Val>
+void KVServer<Val>::Run(const KVMeta& meta, const KVPairs<Val>& data) {
+  if (batch_request_handle_) {
+    batched_.emplace_back(meta, data); return;
+  }
+  if (executors_.empty()) {
+    request_handle_(meta, data, this); return;
+  }
+  Task task;
+  task.meta = meta;
+  task.data = data;
+  const size_t n = tasks_.size();
+  size_t first = HashKeyToServer(data.keys.size() ? data.keys[0] : 0, n);
+  // the other threads of its keys, which must not handle later requests of
+  // them before this one
+  std::vector<size_t> others;
+  std::vector<bool> seen;
+  for (Key key : data.keys) {
+    size_t index = HashKeyToServer(key, n);
+    if (index == first) continue;
+    if (seen.empty()) seen.resize(n, false);
+    if (seen[index]) continue;
+    seen[index] = true;
+    others.push_back(index);
+  }
+  num_tasks_.fetch_add(1, std::memory_order_relaxed);
+  if (others.size()) {
+    task.joint = std::make_shared<Joint>();
+    task.joint->pending = others.size() + 1;
+    for (size_t index : others) tasks_[index]->Push(Task(task));
+  }
+  tasks_[first]->Push(std::move(task));
+}
+
+template <typename Val>
+void KVServer<Val>::Execute(int index) {
+  auto& queue = *tasks_[index];
+  while (true) {
+    Task task;
+    queue.WaitAndPop(&task);
+    if (task.stop) break;
+    if (task.joint) {
+      auto& joint = *task.joint;
+      std::unique_lock<std::mutex> lk(joint.mu);
+      if (--joint.pending) {
+        joint.cond.wait(lk, [&joint] { return joint.done; });
+        continue;
+      }
+    }
+    request_handle_(task.meta, task.data, this);
+    if (task.joint) {
+      std::lock_guard<std::mutex> lk(task.joint->mu);
+      task.joint->done = true;
+      task.joint->cond.notify_all();
+    }
+    if (num_tasks_.fetch_sub(1, std::memory_order_release) == 1) {
+      std::lock_guard<std::mutex> lk(drain_mu_);
+      drain_cond_.notify_all();
+    }
+  }
+}
+
+template <typename Val>
+void KVServer<Val>::Drain() {
+  FlushRequests();
+  std::unique_lock<std::mutex> lk(drain_mu_);
+  drain_cond_.wait(lk, [this] { return !num_tasks_.load(std::memory_order_acquire); });
+}
+
+template <typename Val>
+void KVServer<Val>::set_executor(int num_threads, int first_core) {
+  CHECK(!num_threads || !batch_request_handle_)
+      << "a batch request handle does not go with set_executor";
+  for (auto& queue : tasks_) {
+    Task task{};
+    task.stop = true;
+    queue->Push(std::move(task));
+  }
+  for (auto& thread : executors_) thread.join();
+  executors_.clear();
+  tasks_.clear();
+  for (int i = 0; i < num_threads; ++i) {
+    tasks_.emplace_back(new ThreadsafeQueue<Task>());
+  }
+  for (int i = 0; i < num_threads; ++i) {
+    executors_.emplace_back(&KVServer<Val>::Execute, this, i);
+#ifdef __linux__
+    if (first_core >= 0) {
+      static const int num_cores = std::max(1u, std::thread::hardware_concurrency());
+      cpu_set_t cpus;
+      CPU_ZERO(&cpus);
+      CPU_SET((first_core + i) % num_cores, &cpus);
+      int ret = pthread_setaffinity_np(executors_.back().native_handle(), sizeof(cpus), &cpus);
+      if (ret) LOG(WARNING) << "failed to pin executor thread " << i << ": " << ret;
+    }
+#endif
+  }
+}
+
+template <typename Val>
+void KVServer<Val>::AdvanceClock(int sender, int clock) {
+  if (clocks_.empty()) clocks_.resize(postoffice_->num_workers(), 0);
+  int& worker_clock = clocks_[Postoffice::IDtoRank(sender)];
+  if (clock <= worker_clock) return;
+  worker_clock = clock;
+  int min_clock = *std::min_element(clocks_.begin(), clocks_.end());
+  if (min_clock == min_clock_) return;
+  min_clock_ = min_clock;
+  // the requests held under older key ranges were rejected by RejectHeld, so
+  // the released ones still belong to this server
+  std::vector<std::pair<KVMeta, KVPairs<Val>>> released, kept;
+  for (auto& req : held_) {
+    auto& to = req.first.clock - min_clock_ > staleness_ ? kept : released;
+    to.push_back(std::move(req));
+  }
+  held_.swap(kept);
+  for (const auto& req : released) Run(req.first, req.second);
+}
+
+template <typename Val>
+void KVServer<Val>::ProcessBatch(const Message& msg, const KVMeta& batch_meta) {
+  CHECK_EQ(msg.data.size(), (size_t)4);
+  SArray<Key> keys;
+  SArray<Val> vals;
+  SArray<int> lens;
+  SArray<int64_t> parts;
+  keys = msg.data[0];
+  vals = msg.data[1];
+  lens = msg.data[2];
+  parts = msg.data[3];
+  size_t num = parts.size() / kPartSize;
+  if (num == 0) return;
+  int id;
+  {
+    std::lock_guard<std::mutex> lk(batch_mu_);
+    id = next_batch_++;
+    auto& batch = response_batches_[id];
+    batch.recver = msg.meta.sender;
+    batch.customer_id = msg.meta.customer_id;
+    batch.timestamp = msg.meta.timestamp;
+    batch.push = msg.meta.push;
+    batch.parts = parts;
+    batch.responses.resize(num);
+    batch.rejected.resize(num, false);
+    batch.pending = num;
+  }
+  CHECK(request_handle_ || batch_request_handle_);
+  size_t key_pos = 0, val_pos = 0, len_pos = 0;
+  for (size_t i = 0; i < num; ++i) {
+    const int64_t* part = parts.data() + i * kPartSize;
+    KVMeta meta = batch_meta;
+    meta.cmd        = part[kPartCmd];
+    meta.timestamp  = part[kPartTimestamp];
+    meta.addr       = part[kPartAddr];
+    meta.val_len    = part[kPartValLen];
+    meta.batch      = id;
+    meta.batch_part = i;
+    KVPairs<Val> data;
+    data.keys = keys.segment(key_pos, key_pos + part[kPartNumKeys]);
+    data.vals = vals.segment(val_pos, val_pos + part[kPartNumVals]);
+    data.lens = lens.segment(len_pos, len_pos + part[kPartNumLens]);
+    if (data.lens.size()) CHECK_EQ(data.lens.size(), data.keys.size());
+    key_pos += part[kPartNumKeys];
+    val_pos += part[kPartNumVals];
+    len_pos += part[kPartNumLens];
+    if (meta.push) CountLoad(data);
+    if (versioning_) TagVersions(&meta, data.keys);
+    Handle(meta, data);
+  }
+}
+
+template <typename Val>
+void KVServer<Val>::RespondBatch(const KVMeta& req, const KVPairs<Val>& res, bool rejected) {
+  ResponseBatch batch;
+  {
+    std::lock_guard<std::mutex> lk(batch_mu_);
+    auto it = response_batches_.find(req.batch);
+    CHECK(it != response_batches_.end()) << "unknown batch " << req.batch;
+    it->second.responses[req.batch_part] = res;
+    it->second.rejected[req.batch_part] = rejected;
+    if (--it->second.pending) return;
+    batch = std::move(it->second);
+    response_batches_.erase(it);
+  }
+  // the responses in the order of the requests
+  std::vector<size_t> answered;
+  for (size_t i = 0; i < batch.responses.size(); ++i) {
+    if (!batch.rejected[i]) answered.push_back(i);
+  }
+  if (answered.empty()) return;
+  SArray<int64_t> parts(answered.size() * kPartSize);
+  size_t num_keys = 0, num_vals = 0, num_lens = 0;
+  for (size_t j = 0; j < answered.size(); ++j) {
+    const auto& r = batch.responses[answered[j]];
+    memcpy(parts.data() + j * kPartSize, batch.parts.data() + answered[j] * kPartSize,
+           kPartSize * sizeof(int64_t));
+    parts[j * kPartSize + kPartNumKeys] = r.keys.size();
+    parts[j * kPartSize + kPartNumVals] = r.vals.size();
+    parts[j * kPartSize + kPartNumLens] = r.lens.size();
+    num_keys += r.keys.size();
+    num_vals += r.vals.size();
+    num_lens += r.lens.size();
+  }
+  SArray<Key> keys(num_keys);
+  SArray<Val> vals(num_vals);
+  SArray<int> lens(num_lens);
+  num_keys = num_vals = num_lens = 0;
+  for (size_t i : answered) {
+    const auto& r = batch.responses[i];
+    memcpy(keys.data() + num_keys, r.keys.data(), r.keys.size() * sizeof(Key));
+    memcpy(vals.data() + num_vals, r.vals.data(), r.vals.size() * sizeof(Val));
+    memcpy(lens.data() + num_lens, r.lens.data(), r.lens.size() * sizeof(int));
+    num_keys += r.keys.size();
+    num_vals += r.vals.size();
+    num_lens += r.lens.size();
+  }
+
+  Message msg;
+  msg.meta.app_id = obj_->app_id();
+  msg.meta.customer_id = batch.customer_id;
+  msg.meta.request     = false;
+  msg.meta.push        = batch.push;
+  msg.meta.timestamp   = batch.timestamp;
+  msg.meta.recver      = batch.recver;
+  msg.meta.batch       = true;
+  msg.AddData(keys);
+  msg.AddData(vals);
+  msg.AddData(lens);
+  msg.AddData(parts);
+  postoffice_->van()->Send(msg);
+}
+
+template <typename Val>
+void KVServer<Val>::CountLoad(const KVPairs<Val>& kvs) {
+  if (!export_handle_ || kvs.keys.empty()) return;
+  size_t k = kvs.vals.size() / kvs.keys.size();
+  std::lock_guard<std::mutex> lk(load_mu_);
+  for (size_t i = 0; i < kvs.keys.size(); ++i) {
+    key_load_[kvs.keys[i]] += (kvs.lens.empty() ? k : kvs.lens[i]) * sizeof(Val);
+  }
+}
+
+template <typename Val>
+void KVServer<Val>::Reject(const Message& msg, int version) {
+  // the slice goes back as it is, so the worker can cut it by the new ranges
+  Message res;
+  res.meta.app_id = obj_->app_id();
+  res.meta.customer_id = msg.meta.customer_id;
+  res.meta.request = false;
+  res.meta.push = msg.meta.push;
+  res.meta.head = msg.meta.head;
+  res.meta.timestamp = msg.meta.timestamp;
+  res.meta.recver = msg.meta.sender;
+  res.meta.key_range_version = version;
+  res.meta.batch = msg.meta.batch;
+  res.meta.push_pull = msg.meta.push_pull;
+  res.meta.versioned = msg.meta.versioned;
+  res.meta.data_type = msg.meta.data_type;
+  res.meta.data_size = msg.meta.data_size;
+  res.data = msg.data;
+  postoffice_->van()->Send(res);
+}
+
+template <typename Val>
+void KVServer<Val>::RejectHeld(int version) {
+  for (const auto& req : held_) {
+    const KVMeta& meta = req.first;
+    const KVPairs<Val>& data = req.second;
+    // the request as the worker sent it on its own, also if it came in a batch
+    Message msg;
+    msg.meta.customer_id = meta.customer_id;
+    msg.meta.push = meta.push;
+    msg.meta.push_pull = meta.push_pull;
+    msg.meta.head = meta.cmd;
+    msg.meta.timestamp = meta.timestamp;
+    msg.meta.sender = postoffice_->GroupWorkerRankToInstanceID(
+        postoffice_->IDtoRank(meta.sender), instance_idx_);
+    msg.meta.versioned = meta.versioned;
+    msg.AddData(data.keys);
+    msg.AddData(data.vals);
+    if (data.lens.size()) msg.AddData(data.lens);
+    Reject(msg, version);
+    if (meta.batch >= 0) RespondBatch(meta, KVPairs<Val>(), true);
+  }
+  held_.clear();
+}
+
+template <typename Val>
+void KVServer<Val>::ProcessRebalance(const Message& msg) {
+  const auto cmd = msg.meta.control.cmd;
+  Message res;
+  res.meta.app_id = obj_->app_id();
+  res.meta.customer_id = obj_->app_id();
+  res.meta.request = false;
+  res.meta.recver = kScheduler;
+  res.meta.timestamp = postoffice_->van()->GetTimestamp();
+  res.meta.control.cmd = cmd;
+  if (cmd == Control::KEY_LOAD) {
+    std::vector<std::pair<Key, uint64_t>> load;
+    {
+      std::lock_guard<std::mutex> lk(load_mu_);
+      load.assign(key_load_.begin(), key_load_.end());
+      key_load_.clear();
+    }
+    res.meta.body = EncodeKeyLoad(CompactKeyLoad(load, kMaxKeyLoadSamples));
+    res.meta.key_range_version = postoffice_->GetKeyRangeTable().version;
+    postoffice_->van()->Send(res);
+    return;
+  }
+  CHECK_EQ(cmd, Control::MIGRATE);
+  // the van installed the new ranges before passing the message on
+  int version = msg.meta.key_range_version;
+  const KeyRangeTable* old_ranges = CHECK_NOTNULL(postoffice_->GetKeyRangeTable(version - 1));
+  const KeyRangeTable* new_ranges = CHECK_NOTNULL(postoffice_->GetKeyRangeTable(version));
+  int me = postoffice_->InstanceIDtoGroupRank(postoffice_->van()->my_node().id);
+  const Range& mine = old_ranges->ranges[me];
+  // the requests held back by set_staleness would run after the pairs moved,
+  // they are sliced again by the new ranges. the requests queued before the
+  // ranges changed still touch the pairs
+  RejectHeld(version);
+  Drain();
+  // every other server gets one message, maybe empty, so it knows when all
+  // of its new pairs are here
+  for (int i = 0; i < postoffice_->num_servers(); ++i) {
+    if (i == me) continue;
+    const Range& theirs = new_ranges->ranges[i];
+    Range move(std::max(mine.begin(), theirs.begin()), std::min(mine.end(), theirs.end()));
+    KVPairs<Val> kvs;
+    if (move.begin() < move.end() && export_handle_) export_handle_(move, &kvs);
+    Message out;
+    out.meta.app_id = obj_->app_id();
+    out.meta.customer_id = obj_->app_id();
+    out.meta.request = true;
+    out.meta.push = true;
+    out.meta.timestamp = postoffice_->van()->GetTimestamp();
+    out.meta.recver = postoffice_->GroupServerRankToInstanceID(i, instance_idx_);
+    out.meta.key_range_version = version;
+    if (kvs.keys.size()) {
+      out.AddData(kvs.keys);
+      out.AddData(kvs.vals);
+      if (kvs.lens.size()) out.AddData(kvs.lens);
+    }
+    postoffice_->van()->Send(out);
+  }
+  migrating_version_ = version;
+  CheckMigrated();
+}
+
+template <typename Val>
+void KVServer<Val>::Import(const Message& msg) {
+  // the pairs may arrive before this server got the new ranges, they are not
+  // owned by this server under the old ones
+  if (msg.data.size()) {
+    CHECK_GE(msg.data.size(), (size_t)2);
+    KVPairs<Val> kvs;
+    kvs.keys = msg.data[0];
+    kvs.vals = msg.data[1];
+    if (msg.data.size() > (size_t)2) kvs.lens = msg.data[2];
+    CHECK(import_handle_) << "no migrate handle";
+    Drain();
+    import_handle_(kvs);
+  }
+  ++imports_[msg.meta.key_range_version];
+  CheckMigrated();
+}
+
+template <typename Val>
+void KVServer<Val>::CheckMigrated() {
+  if (!migrating_version_) return;
+  auto it = imports_.find(migrating_version_);
+  int num = it == imports_.end() ? 0 : it->second;
+  if (num < postoffice_->num_servers() - 1) return;
+  if (it != imports_.end()) imports_.erase(it);
+  Message res;
+  res.meta.app_id = obj_->app_id();
+  res.meta.customer_id = obj_->app_id();
+  res.meta.request = false;
+  res.meta.recver = kScheduler;
+  res.meta.timestamp = postoffice_->van()->GetTimestamp();
+  res.meta.control.cmd = Control::MIGRATE;
+  res.meta.key_range_version = migrating_version_;
+  postoffice_->van()->Send(res);
+  migrating_version_ = 0;
+}
+
+template <typename Val>
+void KVServer<Val>::Response(const KVMeta& req, const KVPairs<Val>& res) {
+  if (!req.push || req.push_pull) CountLoad(res);
+  if (versioning_ && req.version_keys.size() && req.push) {
+    // the handle stored the pushed values before answering
+    std::lock_guard<std::mutex> lk(version_mu_);
+    for (Key key : req.version_keys) ++key_versions_[key];
+  }
+  if (req.batch >= 0) {
+    RespondBatch(req, res); return;
+  }
+  // server instance group support
+  int group_worker_id = req.sender;
+  int group_worker_rank = postoffice_->IDtoRank(group_worker_id);
+  int instance_worker_id = postoffice_->GroupWorkerRankToInstanceID(group_worker_rank, instance_idx_);
+  // PS_VLOG(3) << "server instance " << instance_idx_ << " response to " << instance_worker_id;
+
+  Message msg;
+  msg.meta.app_id = obj_->app_id();
+  msg.meta.customer_id = req.customer_id;
+  msg.meta.request     = false;
+  msg.meta.push        = req.push;
+  msg.meta.push_pull   = req.push_pull;
+  msg.meta.head        = req.cmd;
+  msg.meta.timestamp   = req.timestamp;
+  msg.meta.recver      = instance_worker_id;
+  msg.meta.key         = req.key;
+  msg.meta.addr        = req.addr;
+  msg.meta.val_len     = req.val_len;
+  msg.meta.option      = req.option;
+  msg.meta.versioned   = req.versioned;
+  if (res.keys.size()) {
+    msg.AddData(res.keys);
+    msg.AddData(res.vals);
+    if (req.versioned) {
+      // the versions as of the request, with the lengths in front of them
+      SArray<int> lens = res.lens;
+      if (lens.empty()) lens.resize(res.keys.size(), res.vals.size() / res.keys.size());
+      msg.AddData(lens);
+      msg.AddData(ResponseVersions(req, res.keys));
+    } else if (res.lens.size()) {
+      msg.AddData(res.lens);
+    }
+  }
+  postoffice_->van()->Send(msg);
+}
+
+template <typename Val>
+void KVWorker<Val>::DefaultSlicer(
     const KVPairs<Val>& send, const std::vector<Range>& ranges,
     typename KVWorker<Val>::SlicedKVs* sliced) {
+  // the ranges of the postoffice come with a prebuilt boundary table
+  std::unique_ptr<KeySlicer> own;
+  const KeySlicer* slicer;
+  const KeyRangeTable& table = postoffice_->GetKeyRangeTable();
+  if (&ranges == &table.ranges) {
+    slicer = &table.slicer;
+  } else {
+    own.reset(new KeySlicer(ranges));
+    slicer = own.get();
+  }
   sliced->resize(ranges.size());
 
   // find the positions in msg.key
   size_t n = ranges.size();
   std::vector<size_t> pos(n+1);
-  const Key* begin = send.keys.begin();
-  const Key* end = send.keys.end();
+  slicer->FindKeyPositions(send.keys.data(), send.keys.size(), pos.data());
+  CHECK_EQ(pos[n], send.keys.size());
   for (size_t i = 0; i < n; ++i) {
-    if (i == 0) {
-      pos[0] = std::lower_bound(begin, end, ranges[0].begin()) - begin;
-      begin += pos[0];
-    } else {
-      CHECK_EQ(ranges[i-1].end(), ranges[i].begin());
-    }
-    size_t len = std::lower_bound(begin, end, ranges[i].end()) - begin;
-    begin += len;
-    pos[i+1] = pos[i] + len;
-
     // don't send it to servers for empty kv
-    sliced->at(i).first = (len != 0);
+    sliced->at(i).first = pos[i+1] != pos[i];
   }
-  CHECK_EQ(pos[n], send.keys.size());
   if (send.keys.empty()) return;
 
   // the length of value
-  size_t k = 0, val_begin = 0, val_end = 0;
+  size_t k = 0;
+  std::vector<size_t> val_pos;
   if (send.lens.empty()) {
     k = send.vals.size() / send.keys.size();
     CHECK_EQ(k * send.keys.size(), send.vals.size());
   } else {
     CHECK_EQ(send.keys.size(), send.lens.size());
+    val_pos.resize(n+1);
+    slicer->FindValuePositions(send.lens.data(), pos.data(), val_pos.data());
   }
 
   // slice
   for (size_t i = 0; i < n; ++i) {
-    if (pos[i+1] == pos[i]) {
-      sliced->at(i).first = false;
-      continue;
-    }
-    sliced->at(i).first = true;
+    if (!sliced->at(i).first) continue;
     auto& kv = sliced->at(i).second;
     kv.keys = send.keys.segment(pos[i], pos[i+1]);
     if (send.lens.size()) {
       kv.lens = send.lens.segment(pos[i], pos[i+1]);
-      for (int l : kv.lens) val_end += l;
-      kv.vals = send.vals.segment(val_begin, val_end);
-      val_begin = val_end;
+      kv.vals = send.vals.segment(val_pos[i], val_pos[i+1]);
     } else {
       kv.vals = send.vals.segment(pos[i]*k, pos[i+1]*k);
     }
@@ -621,24 +2104,112 @@ void KVWorker<Val>::DefaultSlicer(
 }
 
 template <typename Val>
-void KVWorker<Val>::Send(int timestamp, bool push, int cmd, KVPairs<Val>& kvs) {
+void KVWorker<Val>::HashSlicer(
+    const KVPairs<Val>& send, const std::vector<Range>& ranges,
+    typename KVWorker<Val>::SlicedKVs* sliced, bool with_vals,
+    std::vector<size_t>* offsets, std::vector<uint32_t>* perm) {
+  std::vector<size_t> own_offsets;
+  std::vector<uint32_t> own_perm;
+  if (!offsets) offsets = &own_offsets;
+  if (!perm) perm = &own_perm;
+  size_t num = ranges.size();
+  size_t n = send.keys.size();
+  offsets->resize(num + 1);
+  perm->resize(n);
+  SArray<Key> keys(n);
+  HashScatterKeys(send.keys.data(), n, num, offsets->data(), perm->data(), keys.data());
+  sliced->resize(num);
+  for (size_t i = 0; i < num; ++i) {
+    sliced->at(i).first = (*offsets)[i+1] != (*offsets)[i];
+  }
+  if (n == 0) return;
+
+  // gather the values in the scattered order
+  const uint32_t* p = perm->data();
+  SArray<Val> vals;
+  SArray<int> lens;
+  std::vector<size_t> val_pos;
+  size_t k = 0;
+  if (send.lens.empty()) {
+    k = send.vals.size() / n;
+    CHECK_EQ(k * n, send.vals.size());
+    if (with_vals) {
+      vals.resize(n * k);
+      for (size_t j = 0; j < n; ++j) {
+        memcpy(vals.data() + j * k, send.vals.data() + p[j] * k, k * sizeof(Val));
+      }
+    }
+  } else {
+    CHECK_EQ(send.lens.size(), n);
+    lens.resize(n);
+    for (size_t j = 0; j < n; ++j) lens[j] = send.lens[p[j]];
+    if (with_vals) {
+      std::vector<size_t> pos(n + 1, 0);
+      for (size_t i = 0; i < n; ++i) pos[i + 1] = pos[i] + send.lens[i];
+      CHECK_EQ(pos[n], send.vals.size());
+      vals.resize(pos[n]);
+      val_pos.resize(num + 1, 0);
+      size_t v = 0;
+      for (size_t i = 0, j = 0; i < num; ++i) {
+        val_pos[i] = v;
+        for (; j < (*offsets)[i+1]; ++j) {
+          memcpy(vals.data() + v, send.vals.data() + pos[p[j]], lens[j] * sizeof(Val));
+          v += lens[j];
+        }
+      }
+      val_pos[num] = v;
+    }
+  }
+
+  // slice
+  for (size_t i = 0; i < num; ++i) {
+    if (!sliced->at(i).first) continue;
+    auto& kv = sliced->at(i).second;
+    size_t begin = (*offsets)[i], end = (*offsets)[i+1];
+    kv.keys = keys.segment(begin, end);
+    if (lens.size()) {
+      kv.lens = lens.segment(begin, end);
+      if (with_vals) kv.vals = vals.segment(val_pos[i], val_pos[i+1]);
+    } else if (with_vals) {
+      kv.vals = vals.segment(begin * k, end * k);
+    }
+  }
+}
+
+template <typename Val>
+void KVWorker<Val>::Send(Request* req, bool push, bool pull, int cmd,
+                         KVPairs<Val>& kvs) {
+  int timestamp = req->timestamp;
   // slice the message
+  const KeyRangeTable& table = postoffice_->GetKeyRangeTable();
   SlicedKVs sliced;
-  slicer_(kvs, Postoffice::GetWorker()->GetServerKeyRanges(), &sliced);
+  if (hash_slicing_) {
+    // keep the permutation to put the pulled values back
+    HashSlicer(kvs, table.ranges, &sliced, push, &req->hash_offsets, &req->hash_perm);
+    req->pull_vals = nullptr;
+  } else {
+    slicer_(kvs, table.ranges, &sliced);
+  }
 
   // need to add response first, since it will not always trigger the callback
   int skipped = 0;
   for (size_t i = 0; i < sliced.size(); ++i) {
     if (!sliced[i].first) ++skipped;
   }
+  if (pull && req->pull_vals) PlanPull(req, kvs.keys, sliced);
+  AddResponse(req, skipped);
   obj_->AddResponse(timestamp, skipped);
-  if ((size_t)skipped == sliced.size()) {
-    RunCallback(timestamp);
-  }
+  SendSlices(timestamp, push, pull, cmd, table.version, &sliced);
+}
+
+template <typename Val>
+void KVWorker<Val>::SendSlices(int timestamp, bool push, bool pull, int cmd,
+                               int version, SlicedKVs* sliced,
+                               const std::vector<SArray<uint64_t>>* versions) {
   DeviceType src_dev_type, dst_dev_type;
   int src_dev_id, dst_dev_id;
-  for (size_t i = 0; i < sliced.size(); ++i) {
-    auto& s = sliced[i];
+  for (size_t i = 0; i < sliced->size(); ++i) {
+    auto& s = sliced->at(i);
     if (!s.first) continue;
 
     // worker instance group support
@@ -651,9 +2222,13 @@ void KVWorker<Val>::Send(int timestamp, bool push, int cmd, KVPairs<Val>& kvs) {
     msg.meta.customer_id = obj_->customer_id();
     msg.meta.request     = true;
     msg.meta.push        = push;
+    msg.meta.push_pull   = push && pull;
     msg.meta.head        = cmd;
     msg.meta.timestamp   = timestamp;
     msg.meta.recver      = instance_server_id;
+    msg.meta.key_range_version = version;
+    msg.meta.clock       = clock_.load(std::memory_order_relaxed);
+    msg.meta.versioned   = versions != nullptr;
     auto& kvs = s.second;
     msg.meta.addr = reinterpret_cast<uint64_t>(kvs.vals.data());
     msg.meta.val_len = kvs.vals.size();
@@ -668,7 +2243,9 @@ void KVWorker<Val>::Send(int timestamp, bool push, int cmd, KVPairs<Val>& kvs) {
     if (kvs.keys.size()) {
       msg.AddData(kvs.keys);
       msg.AddData(kvs.vals);
-      if (kvs.lens.size()) {
+      if (versions) {
+        msg.AddData(versions->at(i));
+      } else if (kvs.lens.size()) {
         msg.AddData(kvs.lens);
       }
     }
@@ -678,61 +2255,597 @@ void KVWorker<Val>::Send(int timestamp, bool push, int cmd, KVPairs<Val>& kvs) {
       msg.meta.dst_dev_type = dst_dev_type;
       msg.meta.dst_dev_id = dst_dev_id;
     }
+    if (coalesce_us_ > 0 && !msg.meta.push_pull && !versions && kvs.keys.size()) {
+      Coalesce(i, msg, kvs);
+      continue;
+    }
     postoffice_->van()->Send(msg);
   }
 }
 
+template <typename Val>
+void KVWorker<Val>::set_coalescing(int window_us, size_t max_bytes) {
+  {
+    std::lock_guard<std::mutex> lk(batch_mu_);
+    coalesce_us_ = window_us;
+    coalesce_bytes_ = max_bytes;
+    batch_stop_ = window_us <= 0;
+  }
+  batch_cond_.notify_all();
+  if (window_us <= 0) {
+    // the thread sends what is left
+    if (batch_thread_.joinable()) batch_thread_.join();
+    return;
+  }
+  if (!batch_thread_.joinable()) {
+    batch_thread_ = std::thread(&KVWorker<Val>::FlushBatches, this);
+  }
+}
+
+template <typename Val>
+int KVWorker<Val>::Clock(const Callback& cb) {
+  // the batches hold requests of the ending iteration
+  std::vector<Message> ready;
+  {
+    std::lock_guard<std::mutex> lk(batch_mu_);
+    for (size_t i = 0; i < batches_.size(); ++i) {
+      if (batches_[i].parts.size()) ready.push_back(TakeBatch(i / 2, i % 2));
+    }
+  }
+  for (auto& msg : ready) postoffice_->van()->Send(msg);
+
+  Request* req = NewRequest(cb);
+  int ts = req->timestamp;
+  clock_.fetch_add(1, std::memory_order_relaxed);
+  // a request without keys to every server only carries the clock
+  const KeyRangeTable& table = postoffice_->GetKeyRangeTable();
+  SlicedKVs sliced(table.ranges.size(), std::make_pair(true, KVPairs<Val>()));
+  SendSlices(ts, true, false, 0, table.version, &sliced);
+  return ts;
+}
+
+template <typename Val>
+int KVWorker<Val>::CachedPull(const SArray<Key>& keys, SArray<Val>* vals,
+                              SArray<int>* lens, int cmd, const Callback& cb) {
+  CHECK_NOTNULL(vals);
+  const int clock = this->clock();
+  const size_t n = keys.size();
+  // the cached values of every key, and the cached versions of the keys to
+  // ask the servers for
+  auto rows = std::make_shared<std::vector<SArray<Val>>>(n);
+  auto asked = std::make_shared<std::unordered_map<Key, uint64_t>>();
+  KVPairs<Val> ask;
+  {
+    std::lock_guard<std::mutex> lk(cache_mu_);
+    for (size_t i = 0; i < n; ++i) {
+      uint64_t version = kNoVersion;
+      auto it = cache_.find(keys[i]);
+      if (it != cache_.end()) {
+        auto& entry = it->second;
+        cache_lru_.splice(cache_lru_.begin(), cache_lru_, entry.lru);
+        (*rows)[i] = entry.vals;
+        if (clock - entry.clock <= cache_staleness_) continue;
+        version = entry.version;
+      }
+      if (asked->emplace(keys[i], version).second) ask.keys.push_back(keys[i]);
+    }
+  }
+
+  Request* req = NewRequest(nullptr);
+  int ts = req->timestamp;
+  req->cached = true;
+  req->callback = [this, req, keys, vals, lens, cb, rows, asked, clock]() {
+    // a server only sends the values which changed
+    std::unordered_map<Key, SArray<Val>> changed;
+    {
+      std::lock_guard<std::mutex> lk(cache_mu_);
+      for (size_t r = 0; r < req->kvs.size(); ++r) {
+        const auto& s = req->kvs[r];
+        const auto& versions = req->versions[r];
+        size_t k = s.lens.empty() ? s.vals.size() / s.keys.size() : 0;
+        size_t offset = 0;
+        for (size_t j = 0; j < s.keys.size(); ++j) {
+          size_t len = s.lens.empty() ? k : s.lens[j];
+          changed[s.keys[j]] = s.vals.segment(offset, offset + len);
+          if (versions.size()) {
+            CacheValues(s.keys[j], changed[s.keys[j]], versions[j], clock);
+          }
+          offset += len;
+        }
+      }
+      // the others are still current
+      for (const auto& a : *asked) {
+        if (changed.count(a.first)) continue;
+        CHECK(a.second != kNoVersion) << "lost key " << a.first;
+        auto it = cache_.find(a.first);
+        if (it != cache_.end() && it->second.version == a.second) {
+          it->second.clock = std::max(it->second.clock, clock);
+        }
+      }
+    }
+    size_t total = 0;
+    for (size_t i = 0; i < keys.size(); ++i) {
+      auto it = changed.find(keys[i]);
+      if (it != changed.end()) (*rows)[i] = it->second;
+      total += (*rows)[i].size();
+    }
+    if (vals->empty()) {
+      vals->resize(total);
+    } else {
+      CHECK_GE(vals->size(), total);
+    }
+    if (lens) {
+      if (lens->empty()) {
+        lens->resize(keys.size());
+      } else {
+        CHECK_EQ(lens->size(), keys.size());
+      }
+    }
+    Val* p_vals = vals->data();
+    for (size_t i = 0; i < keys.size(); ++i) {
+      const auto& row = (*rows)[i];
+      memcpy(p_vals, row.data(), row.size() * sizeof(Val));
+      p_vals += row.size();
+      if (lens) (*lens)[i] = row.size();
+    }
+    if (cb) cb();
+  };
+
+  const KeyRangeTable& table = postoffice_->GetKeyRangeTable();
+  SlicedKVs sliced;
+  slicer_(ask, table.ranges, &sliced);
+  std::vector<SArray<uint64_t>> versions(sliced.size());
+  int skipped = 0;
+  for (size_t i = 0; i < sliced.size(); ++i) {
+    if (!sliced[i].first) {
+      ++skipped;
+      continue;
+    }
+    for (Key key : sliced[i].second.keys) versions[i].push_back(asked->at(key));
+  }
+  AddResponse(req, skipped);
+  obj_->AddResponse(ts, skipped);
+  SendSlices(ts, false, true, cmd, table.version, &sliced, &versions);
+  return ts;
+}
+
+template <typename Val>
+void KVWorker<Val>::CacheValues(Key key, const SArray<Val>& vals,
+                                uint64_t version, int clock) {
+  auto it = cache_.find(key);
+  if (it == cache_.end()) {
+    cache_lru_.push_front(key);
+    it = cache_.emplace(key, CacheEntry()).first;
+    it->second.lru = cache_lru_.begin();
+  } else {
+    cache_bytes_ -= it->second.vals.size() * sizeof(Val);
+    cache_lru_.splice(cache_lru_.begin(), cache_lru_, it->second.lru);
+  }
+  // a new buffer, pulls in flight may still read the old one
+  SArray<Val> copy;
+  copy.CopyFrom(vals);
+  auto& entry = it->second;
+  entry.vals = copy;
+  entry.version = version;
+  entry.clock = clock;
+  cache_bytes_ += vals.size() * sizeof(Val);
+  EvictCache();
+}
+
+template <typename Val>
+void KVWorker<Val>::EvictCache() {
+  while (cache_bytes_ > cache_max_bytes_ && cache_lru_.size()) {
+    auto it = cache_.find(cache_lru_.back());
+    cache_bytes_ -= it->second.vals.size() * sizeof(Val);
+    cache_.erase(it);
+    cache_lru_.pop_back();
+  }
+}
+
+template <typename Val>
+void KVWorker<Val>::Coalesce(int server, const Message& msg, const KVPairs<Val>& kvs) {
+  std::vector<Message> ready;
+  bool first = false;
+  {
+    std::lock_guard<std::mutex> lk(batch_mu_);
+    if (batches_.empty()) batches_.resize(2 * postoffice_->num_servers());
+    auto& batch = batches_[2 * server + msg.meta.push];
+    if (batch.parts.size() && (batch.version != msg.meta.key_range_version ||
+                               batch.clock != msg.meta.clock)) {
+      ready.push_back(TakeBatch(server, msg.meta.push));
+    }
+    if (batch.parts.empty()) {
+      first = true;
+      batch.version = msg.meta.key_range_version;
+      batch.clock = msg.meta.clock;
+      batch.deadline = std::chrono::steady_clock::now() +
+                       std::chrono::microseconds(coalesce_us_);
+    }
+    int64_t part[kPartSize];
+    part[kPartTimestamp] = msg.meta.timestamp;
+    part[kPartCmd] = msg.meta.head;
+    part[kPartNumKeys] = kvs.keys.size();
+    part[kPartNumVals] = kvs.vals.size();
+    part[kPartNumLens] = kvs.lens.size();
+    part[kPartValLen] = msg.meta.val_len;
+    part[kPartAddr] = msg.meta.addr;
+    // grow geometrically, SArray::append only grows to the size needed
+    auto append = [](const auto& from, auto* to) {
+      if (from.empty()) return;
+      if (to->capacity() < to->size() + from.size()) {
+        to->reserve(std::max(2 * to->capacity(), to->size() + from.size()));
+      }
+      to->append(from);
+    };
+    append(SArray<int64_t>(part, kPartSize), &batch.parts);
+    append(kvs.keys, &batch.keys);
+    append(kvs.vals, &batch.vals);
+    append(kvs.lens, &batch.lens);
+    batch.bytes += kvs.keys.size() * sizeof(Key) + kvs.vals.size() * sizeof(Val) +
+                   kvs.lens.size() * sizeof(int);
+    if (batch.bytes >= coalesce_bytes_) {
+      first = false;
+      ready.push_back(TakeBatch(server, msg.meta.push));
+    }
+  }
+  // a new deadline for the flushing thread
+  if (first) batch_cond_.notify_one();
+  for (auto& m : ready) postoffice_->van()->Send(m);
+}
+
+template <typename Val>
+Message KVWorker<Val>::TakeBatch(int server, bool push) {
+  auto& batch = batches_[2 * server + push];
+  Message msg;
+  msg.meta.app_id = obj_->app_id();
+  msg.meta.customer_id = obj_->customer_id();
+  msg.meta.request     = true;
+  msg.meta.push        = push;
+  msg.meta.timestamp   = batch.parts[kPartTimestamp];
+  msg.meta.recver      = postoffice_->GroupServerRankToInstanceID(server, instance_idx_);
+  msg.meta.key_range_version = batch.version;
+  msg.meta.clock       = batch.clock;
+  msg.meta.batch       = true;
+  msg.AddData(batch.keys);
+  msg.AddData(batch.vals);
+  msg.AddData(batch.lens);
+  msg.AddData(batch.parts);
+  batch = Batch();
+  return msg;
+}
+
+template <typename Val>
+void KVWorker<Val>::FlushBatches() {
+  std::vector<Message> ready;
+  std::unique_lock<std::mutex> lk(batch_mu_);
+  while (true) {
+    auto now = std::chrono::steady_clock::now();
+    auto next = std::chrono::steady_clock::time_point::max();
+    for (size_t i = 0; i < batches_.size(); ++i) {
+      auto& batch = batches_[i];
+      if (batch.parts.empty()) continue;
+      if (batch_stop_ || batch.deadline <= now) {
+        ready.push_back(TakeBatch(i / 2, i % 2));
+      } else {
+        next = std::min(next, batch.deadline);
+      }
+    }
+    if (ready.size()) {
+      lk.unlock();
+      for (auto& msg : ready) postoffice_->van()->Send(msg);
+      ready.clear();
+      lk.lock();
+      continue;
+    }
+    if (batch_stop_) return;
+    if (next == std::chrono::steady_clock::time_point::max()) {
+      batch_cond_.wait(lk);
+    } else {
+      batch_cond_.wait_until(lk, next);
+    }
+  }
+}
+
 
 template <typename Val>
 void KVWorker<Val>::Process(const Message& msg) {
   if (msg.meta.simple_app) {
     SimpleApp::Process(msg); return;
   }
-  // store the data for pulling
-  int ts = msg.meta.timestamp;
-  if (!msg.meta.push && msg.data.size()) {
+  if (msg.meta.batch) {
+    ProcessBatch(msg); return;
+  }
+  Request* req = FindRequest(msg.meta.timestamp);
+  // store the data for pulling. the responses of a request are processed one
+  // by one by the customer thread. a response with a key range version
+  // returns a rejected slice
+  KVPairs<Val> kvs;
+  if (msg.data.size()) {
     CHECK_GE(msg.data.size(), (size_t)2);
-    KVPairs<Val> kvs;
     kvs.keys = msg.data[0];
     kvs.vals = msg.data[1];
     if (msg.data.size() > (size_t)2) {
       kvs.lens = msg.data[2];
     }
-    mu_.lock();
-    recv_kvs_[ts].push_back(kvs);
-    mu_.unlock();
+  }
+  if (msg.meta.key_range_version) {
+    // a rejected CachedPull is asked again without the versions, and gets
+    // all the values
+    if (msg.meta.versioned) kvs.lens.clear();
+    Resend(req, msg.meta.timestamp, msg.meta.push,
+           !msg.meta.push || msg.meta.push_pull, msg.meta.head,
+           msg.meta.key_range_version, kvs);
+  } else if ((!msg.meta.push || msg.meta.push_pull) && msg.data.size()) {
+    AddPulled(req, postoffice_->InstanceIDtoGroupRank(msg.meta.sender), std::move(kvs));
+    if (req->cached) {
+      req->versions.push_back(msg.meta.versioned ? SArray<uint64_t>(msg.data[3])
+                                                 : SArray<uint64_t>());
+    }
+  }
+  AddResponse(req, 1);
+}
 
+template <typename Val>
+void KVWorker<Val>::ProcessBatch(const Message& msg) {
+  CHECK_EQ(msg.data.size(), (size_t)4);
+  SArray<Key> keys;
+  SArray<Val> vals;
+  SArray<int> lens;
+  SArray<int64_t> parts;
+  keys = msg.data[0];
+  vals = msg.data[1];
+  lens = msg.data[2];
+  parts = msg.data[3];
+  int server = postoffice_->InstanceIDtoGroupRank(msg.meta.sender);
+  size_t key_pos = 0, val_pos = 0, len_pos = 0;
+  for (size_t p = 0; p + kPartSize <= parts.size(); p += kPartSize) {
+    const int64_t* part = parts.data() + p;
+    KVPairs<Val> kvs;
+    kvs.keys = keys.segment(key_pos, key_pos + part[kPartNumKeys]);
+    kvs.vals = vals.segment(val_pos, val_pos + part[kPartNumVals]);
+    kvs.lens = lens.segment(len_pos, len_pos + part[kPartNumLens]);
+    key_pos += part[kPartNumKeys];
+    val_pos += part[kPartNumVals];
+    len_pos += part[kPartNumLens];
+    // as if each response came in its own message
+    int ts = part[kPartTimestamp];
+    Request* req = FindRequest(ts);
+    if (msg.meta.key_range_version) {
+      Resend(req, ts, msg.meta.push, !msg.meta.push, part[kPartCmd],
+             msg.meta.key_range_version, kvs);
+    } else if (!msg.meta.push && kvs.keys.size()) {
+      AddPulled(req, server, std::move(kvs));
+    }
+    AddResponse(req, 1);
+    obj_->AddResponse(ts, 1);
   }
-  // finished, run callbacks
-  if (obj_->NumResponse(ts) == Postoffice::GetWorker()->num_servers() - 1)  {
-    RunCallback(ts);
+}
+
+template <typename Val>
+void KVWorker<Val>::AddPulled(Request* req, int server, KVPairs<Val>&& kvs) {
+  if (req->pull_vals && !req->place_failed) PlacePull(req, server, kvs);
+  req->kvs.push_back(std::move(kvs));
+}
+
+template <typename Val>
+void KVWorker<Val>::Resend(Request* req, int timestamp, bool push, bool pull,
+                           int cmd, int version, const KVPairs<Val>& kvs) {
+  // the server switched to newer key ranges, the worker gets them once every
+  // server holds its new pairs
+  postoffice_->WaitKeyRangeVersion(version);
+  const KeyRangeTable& table = postoffice_->GetKeyRangeTable();
+  SlicedKVs sliced;
+  slicer_(kvs, table.ranges, &sliced);
+  int num = 0;
+  for (const auto& s : sliced) num += s.first;
+  // the responses of the new slices replace the rejection, which is counted
+  // as a response by the caller
+  req->num_pending.fetch_add(num, std::memory_order_relaxed);
+  obj_->AddResponse(timestamp, -num);
+  // the slices come back from other servers than planned
+  req->place_failed = true;
+  SendSlices(timestamp, push, pull, cmd, table.version, &sliced);
+}
+
+template <typename Val>
+void KVWorker<Val>::PlanPull(Request* req, const SArray<Key>& keys,
+                             const SlicedKVs& sliced) {
+  const size_t kNone = std::numeric_limits<size_t>::max();
+  req->pull_offsets.assign(sliced.size(), std::make_pair(kNone, kNone));
+  size_t key_pos = 0, val_pos = 0;
+  for (size_t i = 0; i < sliced.size(); ++i) {
+    const auto& slice = sliced[i].second.keys;
+    if (!sliced[i].first || slice.empty()) continue;
+    // the default slicer cuts segments out of the keys in server order, other
+    // slicers fall back to merging in the callback
+    if (slice.data() < keys.data() + key_pos ||
+        slice.data() + slice.size() > keys.data() + keys.size()) {
+      req->place_failed = true;
+      return;
+    }
+    size_t key_offset = slice.data() - keys.data();
+    if (req->pull_lens) {
+      for (; key_pos < key_offset; ++key_pos) val_pos += req->pull_lens[key_pos];
+    }
+    key_pos = key_offset;
+    req->pull_offsets[i] = std::make_pair(key_offset, req->pull_lens ? val_pos : kNone);
+  }
+}
+
+template <typename Val>
+void KVWorker<Val>::PlacePull(Request* req, int server, const KVPairs<Val>& kvs) {
+  size_t n = kvs.keys.size();
+  if (server < 0 || (size_t)server >= req->pull_offsets.size() || n == 0 ||
+      req->pull_offsets[server].first == std::numeric_limits<size_t>::max()) {
+    req->place_failed = true;
+    return;
+  }
+  // the response must hold exactly the keys sent to this server
+  size_t key_offset = req->pull_offsets[server].first;
+  if (key_offset + n > req->pull_keys_size ||
+      kvs.keys.front() != req->pull_keys[key_offset] ||
+      kvs.keys.back() != req->pull_keys[key_offset + n - 1]) {
+    req->place_failed = true;
+    return;
+  }
+  size_t val_offset;
+  if (req->pull_lens) {
+    // the lengths must be the expected ones, otherwise the value offsets of
+    // the following servers are unknown
+    if (kvs.lens.size() != n) {
+      req->place_failed = true;
+      return;
+    }
+    size_t total = 0;
+    for (size_t i = 0; i < n; ++i) {
+      if (kvs.lens[i] != req->pull_lens[key_offset + i]) {
+        req->place_failed = true;
+        return;
+      }
+      total += kvs.lens[i];
+    }
+    if (total != kvs.vals.size()) {
+      req->place_failed = true;
+      return;
+    }
+    val_offset = req->pull_offsets[server].second;
+  } else {
+    if (kvs.vals.size() % n) {
+      req->place_failed = true;
+      return;
+    }
+    val_offset = key_offset * (kvs.vals.size() / n);
+  }
+  if (val_offset + kvs.vals.size() > req->pull_vals_size) {
+    req->place_failed = true;
+    return;
   }
+  memcpy(req->pull_vals + val_offset, kvs.vals.data(), kvs.vals.size() * sizeof(Val));
+  req->num_placed_keys += n;
 }
+
+template <typename Val>
+void KVWorker<Val>::AddResponse(Request* req, int num) {
+  if (req->num_pending.fetch_sub(num, std::memory_order_acq_rel) != num) return;
+  // finished, run the callback and release the request
+  if (req->callback) {
+    req->callback();
+    req->callback = nullptr;
+  }
+  req->kvs.clear();
+  req->versions.clear();
+  req->cached = false;
+  req->hash_offsets.clear();
+  req->hash_perm.clear();
+  req->pull_vals = nullptr;
+  req->pull_lens = nullptr;
+  req->num_placed_keys = 0;
+  req->place_failed = false;
+  req->timestamp.store(-1, std::memory_order_release);
+}
+
 template <typename Val>
-void KVWorker<Val>::RunCallback(int timestamp) {
-  mu_.lock();
-  auto it = callbacks_.find(timestamp);
-  if (it != callbacks_.end()) {
-    mu_.unlock();
+typename KVWorker<Val>::Request* KVWorker<Val>::NewRequest(const Callback& cb) {
+  int ts = obj_->NewRequest(kServerGroup);
+  std::lock_guard<std::mutex> lk(mu_);
+  auto table = requests_.load(std::memory_order_relaxed);
+  if (!table || (table->slots[ts & table->mask] &&
+                 table->slots[ts & table->mask]->timestamp.load(std::memory_order_acquire) != -1)) {
+    GrowRequestTable(ts);
+    table = requests_.load(std::memory_order_relaxed);
+  }
+  auto& req = table->slots[ts & table->mask];
+  if (!req) {
+    if (free_requests_.empty()) {
+      request_pool_.emplace_back(new Request());
+      free_requests_.push_back(request_pool_.back().get());
+    }
+    req = free_requests_.back();
+    free_requests_.pop_back();
+  }
+  req->callback = cb;
+  req->num_pending.store(postoffice_->num_servers(), std::memory_order_relaxed);
+  req->timestamp.store(ts, std::memory_order_release);
+  return req;
+}
 
-    CHECK(it->second);
-    it->second();
+template <typename Val>
+void KVWorker<Val>::GrowRequestTable(int timestamp) {
+  auto old_table = requests_.load(std::memory_order_relaxed);
+  // the requests in flight with their timestamps. a request may finish in the
+  // meantime, it then sits as a free request in the slot of its old timestamp
+  std::vector<std::pair<int, Request*>> live;
+  size_t size = kInitRequestTableSize;
+  if (old_table) {
+    size = old_table->slots.size() * 2;
+    for (auto req : old_table->slots) {
+      if (!req) continue;
+      int ts = req->timestamp.load(std::memory_order_acquire);
+      if (ts != -1) {
+        live.emplace_back(ts, req);
+      } else {
+        free_requests_.push_back(req);
+      }
+    }
+  }
+  // the new timestamp and the requests in flight must map to distinct slots
+  for (bool collision = true; collision; ) {
+    std::vector<bool> used(size, false);
+    used[timestamp & (size - 1)] = true;
+    collision = false;
+    for (const auto& req : live) {
+      size_t idx = req.first & (size - 1);
+      if (used[idx]) {
+        collision = true;
+        size *= 2;
+        break;
+      }
+      used[idx] = true;
+    }
+  }
+  auto table = new RequestTable(size);
+  for (const auto& req : live) table->slots[req.first & table->mask] = req.second;
+  request_tables_.emplace_back(table);
+  requests_.store(table, std::memory_order_release);
+}
 
-    mu_.lock();
-    callbacks_.erase(it);
+template <typename Val>
+typename KVWorker<Val>::Request* KVWorker<Val>::FindRequest(int timestamp) {
+  auto table = requests_.load(std::memory_order_acquire);
+  if (table) {
+    auto req = table->slots[timestamp & table->mask];
+    if (req && req->timestamp.load(std::memory_order_acquire) == timestamp) return req;
   }
-  mu_.unlock();
+  // the table was just replaced, look it up again with the lock
+  std::lock_guard<std::mutex> lk(mu_);
+  table = requests_.load(std::memory_order_relaxed);
+  CHECK(table) << "no request is in flight";
+  auto req = table->slots[timestamp & table->mask];
+  CHECK(req && req->timestamp.load(std::memory_order_acquire) == timestamp)
+      << "response of unknown request " << timestamp;
+  return req;
 }
 
 template <typename Val>
 template <typename C, typename D>
 int KVWorker<Val>::Pull_(
-    const SArray<Key>& keys, C* vals, D* lens, int cmd, const Callback& cb) {
-  int ts = obj_->NewRequest(kServerGroup);
-  AddCallback(ts, [this, ts, keys, vals, lens, cb]() mutable {
-      mu_.lock();
-      auto& kvs = recv_kvs_[ts];
-      mu_.unlock();
+    const SArray<Key>& keys, C* vals, D* lens, int cmd, const Callback& cb,
+    const KVPairs<Val>* push) {
+  Request* req = NewRequest(nullptr);
+  int ts = req->timestamp;
+  req->callback = [this, req, keys, vals, lens, cb]() mutable {
+      if (!req->hash_offsets.empty()) {
+        MergeHashPull(req, keys, vals, lens);
+        if (cb) cb();
+        return;
+      }
+      if (req->pull_vals && !req->place_failed) {
+        // every response is already in place
+        CHECK_EQ(req->num_placed_keys, keys.size()) << "lost some servers?";
+        if (cb) cb();
+        return;
+      }
+      auto& kvs = req->kvs;
 
       // do check
       size_t total_key = 0, total_val = 0;
@@ -778,18 +2891,111 @@ int KVWorker<Val>::Pull_(
         }
       }
 
-      mu_.lock();
-      recv_kvs_.erase(ts);
-      mu_.unlock();
       if (cb) cb();
-    });
+    };
+  if (!is_worker_zpull_ && !vals->empty() && !keys.empty() &&
+      (!lens || lens->size() == keys.size())) {
+    req->pull_vals = vals->data();
+    req->pull_vals_size = vals->size();
+    req->pull_lens = lens ? lens->data() : nullptr;
+    req->pull_keys = keys.data();
+    req->pull_keys_size = keys.size();
+  }
 
   KVPairs<Val> kvs;
   kvs.keys = keys;
-  kvs.vals = *vals;
-  Send(ts, false, cmd, kvs);
+  if (push) {
+    kvs.vals = push->vals;
+    kvs.lens = push->lens;
+  } else {
+    kvs.vals = *vals;
+  }
+  Send(req, push != nullptr, true, cmd, kvs);
   return ts;
 }
 
+template <typename Val>
+template <typename C, typename D>
+void KVWorker<Val>::MergeHashPull(Request* req, const SArray<Key>& keys,
+                                  C* vals, D* lens) {
+  const auto& kvs = req->kvs;
+  const size_t* offsets = req->hash_offsets.data();
+  const uint32_t* perm = req->hash_perm.data();
+  const size_t num = req->hash_offsets.size() - 1;
+  const size_t n = keys.size();
+
+  // do check, and find where the keys of every response are scattered
+  std::vector<size_t> begin(kvs.size());
+  size_t total_key = 0, total_val = 0;
+  for (size_t i = 0; i < kvs.size(); ++i) {
+    const auto& s = kvs[i];
+    CHECK(s.keys.size()) << "empty response";
+    size_t server = HashKeyToServer(s.keys.front(), num);
+    begin[i] = offsets[server];
+    CHECK_EQ(s.keys.size(), offsets[server+1] - offsets[server])
+        << "unmatched keys size from one server";
+    CHECK_EQ(s.keys.front(), keys[perm[begin[i]]]) << "keys reordered by a server";
+    CHECK_EQ(s.lens.empty(), kvs[0].lens.empty());
+    if (lens) CHECK_EQ(s.lens.size(), s.keys.size());
+    total_key += s.keys.size();
+    total_val += s.vals.size();
+  }
+  CHECK_EQ(total_key, n) << "lost some servers?";
+
+  CHECK_NOTNULL(vals);
+  if (vals->empty()) {
+    vals->resize(total_val);
+  } else {
+    CHECK_GE(vals->size(), total_val);
+  }
+  if (is_worker_zpull_) return;
+
+  Val* p_vals = vals->data();
+  int* p_lens = nullptr;
+  if (lens) {
+    if (lens->empty()) {
+      lens->resize(n);
+    } else {
+      CHECK_EQ(lens->size(), n);
+    }
+    p_lens = lens->data();
+  }
+  if (kvs.empty() || kvs[0].lens.empty()) {
+    // fixed length values
+    size_t k = n ? total_val / n : 0;
+    CHECK_EQ(k * n, total_val);
+    for (size_t i = 0; i < kvs.size(); ++i) {
+      const Val* src = kvs[i].vals.data();
+      const uint32_t* p = perm + begin[i];
+      for (size_t j = 0; j < kvs[i].keys.size(); ++j) {
+        memcpy(p_vals + p[j] * k, src + j * k, k * sizeof(Val));
+      }
+    }
+    if (p_lens) std::fill(p_lens, p_lens + n, static_cast<int>(k));
+    return;
+  }
+  // the lengths go back first, they give the value offsets in key order
+  std::vector<int> own_lens;
+  if (!p_lens) {
+    own_lens.resize(n);
+    p_lens = own_lens.data();
+  }
+  for (size_t i = 0; i < kvs.size(); ++i) {
+    const uint32_t* p = perm + begin[i];
+    for (size_t j = 0; j < kvs[i].keys.size(); ++j) p_lens[p[j]] = kvs[i].lens[j];
+  }
+  std::vector<size_t> val_pos(n + 1, 0);
+  for (size_t i = 0; i < n; ++i) val_pos[i + 1] = val_pos[i] + p_lens[i];
+  CHECK_EQ(val_pos[n], total_val);
+  for (size_t i = 0; i < kvs.size(); ++i) {
+    const Val* src = kvs[i].vals.data();
+    const uint32_t* p = perm + begin[i];
+    for (size_t j = 0; j < kvs[i].keys.size(); ++j) {
+      memcpy(p_vals + val_pos[p[j]], src, kvs[i].lens[j] * sizeof(Val));
+      src += kvs[i].lens[j];
+    }
+  }
+}
+
 }  // namespace ps
 #endif  // PS_KV_APP_H_
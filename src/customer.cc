@@ -4,6 +4,8 @@
 #include "ps/internal/customer.h"
 #include "ps/internal/postoffice.h"
 #include "ps/internal/threadsafe_queue.h"
+#include <algorithm>
+#include <limits>
 #include <map>
 #include <atomic>
 #include <set>
@@ -15,18 +17,26 @@ namespace ps {
 const int Node::kEmpty = std::numeric_limits<short>::max();
 const int Meta::kEmpty = std::numeric_limits<short>::max();
 
-Customer::Customer(int app_id, int customer_id, const Customer::RecvHandle& recv_handle, Postoffice* postoffice)
-    : app_id_(app_id), customer_id_(customer_id), recv_handle_(recv_handle), postoffice_(postoffice) {
+Customer::Customer(int app_id, int customer_id, const Customer::RecvHandle& recv_handle, Postoffice* postoffice,
+                   const Customer::BatchRecvHandle& batch_handle)
+    : app_id_(app_id), customer_id_(customer_id), recv_handle_(recv_handle),
+      batch_handle_(batch_handle), postoffice_(postoffice) {
   postoffice_->AddCustomer(this);
   recv_thread_ = std::unique_ptr<std::thread>(new std::thread(&Customer::Receiving, this));
 }
 
 Customer::~Customer() {
+  Stop();
+}
+
+void Customer::Stop() {
+  if (!recv_thread_) return;
   postoffice_->RemoveCustomer(this);
   Message msg;
   msg.meta.control.cmd = Control::TERMINATE;
-  recv_queue_.Push(msg);
+  recv_queue_.Push(std::move(msg));
   recv_thread_->join();
+  recv_thread_.reset();
 }
 
 int Customer::NewRequest(int recver) {
@@ -35,28 +45,131 @@ int Customer::NewRequest(int recver) {
   // for push/pull requests, the worker only communication with one instance from
   // each server instance group
   int num = postoffice_->GetNodeIDs(recver).size() / postoffice_->group_size();
-  tracker_.push_back(std::make_pair(num, 0));
-  return tracker_.size() - 1;
+  int ts = next_timestamp_;
+  next_timestamp_ = ts == std::numeric_limits<int>::max() ? 0 : ts + 1;
+  if (tracker_.empty() || !tracker_[ts & (tracker_.size() - 1)].finished()) {
+    GrowTracker(ts);
+  }
+  auto& tracker = tracker_[ts & (tracker_.size() - 1)];
+  tracker.timestamp = ts;
+  tracker.num_expected = num;
+  tracker.num_received = 0;
+  return ts;
+}
+
+void Customer::GrowTracker(int timestamp) {
+  // the ring size is a power of 2, and must map the new timestamp and all the
+  // requests in flight to distinct slots
+  std::vector<int> live = {timestamp};
+  for (const auto& tracker : tracker_) {
+    if (!tracker.finished()) live.push_back(tracker.timestamp);
+  }
+  size_t size = tracker_.empty() ? kInitTrackerSize : tracker_.size() * 2;
+  for (bool collision = true; collision; ) {
+    std::vector<bool> used(size, false);
+    collision = false;
+    for (int ts : live) {
+      size_t idx = ts & (size - 1);
+      if (used[idx]) {
+        collision = true;
+        size *= 2;
+        break;
+      }
+      used[idx] = true;
+    }
+  }
+  std::vector<Tracker> tracker(size);
+  for (auto& t : tracker_) {
+    if (!t.finished()) tracker[t.timestamp & (size - 1)] = std::move(t);
+  }
+  tracker_.swap(tracker);
+}
+
+Customer::Tracker* Customer::FindTracker(int timestamp) {
+  // a timestamp not found in its slot is finished: either its slot has been
+  // reused by a later request, or the ring has been enlarged without it
+  if (tracker_.empty() || timestamp < 0) return nullptr;
+  auto& tracker = tracker_[timestamp & (tracker_.size() - 1)];
+  if (tracker.timestamp != timestamp || tracker.finished()) return nullptr;
+  return &tracker;
+}
+
+void Customer::AddResponseLocked(int timestamp, int num) {
+  auto tracker = FindTracker(timestamp);
+  if (!tracker) {
+    LOG(WARNING) << "drop the response of finished request " << timestamp;
+    return;
+  }
+  tracker->num_received += num;
+  if (!tracker->finished()) return;
+  // only wake up the threads waiting for this request. notify under the lock,
+  // a waiter may return and destroy its Waiter right after the lock is released
+  for (auto waiter : tracker->waiters) {
+    waiter->done = true;
+    waiter->cond.notify_one();
+  }
+  tracker->waiters.clear();
 }
 
 void Customer::WaitRequest(int timestamp) {
   std::unique_lock<std::mutex> lk(tracker_mu_);
-  tracker_cond_.wait(lk, [this, timestamp]{
-      return tracker_[timestamp].first == tracker_[timestamp].second;
-    });
+  auto tracker = FindTracker(timestamp);
+  if (!tracker) return;
+  Waiter waiter;
+  tracker->waiters.push_back(&waiter);
+  waiter.cond.wait(lk, [&waiter]{ return waiter.done; });
+}
+
+bool Customer::TestRequest(int timestamp) {
+  std::lock_guard<std::mutex> lk(tracker_mu_);
+  return FindTracker(timestamp) == nullptr;
+}
+
+void Customer::WaitAll(const std::vector<int>& timestamps) {
+  for (int ts : timestamps) WaitRequest(ts);
+}
+
+int Customer::WaitAny(const std::vector<int>& timestamps) {
+  CHECK(!timestamps.empty());
+  std::unique_lock<std::mutex> lk(tracker_mu_);
+  for (int ts : timestamps) {
+    if (!FindTracker(ts)) return ts;
+  }
+  Waiter waiter;
+  for (int ts : timestamps) FindTracker(ts)->waiters.push_back(&waiter);
+  waiter.cond.wait(lk, [&waiter]{ return waiter.done; });
+
+  // unregister from the requests still in flight
+  int finished = -1;
+  for (int ts : timestamps) {
+    auto tracker = FindTracker(ts);
+    if (!tracker) {
+      if (finished == -1) finished = ts;
+      continue;
+    }
+    auto& waiters = tracker->waiters;
+    waiters.erase(std::remove(waiters.begin(), waiters.end(), &waiter), waiters.end());
+  }
+  CHECK_NE(finished, -1);
+  return finished;
 }
 
 int Customer::NumResponse(int timestamp) {
   std::lock_guard<std::mutex> lk(tracker_mu_);
-  return tracker_[timestamp].second;
+  auto tracker = FindTracker(timestamp);
+  return tracker ? tracker->num_received : 0;
 }
 
 void Customer::AddResponse(int timestamp, int num) {
   std::lock_guard<std::mutex> lk(tracker_mu_);
-  tracker_[timestamp].second += num;
+  AddResponseLocked(timestamp, num);
 }
 
 void Customer::Receiving() {
+  if (batch_handle_) {
+    ReceivingBatches();
+    return;
+  }
   while (true) {
     Message recv;
     recv_queue_.WaitAndPop(&recv);
@@ -65,11 +178,69 @@ void Customer::Receiving() {
       break;
     }
     recv_handle_(recv);
-    if (!recv.meta.request) {
+    // the handle counts the responses of a batch, one per request in it
+    if (!recv.meta.request && !recv.meta.batch) {
       std::lock_guard<std::mutex> lk(tracker_mu_);
-      tracker_[recv.meta.timestamp].second++;
-      tracker_cond_.notify_all();
+      AddResponseLocked(recv.meta.timestamp, 1);
     }
+    num_queued_.fetch_sub(1, std::memory_order_release);
+  }
+}
+
+void Customer::ReceivingBatches() {
+  std::vector<Message> recved;
+  bool stop = false;
+  while (!stop) {
+    recved.clear();
+    recv_queue_.PopBatch(&recved);
+    // the messages after a terminate are dropped, as the loop above does
+    for (size_t i = 0; i < recved.size(); ++i) {
+      const auto& ctrl = recved[i].meta.control;
+      if (!ctrl.empty() && ctrl.cmd == Control::TERMINATE) {
+        recved.resize(i);
+        stop = true;
+        break;
+      }
+    }
+    if (recved.empty()) continue;
+    batch_handle_(recved);
+    {
+      std::lock_guard<std::mutex> lk(tracker_mu_);
+      for (const auto& recv : recved) {
+        if (!recv.meta.request && !recv.meta.batch) {
+          AddResponseLocked(recv.meta.timestamp, 1);
+        }
+      }
+    }
+    num_queued_.fetch_sub(recved.size(), std::memory_order_release);
+  }
+}
+
+bool Customer::AcceptInline(Message* recved) {
+  if (!recved->meta.control.empty()) return false;
+  // a response rejected by a server which switched to new key ranges waits
+  // for the other servers to switch, which only this thread can receive
+  if (!recved->meta.request && recved->meta.key_range_version) return false;
+  int64_t bytes = 0;
+  for (const auto& data : recved->data) bytes += data.size();
+  if (bytes > inline_max_bytes_.load(std::memory_order_relaxed)) return false;
+  // only the thread of the van adds to num_queued_, so once recv_thread_
+  // handled all the messages it stays idle until the next Accept
+  if (num_queued_.load(std::memory_order_acquire)) return false;
+  bool response = !recved->meta.request && !recved->meta.batch;
+  int timestamp = recved->meta.timestamp;
+  if (batch_handle_) {
+    inline_msgs_.resize(1);
+    inline_msgs_[0] = std::move(*recved);
+    batch_handle_(inline_msgs_);
+    inline_msgs_.clear();
+  } else {
+    recv_handle_(*recved);
+  }
+  if (response) {
+    std::lock_guard<std::mutex> lk(tracker_mu_);
+    AddResponseLocked(timestamp, 1);
   }
+  return true;
 }
 }  // namespace ps
@@ -77,6 +77,12 @@ struct RawMeta {
   bool push;
   // whether or not it's for SimpleApp
   bool simple_app;
+  // whether or not it carries several coalesced requests
+  bool batch;
+  // whether or not a push whose response returns the values
+  bool push_pull;
+  // whether or not a pull or response carries key versions
+  bool versioned;
   // message.data_size 
   int data_size;
   // message.key
@@ -89,6 +95,10 @@ struct RawMeta {
   int option;
   // the sequence id
   int sid;
+  // the version of the server key ranges
+  int key_range_version;
+  // the iteration clock of the worker
+  int clock;
 
   // body
   // data_type
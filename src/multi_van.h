@@ -188,12 +188,18 @@ class MultiVan : public Van {
       // TODO: check msg.meta.src_dev_ids, types, etc.
       
     }
-    Message van_msg = msg;
+    // rewrite the ids in place instead of copying the message, and restore
+    // them afterwards since the caller may still use msg (e.g. the resender)
     auto van = vans_[src_idx];
-    van_msg.meta.sender = EncodeManagedID(msg.meta.sender, src_idx);
-    van_msg.meta.recver = EncodeManagedID(msg.meta.recver, dst_idx);
-    PS_VLOG(3) << "SendMsg: " << van_msg.DebugString();
-    return van->SendMsg(van_msg);
+    int sender = msg.meta.sender;
+    int recver = msg.meta.recver;
+    msg.meta.sender = EncodeManagedID(sender, src_idx);
+    msg.meta.recver = EncodeManagedID(recver, dst_idx);
+    PS_VLOG(3) << "SendMsg: " << msg.DebugString();
+    int bytes = van->SendMsg(msg);
+    msg.meta.sender = sender;
+    msg.meta.recver = recver;
+    return bytes;
   }
 
   void RegisterRecvBuffer(Message &msg) {
@@ -213,7 +219,7 @@ class MultiVan : public Van {
     PS_VLOG(3) << "RecvMsg: " << ctx.msg.DebugString();
     ctx.msg.meta.sender = DecodeMangedID(ctx.msg.meta.sender);
     ctx.msg.meta.recver = DecodeMangedID(ctx.msg.meta.recver);
-    *msg = ctx.msg;
+    *msg = std::move(ctx.msg);
     return ctx.msg_len;
   }
 
@@ -260,8 +266,8 @@ class MultiVan : public Van {
       MultiVanBufferContext ctx;
       ctx.msg_len = recv_bytes;
       ctx.src_idx = index;
-      ctx.msg = msg;
-      recv_buffers_.Push(ctx);
+      ctx.msg = std::move(msg);
+      recv_buffers_.Push(std::move(ctx));
     }
     PS_VLOG(3) << "PollingThread exited";
   }
@@ -45,6 +45,9 @@ void Postoffice::Init(ps::Node::Role role) {
 Postoffice::Postoffice(int instance_idx) {
   env_ref_ = Environment::_GetSharedRef();
   instance_idx_ = instance_idx;
+  for (auto& app : fast_customers_) {
+    for (auto& customer : app) customer.store(nullptr);
+  }
 }
 
 void Postoffice::InitEnvironment() {
@@ -167,9 +170,16 @@ void Postoffice::Finalize(const int customer_id, const bool do_barrier) {
     van_->Stop();
     init_stage_ = 0;
     customers_.clear();
+    for (auto& app : fast_customers_) {
+      for (auto& customer : app) customer.store(nullptr);
+    }
     node_ids_.clear();
     barrier_done_.clear();
-    server_key_ranges_.clear();
+    {
+      std::lock_guard<std::mutex> lk(server_key_ranges_mu_);
+      server_key_ranges_ = nullptr;
+      key_range_tables_.clear();
+    }
     heartbeats_.clear();
     if (exit_callback_) exit_callback_();
   }
@@ -184,6 +194,9 @@ void Postoffice::AddCustomer(Customer* customer) {
   CHECK_EQ(customers_[app_id].count(customer_id), (size_t) 0) << "customer_id " \
     << customer_id << " already exists\n";
   customers_[app_id].insert(std::make_pair(customer_id, customer));
+  if (IsFastCustomer(app_id, customer_id)) {
+    fast_customers_[app_id][customer_id].store(customer, std::memory_order_release);
+  }
   std::unique_lock<std::mutex> ulk(barrier_mu_);
   barrier_done_[app_id].insert(std::make_pair(customer_id, false));
 }
@@ -194,6 +207,9 @@ void Postoffice::RemoveCustomer(Customer* customer) {
   int app_id = CHECK_NOTNULL(customer)->app_id();
   int customer_id = CHECK_NOTNULL(customer)->customer_id();
   customers_[app_id].erase(customer_id);
+  if (IsFastCustomer(app_id, customer_id)) {
+    fast_customers_[app_id][customer_id].store(nullptr, std::memory_order_release);
+  }
   if (customers_[app_id].empty()) {
     customers_.erase(app_id);
   }
@@ -201,15 +217,21 @@ void Postoffice::RemoveCustomer(Customer* customer) {
 
 
 Customer* Postoffice::GetCustomer(int app_id, int customer_id, int timeout) const {
+  const bool fast = IsFastCustomer(app_id, customer_id);
   Customer* obj = nullptr;
   for (int i = 0; i < timeout * 1000 + 1; ++i) {
-    {
+    if (fast) {
+      obj = fast_customers_[app_id][customer_id].load(std::memory_order_acquire);
+      if (obj) break;
+    } else {
       std::lock_guard<std::mutex> lk(mu_);
       const auto it = customers_.find(app_id);
       if (it != customers_.end()) {
-        std::unordered_map<int, Customer*> customers_in_app = it->second;
-        obj = customers_in_app[customer_id];
-        break;
+        const auto customer = it->second.find(customer_id);
+        if (customer != it->second.end()) {
+          obj = customer->second;
+          break;
+        }
       }
     }
     std::this_thread::sleep_for(std::chrono::milliseconds(1));
@@ -255,16 +277,99 @@ void Postoffice::Barrier(int customer_id, int node_group) {
 }
 
 const std::vector<Range>& Postoffice::GetServerKeyRanges() {
-  server_key_ranges_mu_.lock();
-  if (server_key_ranges_.empty()) {
-    for (int i = 0; i < num_servers_; ++i) {
-      server_key_ranges_.push_back(Range(
-          kMaxKey / num_servers_ * i,
-          kMaxKey / num_servers_ * (i+1)));
-    }
+  // every request of a worker asks for the ranges, so only the first call locks
+  KeyRangeTable* table = server_key_ranges_.load(std::memory_order_acquire);
+  if (table) return table->ranges;
+  std::lock_guard<std::mutex> lk(server_key_ranges_mu_);
+  if (!server_key_ranges_.load() && num_servers_ > 0) {
+    InstallKeyRangeTable(WeightedKeyRanges({}, num_servers_), 0);
   }
-  server_key_ranges_mu_.unlock();
-  return server_key_ranges_;
+  table = server_key_ranges_.load();
+  static const std::vector<Range> no_ranges;
+  return table ? table->ranges : no_ranges;
+}
+
+const KeySlicer& Postoffice::GetServerKeySlicer() {
+  return GetKeyRangeTable().slicer;
+}
+
+const KeyRangeTable& Postoffice::GetKeyRangeTable() {
+  GetServerKeyRanges();
+  KeyRangeTable* table = server_key_ranges_.load(std::memory_order_acquire);
+  CHECK(table) << "the number of servers is unknown";
+  return *table;
+}
+
+const KeyRangeTable* Postoffice::GetKeyRangeTable(int version) {
+  GetServerKeyRanges();
+  std::lock_guard<std::mutex> lk(server_key_ranges_mu_);
+  for (const auto& table : key_range_tables_) {
+    if (table->version == version) return table.get();
+  }
+  return nullptr;
+}
+
+void Postoffice::SetServerKeyRanges(const std::vector<Range>& ranges, int version) {
+  if (num_servers_ > 0) CHECK_EQ(ranges.size(), static_cast<size_t>(num_servers_));
+  {
+    std::lock_guard<std::mutex> lk(server_key_ranges_mu_);
+    KeyRangeTable* table = server_key_ranges_.load();
+    int current = table ? table->version : 0;
+    if (version == 0) version = current + 1;
+    CHECK_GT(version, current) << "key ranges are installed in increasing versions";
+    InstallKeyRangeTable(ranges, version);
+  }
+  // wake up WaitKeyRangeVersion, the lock orders the install before its check
+  barrier_mu_.lock();
+  barrier_mu_.unlock();
+  barrier_cond_.notify_all();
+}
+
+void Postoffice::InstallKeyRangeTable(const std::vector<Range>& ranges, int version) {
+  CHECK(!ranges.empty());
+  key_range_tables_.emplace_back(new KeyRangeTable(ranges, version));
+  server_key_ranges_.store(key_range_tables_.back().get(), std::memory_order_release);
+}
+
+void Postoffice::WaitKeyRangeVersion(int version) {
+  std::unique_lock<std::mutex> ulk(barrier_mu_);
+  barrier_cond_.wait(ulk, [this, version] {
+    KeyRangeTable* table = server_key_ranges_.load(std::memory_order_acquire);
+    return table && table->version >= version;
+  });
+}
+
+void Postoffice::PartitionServerKeyRanges(
+    const std::vector<std::pair<Key, uint64_t>>& load) {
+  CHECK(is_worker_) << "only workers report their load";
+  std::unique_lock<std::mutex> ulk(barrier_mu_);
+  key_ranges_done_ = false;
+  Message req;
+  req.meta.recver = kScheduler;
+  req.meta.request = true;
+  req.meta.control.cmd = Control::KEY_RANGES;
+  req.meta.app_id = 0;
+  req.meta.customer_id = 0;
+  req.meta.timestamp = van_->GetTimestamp();
+  // keep the report small whatever the size of the sample
+  req.meta.body = EncodeKeyLoad(CompactKeyLoad(load, kMaxKeyLoadSamples));
+  CHECK_GT(van_->Send(req), 0);
+  barrier_cond_.wait(ulk, [this] { return key_ranges_done_; });
+}
+
+void Postoffice::RebalanceServerKeyRanges(int app_id) {
+  CHECK(is_worker_) << "only workers start a rebalance";
+  std::unique_lock<std::mutex> ulk(barrier_mu_);
+  rebalance_done_ = false;
+  Message req;
+  req.meta.recver = kScheduler;
+  req.meta.request = true;
+  req.meta.control.cmd = Control::REBALANCE;
+  req.meta.app_id = app_id;
+  req.meta.customer_id = app_id;
+  req.meta.timestamp = van_->GetTimestamp();
+  CHECK_GT(van_->Send(req), 0);
+  barrier_cond_.wait(ulk, [this] { return rebalance_done_; });
 }
 
 void Postoffice::Manage(const Message& recv) {
@@ -279,6 +384,17 @@ void Postoffice::Manage(const Message& recv) {
     }
     barrier_mu_.unlock();
     barrier_cond_.notify_all();
+  } else if (ctrl.cmd == Control::KEY_RANGES && !recv.meta.request) {
+    SetServerKeyRanges(DecodeKeyRanges(recv.meta.body), recv.meta.key_range_version);
+    barrier_mu_.lock();
+    key_ranges_done_ = true;
+    barrier_mu_.unlock();
+    barrier_cond_.notify_all();
+  } else if (ctrl.cmd == Control::REBALANCE && !recv.meta.request) {
+    barrier_mu_.lock();
+    rebalance_done_ = true;
+    barrier_mu_.unlock();
+    barrier_cond_.notify_all();
   }
 }
 
@@ -41,10 +41,11 @@ class Resender {
     // already buffered, which often due to call Send by the monitor thread
     if (send_buff_.find(key) != send_buff_.end()) return;
 
-    auto& ent = send_buff_[key];
+    // the only copy of an outgoing message, kept for retransmission
+    Entry ent;
     ent.msg = msg;
     ent.send = Now();
-    ent.num_retry = 0;
+    send_buff_.emplace(key, std::move(ent));
   }
 
   /**
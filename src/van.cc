@@ -9,6 +9,7 @@
 #include <string.h>
 #include <sstream>
 #include <set>
+#include <algorithm>
 
 #include "ps/base.h"
 #include "ps/internal/customer.h"
@@ -378,6 +379,123 @@ void Van::ProcessInstanceBarrierCommand(Message *msg) {
   }
 }
 
+void Van::ProcessKeyRangesCommand(Message *msg) {
+  if (msg->meta.request) {
+    DecodeKeyLoad(msg->meta.body, &key_load_);
+    ++key_load_reports_;
+    PS_VLOG(1) << "Key load reports: " << key_load_reports_;
+    if (key_load_reports_ == static_cast<int>(postoffice_->GetNodeIDs(kWorkerGroup).size())) {
+      auto ranges = WeightedKeyRanges(key_load_, postoffice_->num_servers());
+      key_load_.clear();
+      key_load_reports_ = 0;
+      postoffice_->SetServerKeyRanges(ranges);
+      Message res;
+      res.meta.request = false;
+      res.meta.app_id = msg->meta.app_id;
+      res.meta.customer_id = msg->meta.customer_id;
+      res.meta.control.cmd = Control::KEY_RANGES;
+      res.meta.body = EncodeKeyRanges(ranges);
+      res.meta.key_range_version = postoffice_->GetKeyRangeTable().version;
+      for (int r : postoffice_->GetNodeIDs(kWorkerGroup + kServerGroup)) {
+        if (shared_node_mapping_.find(r) == shared_node_mapping_.end()) {
+          res.meta.recver = r;
+          res.meta.timestamp = timestamp_++;
+          CHECK_GT(Send(res), 0);
+        }
+      }
+    }
+  } else {
+    postoffice_->Manage(*msg);
+  }
+}
+
+int Van::SendToGroup(Message *msg, int group) {
+  int num = 0;
+  for (int r : postoffice_->GetNodeIDs(group)) {
+    if (shared_node_mapping_.find(r) != shared_node_mapping_.end()) continue;
+    msg->meta.recver = r;
+    msg->meta.timestamp = timestamp_++;
+    CHECK_GT(Send(*msg), 0);
+    ++num;
+  }
+  return num;
+}
+
+void Van::ProcessRebalanceCommand(Message *msg) {
+  auto cmd = msg->meta.control.cmd;
+  if (!is_scheduler_) {
+    if (cmd == Control::REBALANCE) {
+      postoffice_->Manage(*msg);
+      return;
+    }
+    // the app of the server handles it in order with its requests
+    if (cmd == Control::MIGRATE) {
+      postoffice_->SetServerKeyRanges(DecodeKeyRanges(msg->meta.body),
+                                      msg->meta.key_range_version);
+    }
+    Customer *obj = postoffice_->GetCustomer(msg->meta.app_id, msg->meta.customer_id, 5);
+    CHECK(obj) << "timeout (5 sec) to wait App " << msg->meta.app_id
+               << " customer " << msg->meta.customer_id << " ready at "
+               << my_node_.role;
+    obj->Accept(std::move(*msg));
+    return;
+  }
+
+  if (cmd == Control::REBALANCE) {
+    rebalance_requesters_.push_back(msg->meta.sender);
+    // a rebalance is in progress already
+    if (rebalance_requesters_.size() > 1) return;
+    rebalance_app_id_ = msg->meta.app_id;
+  }
+  Message req;
+  req.meta.request = true;
+  req.meta.app_id = rebalance_app_id_;
+  req.meta.customer_id = rebalance_app_id_;
+  if (cmd == Control::REBALANCE) {
+    rebalance_version_ = postoffice_->GetKeyRangeTable().version;
+    rebalance_load_.clear();
+    req.meta.control.cmd = Control::KEY_LOAD;
+    rebalance_pending_ = SendToGroup(&req, kServerGroup);
+  } else if (cmd == Control::KEY_LOAD) {
+    DecodeKeyLoad(msg->meta.body, &rebalance_load_);
+    rebalance_version_ = std::max(rebalance_version_, msg->meta.key_range_version);
+    if (--rebalance_pending_) return;
+    PS_VLOG(1) << "Rebalance with " << rebalance_load_.size() << " load samples";
+    if (rebalance_load_.empty()) {
+      // nothing observed, keep the ranges
+      rebalance_pending_ = 0;
+    } else {
+      rebalance_ranges_ = WeightedKeyRanges(rebalance_load_, postoffice_->num_servers());
+      rebalance_load_.clear();
+      postoffice_->SetServerKeyRanges(rebalance_ranges_, ++rebalance_version_);
+      req.meta.control.cmd = Control::MIGRATE;
+      req.meta.body = EncodeKeyRanges(rebalance_ranges_);
+      req.meta.key_range_version = rebalance_version_;
+      rebalance_pending_ = SendToGroup(&req, kServerGroup);
+    }
+  } else if (cmd == Control::MIGRATE) {
+    if (--rebalance_pending_) return;
+    // every server holds its new pairs, switch the workers
+    Message res;
+    res.meta.request = false;
+    res.meta.control.cmd = Control::KEY_RANGES;
+    res.meta.body = EncodeKeyRanges(rebalance_ranges_);
+    res.meta.key_range_version = rebalance_version_;
+    SendToGroup(&res, kWorkerGroup);
+  }
+  if (rebalance_pending_) return;
+  PS_VLOG(1) << "Rebalance done, key range version " << rebalance_version_;
+  Message res;
+  res.meta.request = false;
+  res.meta.control.cmd = Control::REBALANCE;
+  for (int r : rebalance_requesters_) {
+    res.meta.recver = r;
+    res.meta.timestamp = timestamp_++;
+    CHECK_GT(Send(res), 0);
+  }
+  rebalance_requesters_.clear();
+}
+
 // process the (group) barrier command
 void Van::ProcessBarrierCommand(Message *msg) {
   // For group-level barrier, we only respond to the requesters
@@ -435,7 +553,6 @@ void Van::ProcessDataMsg(Message *msg) {
   auto *obj = postoffice_->GetCustomer(app_id, customer_id, 5);
   CHECK(obj) << "timeout (5 sec) to wait App " << app_id << " customer " << customer_id
              << " ready at " << my_node_.role;
-  obj->Accept(*msg);
 
 #ifdef USE_PROFILING
   if (is_van_profiling_ && msg->data.size()){
@@ -455,6 +572,8 @@ void Van::ProcessDataMsg(Message *msg) {
     }
   }
 #endif
+  // the message is not used after this point, hand it over without a copy
+  obj->Accept(std::move(*msg));
 }
 
 void Van::ProcessAddNodeCommand(Message *msg, Meta *nodes, Meta *recovery_nodes) {
@@ -557,7 +676,18 @@ void Van::Start(int customer_id, bool standalone) {
     if (Environment::Get()->find("PS_DROP_MSG")) {
       drop_rate_ = atoi(Environment::Get()->find("PS_DROP_MSG"));
     }
-    // start receiver
+    // start receiver, and the threads it hands the messages to
+    control_thread_ = std::unique_ptr<std::thread>(new std::thread(&Van::ProcessingControl, this));
+    int num_data_threads = 0;
+    if (Environment::Get()->find("PS_RECV_THREADS")) {
+      num_data_threads = atoi(Environment::Get()->find("PS_RECV_THREADS"));
+    }
+    for (int i = 0; i < num_data_threads; ++i) {
+      data_queues_.emplace_back(new ThreadsafeQueue<DataMsg>());
+    }
+    for (int i = 0; i < num_data_threads; ++i) {
+      data_threads_.emplace_back(&Van::ProcessingData, this, i);
+    }
     receiver_thread_ = std::unique_ptr<std::thread>(new std::thread(&Van::Receiving, this));
     init_stage++;
   }
@@ -641,13 +771,27 @@ int Van::Send(Message &msg) {
 }
 
 void Van::Receiving() {
-  Meta nodes;
-  Meta recovery_nodes;  // store recovery nodes
-  recovery_nodes.control.cmd = Control::ADD_NODE;
-
   while (true) {
     Message msg;
-    int recv_bytes = RecvMsg(&msg);
+    // the data threads decode the metas of the data messages, unless they
+    // are needed here to drop or acknowledge the messages
+    bool packed = false;
+    int recv_bytes = data_queues_.size() && !resender_ && !drop_rate_
+                         ? RecvPackedMsg(&msg, &packed)
+                         : RecvMsg(&msg);
+    if (packed) {
+      CHECK_NE(recv_bytes, -1);
+      recv_bytes_ += recv_bytes;
+      // by customer, so the messages of a sender to a customer stay in order
+      int app_id = msg.meta.app_id;
+      int customer_id = postoffice_->is_worker() ? msg.meta.customer_id : app_id;
+      size_t index = (static_cast<size_t>(app_id) * 31 + customer_id) % data_queues_.size();
+      DataMsg item;
+      item.msg = std::move(msg);
+      item.packed = true;
+      data_queues_[index]->Push(std::move(item));
+      continue;
+    }
     // For debug, drop received message
     if (ready_.load() && drop_rate_ > 0) {
       unsigned seed = time(NULL) + my_node_.id;
@@ -663,29 +807,97 @@ void Van::Receiving() {
     // duplicated message
     if (resender_ && resender_->AddIncomming(msg)) continue;
 
-    if (!msg.meta.control.empty()) {
-      // control msg
-      auto &ctrl = msg.meta.control;
-      if (ctrl.cmd == Control::TERMINATE) {
-        ProcessTerminateCommand();
-        break;
-      } else if (ctrl.cmd == Control::ADD_NODE) {
-        ProcessAddNodeCommand(&msg, &nodes, &recovery_nodes);
-      } else if (ctrl.cmd == Control::BARRIER) {
-        ProcessBarrierCommand(&msg);
-      } else if (ctrl.cmd == Control::INSTANCE_BARRIER) {
-        ProcessInstanceBarrierCommand(&msg);
-      } else if (ctrl.cmd == Control::HEARTBEAT) {
-        ProcessHearbeat(&msg);
-      } else {
-        LOG(WARNING) << "Drop unknown typed message " << msg.DebugString();
+    auto &ctrl = msg.meta.control;
+    if (!ctrl.empty() && ctrl.cmd == Control::TERMINATE) {
+      // the other threads finish the messages queued before it
+      control_queue_.Push(msg);
+      control_thread_->join();
+      for (auto &queue : data_queues_) {
+        DataMsg item;
+        item.msg = msg;
+        queue->Push(std::move(item));
       }
+      for (auto &thread : data_threads_) thread.join();
+      data_threads_.clear();
+      data_queues_.clear();
+      ProcessTerminateCommand();
+      break;
+    }
+    // the rebalance commands of a node go to its apps in order with their
+    // requests
+    bool data = ctrl.empty() || (!is_scheduler_ && (ctrl.cmd == Control::REBALANCE ||
+                                                    ctrl.cmd == Control::KEY_LOAD ||
+                                                    ctrl.cmd == Control::MIGRATE));
+    if (!data) {
+      control_queue_.Push(std::move(msg));
+    } else if (data_queues_.empty()) {
+      ProcessDataPlaneMsg(&msg);
     } else {
-      ProcessDataMsg(&msg);
+      // by customer, as the packed messages above
+      int app_id = msg.meta.app_id;
+      int customer_id = postoffice_->is_worker() ? msg.meta.customer_id : app_id;
+      size_t index = (static_cast<size_t>(app_id) * 31 + customer_id) % data_queues_.size();
+      DataMsg item;
+      item.msg = std::move(msg);
+      data_queues_[index]->Push(std::move(item));
     }
   }
 }
 
+void Van::ProcessingControl() {
+  Meta nodes;
+  Meta recovery_nodes;  // store recovery nodes
+  recovery_nodes.control.cmd = Control::ADD_NODE;
+
+  while (true) {
+    Message msg;
+    control_queue_.WaitAndPop(&msg);
+    auto &ctrl = msg.meta.control;
+    if (ctrl.cmd == Control::TERMINATE) {
+      break;
+    } else if (ctrl.cmd == Control::ADD_NODE) {
+      ProcessAddNodeCommand(&msg, &nodes, &recovery_nodes);
+    } else if (ctrl.cmd == Control::BARRIER) {
+      ProcessBarrierCommand(&msg);
+    } else if (ctrl.cmd == Control::INSTANCE_BARRIER) {
+      ProcessInstanceBarrierCommand(&msg);
+    } else if (ctrl.cmd == Control::HEARTBEAT) {
+      ProcessHearbeat(&msg);
+    } else if (ctrl.cmd == Control::KEY_RANGES) {
+      ProcessKeyRangesCommand(&msg);
+    } else if (ctrl.cmd == Control::REBALANCE || ctrl.cmd == Control::KEY_LOAD ||
+               ctrl.cmd == Control::MIGRATE) {
+      ProcessRebalanceCommand(&msg);
+    } else {
+      LOG(WARNING) << "Drop unknown typed message " << msg.DebugString();
+    }
+  }
+}
+
+void Van::ProcessingData(int index) {
+  auto &queue = *data_queues_[index];
+  while (true) {
+    DataMsg item;
+    queue.WaitAndPop(&item);
+    Message &msg = item.msg;
+    if (item.packed) {
+      DecodeMsg(&msg);
+      PS_VLOG(2) << this->GetType() << " " << my_node_.id << "\treceived: " << msg.DebugString();
+    } else if (msg.meta.control.cmd == Control::TERMINATE) {
+      break;
+    }
+    ProcessDataPlaneMsg(&msg);
+  }
+}
+
+void Van::ProcessDataPlaneMsg(Message *msg) {
+  if (msg->meta.control.empty()) {
+    ProcessDataMsg(msg);
+  } else {
+    ProcessRebalanceCommand(msg);
+  }
+}
+
 int Van::GetPackMetaLen(const Meta &meta) {
   auto data_type_size = meta.data_type.size() * sizeof(int);
   return sizeof(RawMeta) + meta.body.size() + data_type_size + 
@@ -717,6 +929,9 @@ void Van::PackMeta(const Meta &meta, char **meta_buf, int *buf_size) {
   raw->push = meta.push;
   raw->request = meta.request;
   raw->simple_app = meta.simple_app;
+  raw->batch = meta.batch;
+  raw->push_pull = meta.push_pull;
+  raw->versioned = meta.versioned;
   raw->customer_id = meta.customer_id;
   int data_type_count = 0;
   for (auto d : meta.data_type) {
@@ -769,6 +984,8 @@ void Van::PackMeta(const Meta &meta, char **meta_buf, int *buf_size) {
   raw->val_len = meta.val_len;
   raw->option = meta.option;
   raw->sid = meta.sid;
+  raw->key_range_version = meta.key_range_version;
+  raw->clock = meta.clock;
 }
 
 void Van::UnpackMeta(const char *meta_buf, int buf_size, Meta *meta) {
@@ -785,6 +1002,9 @@ void Van::UnpackMeta(const char *meta_buf, int buf_size, Meta *meta) {
   meta->request = raw->request;
   meta->push = raw->push;
   meta->simple_app = raw->simple_app;
+  meta->batch = raw->batch;
+  meta->push_pull = raw->push_pull;
+  meta->versioned = raw->versioned;
   meta->body = std::string(raw_body, raw->body_size);
   meta->customer_id = raw->customer_id;
   meta->data_type.resize(raw->data_type_size);
@@ -828,6 +1048,389 @@ void Van::UnpackMeta(const char *meta_buf, int buf_size, Meta *meta) {
   meta->val_len = raw->val_len;
   meta->option = raw->option;
   meta->sid = raw->sid;
+  meta->key_range_version = raw->key_range_version;
+  meta->clock = raw->clock;
+}
+
+namespace {
+
+// the first byte of a compact meta: a magic in the high and the format
+// version in the low nibble
+const uint8_t kCompactMetaVersion = 0xB1;
+
+// Meta::request/push/simple_app/batch/push_pull/versioned, packed into the
+// flags byte
+enum CompactMetaFlag {
+  kMetaRequest = 1 << 0,
+  kMetaPush = 1 << 1,
+  kMetaSimpleApp = 1 << 2,
+  kMetaBatch = 1 << 3,
+  kMetaPushPull = 1 << 4,
+  kMetaVersioned = 1 << 5
+};
+
+// presence bits, a field is only encoded when it differs from its default
+enum CompactMetaField {
+  kMetaHasHead = 1 << 0,
+  kMetaHasAppId = 1 << 1,
+  kMetaHasCustomerId = 1 << 2,
+  kMetaHasTimestamp = 1 << 3,
+  kMetaHasBody = 1 << 4,
+  kMetaHasDataType = 1 << 5,
+  kMetaHasSrcDev = 1 << 6,
+  kMetaHasDstDev = 1 << 7,
+  kMetaHasControl = 1 << 8,
+  kMetaHasDataSize = 1 << 9,
+  kMetaHasKey = 1 << 10,
+  kMetaHasAddr = 1 << 11,
+  kMetaHasValLen = 1 << 12,
+  kMetaHasOption = 1 << 13,
+  kMetaHasSid = 1 << 14,
+  kMetaHasKeyRangeVersion = 1 << 15,
+  kMetaHasClock = 1 << 16
+};
+
+// max bytes of a varint-encoded 32 / 64-bit integer
+const int kMaxVarint32 = 5;
+const int kMaxVarint64 = 10;
+// bound of everything but the body, the data types and the control nodes
+const int kCompactMetaFixedMaxLen = 160;
+// bound of a node except for its hostname
+const int kCompactNodeFixedMaxLen = 3 * 32 * kMaxVarint32 + 64 + 16 * kMaxVarint32;
+
+inline char *PutVarint(char *p, uint64_t v) {
+  while (v >= 0x80) {
+    *p++ = static_cast<char>(v | 0x80);
+    v >>= 7;
+  }
+  *p++ = static_cast<char>(v);
+  return p;
+}
+
+// zigzag, so that small negative values such as kEmpty stay short
+inline char *PutSVarint(char *p, int64_t v) {
+  return PutVarint(p, (static_cast<uint64_t>(v) << 1) ^ static_cast<uint64_t>(v >> 63));
+}
+
+// keys and addresses usually use the high bits, so they are sent fixed-width
+inline char *PutFixed64(char *p, uint64_t v) {
+  memcpy(p, &v, sizeof(v));
+  return p + sizeof(v);
+}
+
+inline char *PutBytes(char *p, const void *data, size_t size) {
+  p = PutVarint(p, size);
+  memcpy(p, data, size);
+  return p + size;
+}
+
+// bounds-checked reader of a compact meta
+class CompactMetaReader {
+ public:
+  CompactMetaReader(const char *buf, int size)
+      : p_(reinterpret_cast<const uint8_t *>(buf)), end_(p_ + size) {}
+
+  uint8_t Byte() {
+    if (p_ == end_) Truncated();
+    return *p_++;
+  }
+
+  uint64_t Varint() {
+    // fast path for the common one-byte case
+    if (p_ != end_ && *p_ < 0x80) return *p_++;
+    return VarintSlow();
+  }
+
+  uint64_t Fixed64() {
+    if (end_ - p_ < 8) Truncated();
+    uint64_t v;
+    memcpy(&v, p_, sizeof(v));
+    p_ += sizeof(v);
+    return v;
+  }
+
+  int64_t SVarint() {
+    uint64_t v = Varint();
+    return static_cast<int64_t>(v >> 1) ^ -static_cast<int64_t>(v & 1);
+  }
+
+  const char *Bytes(int *size) {
+    *size = static_cast<int>(Varint());
+    if (*size < 0 || *size > end_ - p_) Truncated();
+    const char *data = reinterpret_cast<const char *>(p_);
+    p_ += *size;
+    return data;
+  }
+
+  int Consumed(const char *buf) const {
+    return static_cast<int>(reinterpret_cast<const char *>(p_) - buf);
+  }
+
+ private:
+  __attribute__((noinline)) uint64_t VarintSlow() {
+    uint64_t v = 0;
+    for (int shift = 0; shift < 64; shift += 7) {
+      uint8_t b = Byte();
+      v |= static_cast<uint64_t>(b & 0x7f) << shift;
+      if (!(b & 0x80)) return v;
+    }
+    Truncated();
+    return 0;
+  }
+
+  __attribute__((noinline)) static void Truncated() {
+    LOG(FATAL) << "truncated or malformed meta";
+  }
+
+  const uint8_t *p_;
+  const uint8_t *end_;
+};
+
+char *PutCompactNode(char *p, const Node &n) {
+  p = PutVarint(p, n.role);
+  p = PutSVarint(p, n.id);
+  p = PutBytes(p, n.hostname.data(), n.hostname.size());
+  p = PutSVarint(p, n.num_ports);
+  // only the ports in use are sent, the rest is zero at the receiver
+  int num_ports = std::min(std::max(n.num_ports, 0), 32);
+  for (int i = 0; i < num_ports; ++i) p = PutSVarint(p, n.ports[i]);
+  for (int i = 0; i < num_ports; ++i) p = PutSVarint(p, n.dev_types[i]);
+  for (int i = 0; i < num_ports; ++i) p = PutSVarint(p, n.dev_ids[i]);
+  p = PutSVarint(p, n.port);
+  *p++ = n.is_recovery ? 1 : 0;
+  p = PutSVarint(p, n.customer_id);
+  size_t name_len = std::min(n.endpoint_name_len, sizeof(n.endpoint_name));
+  p = PutBytes(p, n.endpoint_name, name_len);
+  p = PutSVarint(p, n.aux_id);
+  return p;
+}
+
+void GetCompactNode(CompactMetaReader *in, Node *n) {
+  n->role = static_cast<Node::Role>(in->Varint());
+  n->id = in->SVarint();
+  int size;
+  const char *hostname = in->Bytes(&size);
+  n->hostname.assign(hostname, size);
+  n->num_ports = in->SVarint();
+  n->ports.fill(0);
+  n->dev_types.fill(0);
+  n->dev_ids.fill(0);
+  int num_ports = std::min(std::max(n->num_ports, 0), 32);
+  for (int i = 0; i < num_ports; ++i) n->ports[i] = in->SVarint();
+  for (int i = 0; i < num_ports; ++i) n->dev_types[i] = in->SVarint();
+  for (int i = 0; i < num_ports; ++i) n->dev_ids[i] = in->SVarint();
+  n->port = in->SVarint();
+  n->is_recovery = in->Byte() != 0;
+  n->customer_id = in->SVarint();
+  const char *name = in->Bytes(&size);
+  CHECK_LE(static_cast<size_t>(size), sizeof(n->endpoint_name));
+  bzero(n->endpoint_name, sizeof(n->endpoint_name));
+  memcpy(n->endpoint_name, name, size);
+  n->endpoint_name_len = size;
+  n->aux_id = in->SVarint();
+}
+
+}  // namespace
+
+int Van::GetCompactMetaMaxLen(const Meta &meta) {
+  int len = kCompactMetaFixedMaxLen + meta.body.size() + meta.data_type.size();
+  for (const auto &n : meta.control.node) {
+    len += kCompactNodeFixedMaxLen + n.hostname.size();
+  }
+  return len;
+}
+
+int Van::PackCompactMeta(const Meta &meta, char *meta_buf) {
+  char *p = meta_buf;
+  *p++ = static_cast<char>(kCompactMetaVersion);
+  *p++ = static_cast<char>((meta.request ? kMetaRequest : 0) |
+                           (meta.push ? kMetaPush : 0) |
+                           (meta.simple_app ? kMetaSimpleApp : 0) |
+                           (meta.batch ? kMetaBatch : 0) |
+                           (meta.push_pull ? kMetaPushPull : 0) |
+                           (meta.versioned ? kMetaVersioned : 0));
+  bool has_src_dev = meta.src_dev_type != UNK || meta.src_dev_id != -1;
+  bool has_dst_dev = meta.dst_dev_type != UNK || meta.dst_dev_id != -1;
+  uint32_t fields = 0;
+  if (meta.head != Meta::kEmpty) fields |= kMetaHasHead;
+  if (meta.app_id != Meta::kEmpty) fields |= kMetaHasAppId;
+  if (meta.customer_id != Meta::kEmpty) fields |= kMetaHasCustomerId;
+  if (meta.timestamp != Meta::kEmpty) fields |= kMetaHasTimestamp;
+  if (meta.body.size()) fields |= kMetaHasBody;
+  if (meta.data_type.size()) fields |= kMetaHasDataType;
+  if (has_src_dev) fields |= kMetaHasSrcDev;
+  if (has_dst_dev) fields |= kMetaHasDstDev;
+  if (!meta.control.empty()) fields |= kMetaHasControl;
+  if (meta.data_size) fields |= kMetaHasDataSize;
+  if (meta.key) fields |= kMetaHasKey;
+  if (meta.addr) fields |= kMetaHasAddr;
+  if (meta.val_len) fields |= kMetaHasValLen;
+  if (meta.option) fields |= kMetaHasOption;
+  if (meta.sid) fields |= kMetaHasSid;
+  if (meta.key_range_version) fields |= kMetaHasKeyRangeVersion;
+  if (meta.clock) fields |= kMetaHasClock;
+  p = PutVarint(p, fields);
+
+  if (fields & kMetaHasHead) p = PutSVarint(p, meta.head);
+  if (fields & kMetaHasAppId) p = PutSVarint(p, meta.app_id);
+  if (fields & kMetaHasCustomerId) p = PutSVarint(p, meta.customer_id);
+  if (fields & kMetaHasTimestamp) p = PutSVarint(p, meta.timestamp);
+  if (fields & kMetaHasBody) p = PutBytes(p, meta.body.data(), meta.body.size());
+  if (fields & kMetaHasDataType) {
+    p = PutVarint(p, meta.data_type.size());
+    for (auto d : meta.data_type) *p++ = static_cast<char>(d);
+  }
+  if (has_src_dev) {
+    p = PutSVarint(p, meta.src_dev_type);
+    p = PutSVarint(p, meta.src_dev_id);
+  }
+  if (has_dst_dev) {
+    p = PutSVarint(p, meta.dst_dev_type);
+    p = PutSVarint(p, meta.dst_dev_id);
+  }
+  if (fields & kMetaHasControl) {
+    // length-prefixed, so that a view can skip it without decoding the nodes.
+    // the prefix is reserved with its max width and the control is moved
+    // back once its length is known
+    char *start = p + kMaxVarint32;
+    char *q = start;
+    q = PutVarint(q, meta.control.cmd);
+    q = PutSVarint(q, meta.control.barrier_group);
+    q = PutVarint(q, meta.control.msg_sig);
+    q = PutVarint(q, meta.control.node.size());
+    for (const auto &n : meta.control.node) q = PutCompactNode(q, n);
+    size_t control_size = q - start;
+    p = PutVarint(p, control_size);
+    memmove(p, start, control_size);
+    p += control_size;
+  }
+  if (fields & kMetaHasDataSize) p = PutSVarint(p, meta.data_size);
+  if (fields & kMetaHasKey) p = PutFixed64(p, meta.key);
+  if (fields & kMetaHasAddr) p = PutFixed64(p, meta.addr);
+  if (fields & kMetaHasValLen) p = PutSVarint(p, meta.val_len);
+  if (fields & kMetaHasOption) p = PutSVarint(p, meta.option);
+  if (fields & kMetaHasSid) p = PutSVarint(p, meta.sid);
+  if (fields & kMetaHasKeyRangeVersion) p = PutSVarint(p, meta.key_range_version);
+  if (fields & kMetaHasClock) p = PutSVarint(p, meta.clock);
+  return static_cast<int>(p - meta_buf);
+}
+
+const char *Van::PackCompactMeta(const Meta &meta, int *buf_size) {
+  static thread_local std::vector<char> buf(kCompactMetaFixedMaxLen);
+  size_t max_len = GetCompactMetaMaxLen(meta);
+  if (buf.size() < max_len) buf.resize(max_len);
+  *buf_size = PackCompactMeta(meta, buf.data());
+  return buf.data();
+}
+
+int Van::UnpackCompactMeta(const char *meta_buf, int buf_size, MetaView *view) {
+  CompactMetaReader in(meta_buf, buf_size);
+  uint8_t version = in.Byte();
+  CHECK_EQ(version, kCompactMetaVersion) << "unknown meta format";
+  uint8_t flags = in.Byte();
+  view->request = flags & kMetaRequest;
+  view->push = flags & kMetaPush;
+  view->simple_app = flags & kMetaSimpleApp;
+  view->batch = flags & kMetaBatch;
+  view->push_pull = flags & kMetaPushPull;
+  view->versioned = flags & kMetaVersioned;
+  uint32_t fields = in.Varint();
+
+  view->head = (fields & kMetaHasHead) ? in.SVarint() : Meta::kEmpty;
+  view->app_id = (fields & kMetaHasAppId) ? in.SVarint() : Meta::kEmpty;
+  view->customer_id = (fields & kMetaHasCustomerId) ? in.SVarint() : Meta::kEmpty;
+  view->timestamp = (fields & kMetaHasTimestamp) ? in.SVarint() : Meta::kEmpty;
+  view->body = nullptr;
+  view->body_size = 0;
+  if (fields & kMetaHasBody) view->body = in.Bytes(&view->body_size);
+  view->data_type = nullptr;
+  view->data_type_size = 0;
+  if (fields & kMetaHasDataType) {
+    view->data_type = reinterpret_cast<const uint8_t *>(in.Bytes(&view->data_type_size));
+  }
+  view->src_dev_type = UNK;
+  view->src_dev_id = -1;
+  if (fields & kMetaHasSrcDev) {
+    view->src_dev_type = static_cast<DeviceType>(in.SVarint());
+    view->src_dev_id = in.SVarint();
+  }
+  view->dst_dev_type = UNK;
+  view->dst_dev_id = -1;
+  if (fields & kMetaHasDstDev) {
+    view->dst_dev_type = static_cast<DeviceType>(in.SVarint());
+    view->dst_dev_id = in.SVarint();
+  }
+  view->control = nullptr;
+  view->control_size = 0;
+  if (fields & kMetaHasControl) view->control = in.Bytes(&view->control_size);
+  view->data_size = (fields & kMetaHasDataSize) ? in.SVarint() : 0;
+  view->key = (fields & kMetaHasKey) ? in.Fixed64() : 0;
+  view->addr = (fields & kMetaHasAddr) ? in.Fixed64() : 0;
+  view->val_len = (fields & kMetaHasValLen) ? in.SVarint() : 0;
+  view->option = (fields & kMetaHasOption) ? in.SVarint() : 0;
+  view->sid = (fields & kMetaHasSid) ? in.SVarint() : 0;
+  view->key_range_version = (fields & kMetaHasKeyRangeVersion) ? in.SVarint() : 0;
+  view->clock = (fields & kMetaHasClock) ? in.SVarint() : 0;
+  return in.Consumed(meta_buf);
+}
+
+bool Van::PeekCompactMeta(const char *meta_buf, int buf_size, int *app_id,
+                          int *customer_id) {
+  CompactMetaReader in(meta_buf, buf_size);
+  uint8_t version = in.Byte();
+  CHECK_EQ(version, kCompactMetaVersion) << "unknown meta format";
+  in.Byte();
+  uint32_t fields = in.Varint();
+  if (fields & kMetaHasControl) return false;
+  if (fields & kMetaHasHead) in.SVarint();
+  *app_id = (fields & kMetaHasAppId) ? in.SVarint() : Meta::kEmpty;
+  *customer_id = (fields & kMetaHasCustomerId) ? in.SVarint() : Meta::kEmpty;
+  return true;
+}
+
+int Van::UnpackCompactMeta(const char *meta_buf, int buf_size, Meta *meta) {
+  MetaView view;
+  int consumed = UnpackCompactMeta(meta_buf, buf_size, &view);
+  meta->head = view.head;
+  meta->app_id = view.app_id;
+  meta->customer_id = view.customer_id;
+  meta->timestamp = view.timestamp;
+  meta->request = view.request;
+  meta->push = view.push;
+  meta->simple_app = view.simple_app;
+  meta->batch = view.batch;
+  meta->push_pull = view.push_pull;
+  meta->versioned = view.versioned;
+  meta->body.assign(view.body ? view.body : "", view.body_size);
+  meta->data_type.resize(view.data_type_size);
+  for (int i = 0; i < view.data_type_size; ++i) {
+    meta->data_type[i] = static_cast<DataType>(view.data_type[i]);
+  }
+  meta->src_dev_type = view.src_dev_type;
+  meta->src_dev_id = view.src_dev_id;
+  meta->dst_dev_type = view.dst_dev_type;
+  meta->dst_dev_id = view.dst_dev_id;
+  meta->control.node.clear();
+  if (view.control) {
+    CompactMetaReader in(view.control, view.control_size);
+    meta->control.cmd = static_cast<Control::Command>(in.Varint());
+    meta->control.barrier_group = in.SVarint();
+    meta->control.msg_sig = in.Varint();
+    size_t num_nodes = in.Varint();
+    meta->control.node.resize(num_nodes);
+    for (auto &n : meta->control.node) GetCompactNode(&in, &n);
+  } else {
+    meta->control.cmd = Control::EMPTY;
+  }
+  meta->data_size = view.data_size;
+  meta->key = view.key;
+  meta->addr = view.addr;
+  meta->val_len = view.val_len;
+  meta->option = view.option;
+  meta->sid = view.sid;
+  meta->key_range_version = view.key_range_version;
+  meta->clock = view.clock;
+  return consumed;
 }
 
 void Van::Heartbeat() {
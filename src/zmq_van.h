@@ -4,8 +4,12 @@
 #ifndef PS_ZMQ_VAN_H_
 #define PS_ZMQ_VAN_H_
 #include <stdio.h>
+#include <fcntl.h>
+#include <unistd.h>
 #include <cstdlib>
 #include <zmq.h>
+#include <algorithm>
+#include <memory>
 #include <string>
 #include <cstring>
 #include <thread>
@@ -26,6 +30,30 @@ struct ZmqBufferContext { // for clarity, don't merge meta and data
   std::vector<zmq_msg_t*> data_zmsg;
 };
 
+/**
+ * \brief size of the zmq identity of a node: "ps" followed by the node id as
+ * a 4-byte little-endian integer
+ */
+static const size_t kZmqIdentitySize = 6;
+
+inline void EncodeZmqIdentity(int id, char* buf) {
+  uint32_t v = static_cast<uint32_t>(id);
+  buf[0] = 'p';
+  buf[1] = 's';
+  for (int i = 0; i < 4; ++i) buf[2 + i] = static_cast<char>((v >> (8 * i)) & 0xff);
+}
+
+/**
+ * \brief a zmq socket and the lock serializing the threads using it, since
+ * zmq sockets are not thread safe
+ */
+struct ZmqSocket {
+  void* socket = nullptr;
+  std::mutex mu;
+  /** \brief the identity of the peer node, used to route replies to it */
+  char identity[kZmqIdentitySize];
+};
+
 /**
  * \brief be smart on freeing recved data
  */
@@ -69,28 +97,42 @@ class ZMQVan : public Van {
     int byteps_zmq_nthreads = val2 ? atoi(val2) : 4;
     zmq_ctx_set(context_, ZMQ_IO_THREADS, byteps_zmq_nthreads);
     PS_VLOG(1) << "BYTEPS_ZMQ_NTHREADS set to " << byteps_zmq_nthreads;
+
+    // messages with at most this many data bytes are sent in a single frame
+    short_thresh_ = GetEnv("BYTEPS_ZMQ_SHORT_THRESH", 4096);
+    PS_VLOG(1) << "BYTEPS_ZMQ_SHORT_THRESH set to " << short_thresh_;
+    // servers move key-value pairs to each other in a rebalance
+    connect_servers_ = GetEnv("PS_KEY_MIGRATION", 0) != 0;
     if (!standalone) Van::Start(customer_id, false);
   }
 
   void Stop() override {
     PS_VLOG(1) << "Stopping " << my_node_.ShortDebugString();
     if (!standalone_) Van::Stop();
-    // join all threads
+    // join the receive thread
     should_stop_ = true;
-    for (auto t : thread_list_) t->join();
+    WakeUpRecvLoop();
+    recv_thread_->join();
+    recv_thread_.reset();
+    close(wakeup_fds_[0]);
+    close(wakeup_fds_[1]);
     PS_VLOG(1) << my_node_.ShortDebugString() << " all threads joined and destroyed";
     // close sockets
     int linger = 0;
-    int rc = zmq_setsockopt(receiver_, ZMQ_LINGER, &linger, sizeof(linger));
+    int rc = zmq_setsockopt(receiver_.socket, ZMQ_LINGER, &linger, sizeof(linger));
     CHECK(rc == 0 || errno == ETERM);
-    CHECK_EQ(zmq_close(receiver_), 0);
+    CHECK_EQ(zmq_close(receiver_.socket), 0);
+    receiver_.socket = nullptr;
     std::lock_guard<std::mutex> lk(mu_);
     for (auto& it : senders_) {
-      int rc = zmq_setsockopt(it.second, ZMQ_LINGER, &linger, sizeof(linger));
+      std::lock_guard<std::mutex> peer_lk(it.second->mu);
+      if (it.second->socket == nullptr) continue;
+      int rc = zmq_setsockopt(it.second->socket, ZMQ_LINGER, &linger, sizeof(linger));
       CHECK(rc == 0 || errno == ETERM);
-      CHECK_EQ(zmq_close(it.second), 0);
+      CHECK_EQ(zmq_close(it.second->socket), 0);
     }
     senders_.clear();
+    recv_sockets_.clear();
     zmq_ctx_destroy(context_);
     context_ = nullptr;
   }
@@ -98,11 +140,11 @@ class ZMQVan : public Van {
   int Bind(Node& node, int max_retry) override {
     CHECK_EQ(my_node_.num_ports, 1)
       << "zmq van does not support multiple ports";
-    receiver_ = zmq_socket(context_, ZMQ_ROUTER);
+    receiver_.socket = zmq_socket(context_, ZMQ_ROUTER);
     int option = 1;
-    CHECK(!zmq_setsockopt(receiver_, ZMQ_ROUTER_MANDATORY, &option, sizeof(option)))
+    CHECK(!zmq_setsockopt(receiver_.socket, ZMQ_ROUTER_MANDATORY, &option, sizeof(option)))
         << zmq_strerror(errno);
-    CHECK(receiver_ != NULL)
+    CHECK(receiver_.socket != NULL)
         << "create receiver socket failed: " << zmq_strerror(errno);
     int local = GetEnv("DMLC_LOCAL", 0);
     std::string hostname = node.hostname.empty() ? "*" : node.hostname;
@@ -115,7 +157,7 @@ class ZMQVan : public Van {
     unsigned seed = static_cast<unsigned>(time(NULL) + port);
     for (int i = 0; i < max_retry + 1; ++i) {
       auto address = addr + std::to_string(port);
-      int ret = zmq_bind(receiver_, address.c_str());
+      int ret = zmq_bind(receiver_.socket, address.c_str());
       if (ret == 0) break;
       if (i == max_retry) {
         port = -1;
@@ -126,10 +168,15 @@ class ZMQVan : public Van {
         port = 10000 + rand_r(&seed) % 40000;
       }
     }
+    CHECK_EQ(pipe(wakeup_fds_), 0) << strerror(errno);
+    for (int fd : wakeup_fds_) {
+      CHECK_EQ(fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK), 0);
+    }
     std::lock_guard<std::mutex> lk(mu_);
     is_worker_ = (node.role == Node::WORKER ? true : false);
-    auto t = new std::thread(&ZMQVan::CallZmqRecvThread, this, (void*) receiver_);
-    thread_list_.push_back(t);
+    AddRecvSocket(&receiver_);
+    recv_thread_ = std::unique_ptr<std::thread>(
+        new std::thread(&ZMQVan::ZmqRecvLoop, this));
 
     return port;
   }
@@ -139,17 +186,13 @@ class ZMQVan : public Van {
     CHECK_NE(node.port, node.kEmpty);
     CHECK(node.hostname.size());
     int id = node.id;
-    mu_.lock();
-    auto it = senders_.find(id);
-    if (it != senders_.end()) {
-      zmq_close(it->second);
-    }
-    mu_.unlock();
     // worker doesn't need to connect to the other workers if not in standalone mode.
     // same for server
-    if ((node.role == my_node_.role) && (node.id != my_node_.id) && !standalone_) {
+    bool peer = node.role == Node::SERVER && connect_servers_;
+    if ((node.role == my_node_.role) && (node.id != my_node_.id) && !standalone_ && !peer) {
       PS_VLOG(1) << "Zmq skipped connection to node " << node.DebugString()
                  << ". My node is " << my_node_.DebugString();
+      ResetSender(id, nullptr, false);
       return;
     } else {
       PS_VLOG(1) << "Zmq connecting to node " << node.DebugString()
@@ -160,14 +203,12 @@ class ZMQVan : public Van {
         << zmq_strerror(errno)
         << ". it often can be solved by \"sudo ulimit -n 65536\""
         << " or edit /etc/security/limits.conf";
+    bool recv_on_sender = false;
     if (my_node_.id != Node::kEmpty) {
-      std::string my_id = "ps" + std::to_string(my_node_.id);
-      zmq_setsockopt(sender, ZMQ_IDENTITY, my_id.data(), my_id.size());
-      std::lock_guard<std::mutex> lk(mu_);
-      if (is_worker_ && (senders_.find(id)==senders_.end())) {
-        auto t = new std::thread(&ZMQVan::CallZmqRecvThread, this, (void*) sender);
-        thread_list_.push_back(t);
-      }
+      EncodeZmqIdentity(my_node_.id, my_identity_);
+      zmq_setsockopt(sender, ZMQ_IDENTITY, my_identity_, kZmqIdentitySize);
+      // workers get the data responses from servers on the sender socket
+      recv_on_sender = is_worker_;
     }
     // connect
     std::string addr =
@@ -178,29 +219,24 @@ class ZMQVan : public Van {
     if (zmq_connect(sender, addr.c_str()) != 0) {
       LOG(FATAL) << "connect to " + addr + " failed: " + zmq_strerror(errno);
     }
-    std::lock_guard<std::mutex> lk(mu_);
-    senders_[id] = sender;
+    ResetSender(id, sender, recv_on_sender);
     PS_VLOG(3) << "Zmq Connected to: " << node.DebugString();
   }
 
   int SendMsg(Message& msg) override {
     if (!is_worker_) return NonWorkerSendMsg(msg);
 
-    std::lock_guard<std::mutex> lk(mu_);
-
     int id = msg.meta.recver;
     CHECK_NE(id, Meta::kEmpty);
 
     // find the socket
-    auto it = senders_.find(id);
-    if (it == senders_.end()) {
-      LOG(WARNING) << "there is no socket to node " << id;
-      return -1;
+    ZmqSocket* peer = FindSender(id);
+    if (peer) {
+      std::lock_guard<std::mutex> lk(peer->mu);
+      if (peer->socket) return ZmqSendMsgAndNotify(peer->socket, msg);
     }
-
-    void* socket = it->second;
-
-    return ZmqSendMsg(socket, msg);
+    LOG(WARNING) << "there is no socket to node " << id;
+    return -1;
   }
 
   void RegisterRecvBuffer(Message &msg) {
@@ -222,193 +258,450 @@ class ZMQVan : public Van {
 
     ZmqBufferContext notification;
     recv_buffers_.WaitAndPop(&notification);
+    return UnpackMsg(&notification, msg);
+  }
+
+  int RecvPackedMsg(Message* msg, bool* packed) override {
+    msg->data.clear();
+
+    ZmqBufferContext notification;
+    recv_buffers_.WaitAndPop(&notification);
+    char* meta_buf = CHECK_NOTNULL((char*)zmq_msg_data(notification.meta_zmsg));
+    size_t meta_len = zmq_msg_size(notification.meta_zmsg);
+    *packed = PeekCompactMeta(meta_buf, meta_len, &msg->meta.app_id, &msg->meta.customer_id);
+    if (!*packed) return UnpackMsg(&notification, msg);
+
+    // the frames as they came, the meta first, see DecodeMsg
+    msg->meta.sender = notification.sender;
+    msg->meta.recver = my_node_.id;
+    size_t recv_bytes = meta_len;
+    msg->data.push_back(WrapZmqMsg(notification.meta_zmsg, msg->meta));
+    for (auto zmsg : notification.data_zmsg) {
+      recv_bytes += zmq_msg_size(zmsg);
+      msg->data.push_back(WrapZmqMsg(zmsg, msg->meta));
+    }
+    return recv_bytes;
+  }
+
+  void DecodeMsg(Message* msg) override {
+    std::vector<SArray<char>> frames;
+    frames.swap(msg->data);
+    CHECK(frames.size());
+    const SArray<char>& meta_frame = frames[0];
+    size_t packed_meta_len = UnpackCompactMeta(meta_frame.data(), meta_frame.size(),
+                                               &(msg->meta));
+    // the devices WrapZmqMsg takes from the meta
+    for (auto& frame : frames) {
+      frame.src_device_type_ = msg->meta.src_dev_type;
+      frame.src_device_id_ = msg->meta.src_dev_id;
+      frame.dst_device_type_ = msg->meta.dst_dev_type;
+      frame.dst_device_id_ = msg->meta.dst_dev_id;
+    }
+    if (frames.size() == 1 && meta_frame.size() > packed_meta_len) {
+      AddInlineData(meta_frame, packed_meta_len, msg);
+      return;
+    }
+    for (size_t i = 1; i < frames.size(); ++i) AddRecvData(i - 1, frames[i], msg);
+  }
 
+ private:
+  /**
+   * \brief decode a received message
+   * \return the number of bytes received
+   */
+  int UnpackMsg(ZmqBufferContext* notification, Message* msg) {
     size_t recv_bytes = 0;
-    int sender = notification.sender;
+    int sender = notification->sender;
     msg->meta.sender = sender;
     msg->meta.recver = my_node_.id;
 
-    char* meta_buf = CHECK_NOTNULL((char*)zmq_msg_data(notification.meta_zmsg));
-    size_t meta_len = zmq_msg_size(notification.meta_zmsg);
+    char* meta_buf = CHECK_NOTNULL((char*)zmq_msg_data(notification->meta_zmsg));
+    size_t meta_len = zmq_msg_size(notification->meta_zmsg);
 
-    UnpackMeta(meta_buf, meta_len, &(msg->meta));
+    size_t packed_meta_len = UnpackCompactMeta(meta_buf, meta_len, &(msg->meta));
     recv_bytes += meta_len;
 
-    for (size_t i = 0; i < notification.data_zmsg.size(); ++i) {
-      auto zmsg = notification.data_zmsg[i];
-      char* buf = CHECK_NOTNULL((char*)zmq_msg_data(zmsg));
-      size_t size = zmq_msg_size(zmsg);
-      recv_bytes += size;
-
-      // use the registered buffer for the value
-      // for testing purpose only, since this leads to an extra copy
-      if (i == 1 && size != 0) {
-        if (registered_buffs_.find(sender) != registered_buffs_.end()) {
-          Key* key = reinterpret_cast<Key*>(msg->data[0].data());
-          auto& buffs = registered_buffs_[sender];
-          if (buffs.find(*key) != buffs.end()) {
-            SArray<char> val = buffs[*key];
-            CHECK_EQ(val.size(), size) << val.size() << " v.s." << size;
-            std::memcpy(val.data(), buf, val.size());
-            msg->data.push_back(val);
-            PS_VLOG(3) << "Using registered buffer " << (long long) val.data() << ", key=" << *key;
-            continue;
-          } else {
-            PS_VLOG(3) << "Cannot find registered buffer for key=" << *key;
-          }
-        } else {
-          PS_VLOG(3) << "Cannot find registered buffer for sender=" << sender << " my_id=" << my_node_.id
-            << " buff count=" << registered_buffs_.size();
-        }
-      }
-
-      SArray<char> data;
-      // zero copy
-      data.reset(buf, size, 
-        [zmsg, size](void *) {
-          zmq_msg_close(zmsg);
-          delete zmsg;
-        },
-        msg->meta.src_dev_type,
-        msg->meta.src_dev_id,
-        msg->meta.dst_dev_type,
-        msg->meta.dst_dev_id
-      );
+    if (notification->data_zmsg.empty() && meta_len > packed_meta_len) {
+      // meta and data were sent in a single frame, see ZmqSendInlineMsg
+      AddInlineData(WrapZmqMsg(notification->meta_zmsg, msg->meta), packed_meta_len, msg);
+      return recv_bytes;
+    }
+    zmq_msg_close(notification->meta_zmsg);
+    delete notification->meta_zmsg;
 
-      msg->data.push_back(data);
+    for (size_t i = 0; i < notification->data_zmsg.size(); ++i) {
+      auto zmsg = notification->data_zmsg[i];
+      recv_bytes += zmq_msg_size(zmsg);
+      AddRecvData(i, WrapZmqMsg(zmsg, msg->meta), msg);
     }
 
     return recv_bytes;
   }
 
- private:
+  /**
+   * \brief append the data segments of a frame holding both the meta and the
+   * data, see ZmqSendInlineMsg. all of them share the frame without copying
+   */
+  void AddInlineData(const SArray<char>& frame, size_t packed_meta_len, Message* msg) {
+    size_t pos = ZmqInlineAlign(packed_meta_len);
+    uint64_t n;
+    CHECK_LE(pos + sizeof(n), frame.size());
+    memcpy(&n, frame.data() + pos, sizeof(n));
+    const char* sizes = frame.data() + pos + sizeof(n);
+    pos += (n + 1) * sizeof(uint64_t);
+    for (size_t i = 0; i < n; ++i) {
+      uint64_t size;
+      memcpy(&size, sizes + i * sizeof(size), sizeof(size));
+      CHECK_LE(pos + size, frame.size()) << "malformed inline message";
+      AddRecvData(i, frame.segment(pos, pos + size), msg);
+      pos += ZmqInlineAlign(size);
+    }
+  }
 
-  int NonWorkerSendMsg(Message& msg) {
-    std::lock_guard<std::mutex> lk(mu_);
+  /**
+   * \brief zero-copy wrap a received zmq message, which is closed once the
+   * returned array and all its segments are released
+   */
+  SArray<char> WrapZmqMsg(zmq_msg_t* zmsg, const Meta& meta) {
+    char* buf = CHECK_NOTNULL((char*)zmq_msg_data(zmsg));
+    size_t size = zmq_msg_size(zmsg);
+    SArray<char> data;
+    data.reset(buf, size,
+      [zmsg](void *) {
+        zmq_msg_close(zmsg);
+        delete zmsg;
+      },
+      meta.src_dev_type,
+      meta.src_dev_id,
+      meta.dst_dev_type,
+      meta.dst_dev_id
+    );
+    return data;
+  }
+
+  /**
+   * \brief append the i-th received data segment to msg
+   */
+  void AddRecvData(size_t i, const SArray<char>& data, Message* msg) {
+    int sender = msg->meta.sender;
+    // use the registered buffer for the value
+    // for testing purpose only, since this leads to an extra copy
+    if (i == 1 && data.size() != 0) {
+      if (registered_buffs_.find(sender) != registered_buffs_.end()) {
+        Key* key = reinterpret_cast<Key*>(msg->data[0].data());
+        auto& buffs = registered_buffs_[sender];
+        if (buffs.find(*key) != buffs.end()) {
+          SArray<char> val = buffs[*key];
+          CHECK_EQ(val.size(), data.size()) << val.size() << " v.s." << data.size();
+          std::memcpy(val.data(), data.data(), val.size());
+          msg->data.push_back(val);
+          PS_VLOG(3) << "Using registered buffer " << (long long) val.data() << ", key=" << *key;
+          return;
+        } else {
+          PS_VLOG(3) << "Cannot find registered buffer for key=" << *key;
+        }
+      } else {
+        PS_VLOG(3) << "Cannot find registered buffer for sender=" << sender << " my_id=" << my_node_.id
+          << " buff count=" << registered_buffs_.size();
+      }
+    }
+    msg->data.push_back(data);
+  }
 
+  int NonWorkerSendMsg(Message& msg) {
     // find the socket
     int id = msg.meta.recver;
     CHECK_NE(id, Meta::kEmpty);
 
-    auto it = senders_.find(id);
-    if (it == senders_.end()) {
+    ZmqSocket* peer = FindSender(id);
+    if (peer == nullptr) {
       LOG(FATAL) << "there is no socket to node " << id;
       return -1;
     }
 
-    void* socket;
-
     if (msg.meta.simple_app || !msg.meta.control.empty()
                || (GetRoleFromId(id) != Node::WORKER)) {
-      socket = it->second;
+      std::lock_guard<std::mutex> lk(peer->mu);
+      CHECK(peer->socket) << "there is no socket to node " << id;
+      return ZmqSendMsgAndNotify(peer->socket, msg);
     }
-    else { // data msg, and recver is WORKER
-      socket = receiver_; // scheduler/server using receiver socket --> worker sender socket
+    { // data msg, and recver is WORKER
+      // scheduler/server using receiver socket --> worker sender socket
+      std::lock_guard<std::mutex> lk(receiver_.mu);
+      void* socket = receiver_.socket;
+
+      // first, send dst id, then my id. both are cached, so they go out as
+      // constant messages without any allocation
+      ZmqSendConst(socket, peer->identity, kZmqIdentitySize, ZMQ_SNDMORE);
+      ZmqSendConst(socket, my_identity_, kZmqIdentitySize, ZMQ_SNDMORE);
+      return ZmqSendMsgAndNotify(socket, msg);
+    }
+  }
 
-      // first, send dst id
-      std::string dst = "ps" + std::to_string(id);
-      int len = dst.size();
-      char *dst_array = new char[len + 1];
-      strcpy(dst_array, dst.c_str());
-      CHECK(dst_array);
+  /**
+   * \brief the sender socket to node id, nullptr if not connected. the
+   * returned object stays valid until Stop
+   */
+  ZmqSocket* FindSender(int id) {
+    std::lock_guard<std::mutex> lk(mu_);
+    auto it = senders_.find(id);
+    return it == senders_.end() ? nullptr : it->second.get();
+  }
 
-      zmq_msg_t zmsg_dstid;
-      CHECK_EQ(zmq_msg_init_data(
-          &zmsg_dstid, dst_array, len, FreeData, NULL), 0);
-      while (true) {
-        if (len == zmq_msg_send(&zmsg_dstid, receiver_, ZMQ_SNDMORE)) break;
-        if (errno == EINTR) continue;
-        CHECK(0) << zmq_strerror(errno);
+  /**
+   * \brief install socket as the sender to node id, closing the previous one
+   */
+  void ResetSender(int id, void* socket, bool recv_on_socket) {
+    std::lock_guard<std::mutex> lk(mu_);
+    auto& peer = senders_[id];
+    if (!peer) {
+      peer.reset(new ZmqSocket());
+      EncodeZmqIdentity(id, peer->identity);
+    }
+    std::lock_guard<std::mutex> peer_lk(peer->mu);
+    if (peer->socket) {
+      RemoveRecvSocket(peer.get());
+      zmq_close(peer->socket);
+    }
+    peer->socket = socket;
+    if (socket && recv_on_socket) AddRecvSocket(peer.get());
+  }
+
+  /**
+   * \brief the receive reactor: parks in zmq_poll on the file descriptors of
+   * all receiving sockets and drains the sockets which became readable.
+   *
+   * a socket's lock is only held while a message is being received from it,
+   * never while waiting.
+   */
+  void ZmqRecvLoop() {
+    LOG(INFO) << "Start ZMQ recv thread";
+    std::vector<ZmqSocket*> sockets;
+    std::vector<zmq_pollitem_t> items;
+    int version = -1;
+    bool drain_all = true;
+    while (!should_stop_) {
+      if (version != recv_sockets_version_) {
+        std::lock_guard<std::mutex> lk(mu_);
+        version = recv_sockets_version_;
+        sockets = recv_sockets_;
+        // items[0] is the wakeup pipe, items[i + 1] is sockets[i]
+        items.assign(sockets.size() + 1, zmq_pollitem_t());
+        items[0].fd = wakeup_fds_[0];
+        items[0].events = ZMQ_POLLIN;
+        for (size_t i = 0; i < sockets.size(); ++i) {
+          std::lock_guard<std::mutex> peer_lk(sockets[i]->mu);
+          size_t len = sizeof(items[i + 1].fd);
+          CHECK_EQ(zmq_getsockopt(sockets[i]->socket, ZMQ_FD, &items[i + 1].fd, &len), 0)
+              << zmq_strerror(errno);
+          items[i + 1].events = ZMQ_POLLIN;
+        }
+        drain_all = true;
+      }
+      // ZMQ_FD is edge-triggered, so every signalled socket is drained until
+      // it would block before going back to sleep
+      for (size_t i = 0; i < sockets.size(); ++i) {
+        if (!drain_all && !items[i + 1].revents) continue;
+        if (!DrainSocket(sockets[i], version)) break;
       }
+      if (should_stop_) break;
+      if (version != recv_sockets_version_) continue;
 
-      // second, send my id
-      std::string my_id = "ps" + std::to_string(my_node_.id);
-      len = my_id.size();
-      char *myid_array = new char[len + 1];
-      strcpy(myid_array, my_id.c_str());
-      CHECK(myid_array);
+      int rc = zmq_poll(items.data(), items.size(), kRecvPollTimeoutMs);
+      if (rc == -1) {
+        CHECK_EQ(errno, EINTR) << zmq_strerror(errno);
+        rc = 0;
+      }
+      drain_all = (rc == 0) || items[0].revents;
+      if (items[0].revents) {
+        // clear the flag before emptying the pipe so no wakeup is lost
+        wakeup_pending_ = false;
+        char buf[64];
+        while (read(wakeup_fds_[0], buf, sizeof(buf)) > 0) {}
+      }
+    }
+  }
 
-      zmq_msg_t zmsg_myid;
-      CHECK_EQ(zmq_msg_init_data(
-          &zmsg_myid, myid_array, len, FreeData, NULL), 0);
-      while (true) {
-        if (len == zmq_msg_send(&zmsg_myid, receiver_, ZMQ_SNDMORE)) break;
+  /**
+   * \brief receive all pending messages on socket without blocking
+   * \return false if the set of receiving sockets has changed meanwhile
+   */
+  bool DrainSocket(ZmqSocket* peer, int version) {
+    while (true) {
+      ZmqBufferContext buf_ctx;
+      {
+        // the socket set only changes while the affected socket is locked
+        std::lock_guard<std::mutex> lk(peer->mu);
+        if (version != recv_sockets_version_) return false;
+        if (!ZmqRecvMultipart(peer->socket, &buf_ctx)) return true;
+      }
+      recv_buffers_.Push(std::move(buf_ctx));
+    }
+  }
+
+  /**
+   * \brief receive one multipart message: [sender identity][meta][data]...
+   * \return false if no message is available
+   */
+  bool ZmqRecvMultipart(void* socket, ZmqBufferContext* buf_ctx) {
+    for (int i = 0;; ++i) {
+      zmq_msg_t* zmsg = new zmq_msg_t;
+      CHECK(zmq_msg_init(zmsg) == 0) << zmq_strerror(errno);
+      // only the first frame may be missing, the rest of a multipart
+      // message is delivered atomically with it
+      int tag = (i == 0) ? ZMQ_DONTWAIT : 0;
+      while (zmq_msg_recv(zmsg, socket, tag) == -1) {
         if (errno == EINTR) continue;
-        CHECK(0) << zmq_strerror(errno);
+        if (errno == EAGAIN && i == 0) {
+          zmq_msg_close(zmsg);
+          delete zmsg;
+          return false;
+        }
+        CHECK(0) << "failed to receive message. errno: " << errno << " "
+                 << zmq_strerror(errno);
+      }
+      char* buf = CHECK_NOTNULL((char*)zmq_msg_data(zmsg));
+      size_t size = zmq_msg_size(zmsg);
+
+      if (i == 0) {
+        // identify
+        buf_ctx->sender = GetNodeID(buf, size);
+        CHECK(zmq_msg_more(zmsg));
+        zmq_msg_close(zmsg);
+        delete zmsg;
+      } else if (i == 1) {
+        // task
+        buf_ctx->meta_zmsg = zmsg;
+        if (!zmq_msg_more(zmsg)) break;
+      } else {
+        buf_ctx->data_zmsg.push_back(zmsg);
+        if (!zmq_msg_more(zmsg)) break;
       }
     }
+    return true;
+  }
 
-    return ZmqSendMsg(socket, msg);
+  /**
+   * \brief sending on a socket also processes its pending commands, which may
+   * consume the edge the receive thread is waiting for. wake it up if there
+   * is something to read. must hold the socket's lock
+   */
+  int ZmqSendMsgAndNotify(void* socket, Message& msg) {
+    int send_bytes = ZmqSendMsg(socket, msg);
+    NotifyIfReadable(socket);
+    return send_bytes;
   }
 
-  void CallZmqRecvThread(void* socket) {
-    CHECK(socket);
-    LOG(INFO) << "Start ZMQ recv thread";
+  void NotifyIfReadable(void* socket) {
+    int events = 0;
+    size_t len = sizeof(events);
+    if (zmq_getsockopt(socket, ZMQ_EVENTS, &events, &len) == 0 &&
+        (events & ZMQ_POLLIN)) {
+      WakeUpRecvLoop();
+    }
+  }
+
+  void WakeUpRecvLoop() {
+    if (wakeup_pending_.exchange(true)) return;
+    char c = 0;
+    while (write(wakeup_fds_[1], &c, 1) == -1 && errno == EINTR) {}
+  }
 
+  /** \brief must hold mu_ */
+  void AddRecvSocket(ZmqSocket* socket) {
+    recv_sockets_.push_back(socket);
+    ++recv_sockets_version_;
+    if (recv_thread_) WakeUpRecvLoop();
+  }
+
+  /** \brief must hold mu_ and the socket's lock */
+  void RemoveRecvSocket(ZmqSocket* socket) {
+    auto it = std::find(recv_sockets_.begin(), recv_sockets_.end(), socket);
+    if (it == recv_sockets_.end()) return;
+    recv_sockets_.erase(it);
+    ++recv_sockets_version_;
+    WakeUpRecvLoop();
+  }
+
+  /**
+   * \brief send a buffer which stays valid until the socket is closed
+   */
+  void ZmqSendConst(void* socket, const char* buf, size_t len, int tag) {
     while (true) {
-      ZmqBufferContext *buf_ctx = new ZmqBufferContext();
-
-      for (int i = 0;; ++i) {
-        zmq_msg_t* zmsg = new zmq_msg_t;
-        CHECK(zmq_msg_init(zmsg) == 0) << zmq_strerror(errno);
-        while (true) {
-          std::lock_guard<std::mutex> lk(mu_);
-          // the zmq_msg_recv should be non-blocking, otherwise deadlock will happen
-          int tag = ZMQ_DONTWAIT;
-          if (should_stop_ || zmq_msg_recv(zmsg, socket, tag) != -1) break;
-          if (errno == EINTR) {
-            std::cout << "interrupted";
-            continue;
-          } else if (errno == EAGAIN) { // ZMQ_DONTWAIT
-            continue;
-          }
-          CHECK(0) << "failed to receive message. errno: " << errno << " "
-                       << zmq_strerror(errno);
-        }
-        if (should_stop_) break;
-        char* buf = CHECK_NOTNULL((char*)zmq_msg_data(zmsg));
-        size_t size = zmq_msg_size(zmsg);
-
-        if (i == 0) {
-          // identify
-          buf_ctx->sender = GetNodeID(buf, size);
-          CHECK(zmq_msg_more(zmsg));
-          zmq_msg_close(zmsg);
-          delete zmsg;
-        }
-        else if (i == 1) {
-          // task
-          buf_ctx->meta_zmsg = zmsg;
-          bool more = zmq_msg_more(zmsg);
-          if (!more) break;
-        }
-        else {
-          buf_ctx->data_zmsg.push_back(zmsg);
-          bool more = zmq_msg_more(zmsg);
-          if (!more) break;
-        }
-      } // for
-      if (should_stop_) break;
-      recv_buffers_.Push(*buf_ctx);
-    } // while
+      if (zmq_send_const(socket, buf, len, tag) == static_cast<int>(len)) break;
+      if (errno == EINTR) continue;
+      CHECK(0) << zmq_strerror(errno);
+    }
+  }
+
+  static size_t ZmqInlineAlign(size_t size) {
+    return (size + 7) & ~static_cast<size_t>(7);
+  }
+
+  /**
+   * \brief send meta and all data in a single frame, laid out as
+   * [meta][n][n data sizes][data 0]...[data n-1], where n and the sizes are
+   * uint64 and every section starts at a multiple of 8 bytes
+   */
+  int ZmqSendInlineMsg(void* socket, Message& msg) {
+    int meta_size;
+    const char* meta_buf = PackCompactMeta(msg.meta, &meta_size);
+    uint64_t n = msg.data.size();
+    size_t total = ZmqInlineAlign(meta_size) + (n + 1) * sizeof(uint64_t);
+    for (const auto& d : msg.data) total += ZmqInlineAlign(d.size());
+
+    zmq_msg_t frame;
+    CHECK_EQ(zmq_msg_init_size(&frame, total), 0) << zmq_strerror(errno);
+    char* buf = static_cast<char*>(zmq_msg_data(&frame));
+    memcpy(buf, meta_buf, meta_size);
+    size_t pos = ZmqInlineAlign(meta_size);
+    memset(buf + meta_size, 0, pos - meta_size);
+    memcpy(buf + pos, &n, sizeof(n));
+    pos += sizeof(n);
+    for (const auto& d : msg.data) {
+      uint64_t size = d.size();
+      memcpy(buf + pos, &size, sizeof(size));
+      pos += sizeof(size);
+    }
+    for (const auto& d : msg.data) {
+      size_t aligned = ZmqInlineAlign(d.size());
+      memcpy(buf + pos, d.data(), d.size());
+      memset(buf + pos + d.size(), 0, aligned - d.size());
+      pos += aligned;
+    }
+    CHECK_EQ(pos, total);
+
+    while (true) {
+      if (zmq_msg_send(&frame, socket, 0) == static_cast<int>(total)) break;
+      if (errno == EINTR) continue;
+      LOG(WARNING) << "failed to send message, errno: "
+                   << errno << " " << zmq_strerror(errno);
+      zmq_msg_close(&frame);
+      return -1;
+    }
+    return total;
   }
 
   int ZmqSendMsg(void* socket, Message& msg) {
-    // send meta
+    if (short_thresh_ > 0 && msg.data.size()) {
+      size_t data_size = 0;
+      for (const auto& d : msg.data) data_size += d.size();
+      if (data_size <= static_cast<size_t>(short_thresh_)) {
+        return ZmqSendInlineMsg(socket, msg);
+      }
+    }
+    // send meta. the compact meta of a data message is small enough to be
+    // stored inside the zmq message itself, so copying it allocates nothing
     int meta_size;
-    char* meta_buf = nullptr;
-    PackMeta(msg.meta, &meta_buf, &meta_size);
+    const char* meta_buf = PackCompactMeta(msg.meta, &meta_size);
     int tag = ZMQ_SNDMORE;
     int n = msg.data.size();
     if (n == 0) tag = 0;
-    zmq_msg_t meta_msg;
-    zmq_msg_init_data(&meta_msg, meta_buf, meta_size, FreeData, NULL);
     while (true) {
-      if (zmq_msg_send(&meta_msg, socket, tag) == meta_size) break;
+      if (zmq_send(socket, meta_buf, meta_size, tag) == meta_size) break;
       if (errno == EINTR) continue;
       CHECK(0) << zmq_strerror(errno);
     }
-    zmq_msg_close(&meta_msg);
     int send_bytes = meta_size;
 
     // send data
@@ -437,17 +730,10 @@ class ZMQVan : public Van {
    * \return -1 if not find
    */
   int GetNodeID(const char* buf, size_t size) {
-    if (size > 2 && buf[0] == 'p' && buf[1] == 's') {
-      int id = 0;
-      size_t i = 2;
-      for (; i < size; ++i) {
-        if (buf[i] >= '0' && buf[i] <= '9') {
-          id = id * 10 + buf[i] - '0';
-        } else {
-          break;
-        }
-      }
-      if (i == size) return id;
+    if (size == kZmqIdentitySize && buf[0] == 'p' && buf[1] == 's') {
+      const unsigned char* p = reinterpret_cast<const unsigned char*>(buf + 2);
+      uint32_t v = p[0] | (p[1] << 8) | (p[2] << 16) | (static_cast<uint32_t>(p[3]) << 24);
+      return static_cast<int>(v);
     }
     return Meta::kEmpty;
   }
@@ -460,11 +746,15 @@ class ZMQVan : public Van {
 
   void* context_ = nullptr;
   /**
-   * \brief node_id to the socket for sending data to this node
+   * \brief node_id to the socket for sending data to this node. entries are
+   * never erased before Stop, so the sockets can be used without holding mu_
    */
-  std::unordered_map<int, void*> senders_;
+  std::unordered_map<int, std::unique_ptr<ZmqSocket>> senders_;
+  /** \brief guards senders_ and recv_sockets_, not the sockets themselves */
   std::mutex mu_;
-  void* receiver_ = nullptr;
+  ZmqSocket receiver_;
+  /** \brief my identity, valid once my node id is assigned */
+  char my_identity_[kZmqIdentitySize];
 
   bool is_worker_;
 
@@ -473,9 +763,20 @@ class ZMQVan : public Van {
 
   std::atomic<bool> should_stop_{false};
 
-  std::vector<std::thread*> thread_list_;
+  // the receive reactor and the sockets it watches, guarded by mu_
+  std::unique_ptr<std::thread> recv_thread_;
+  std::vector<ZmqSocket*> recv_sockets_;
+  std::atomic<int> recv_sockets_version_{0};
+  // written to wake the reactor up from zmq_poll
+  int wakeup_fds_[2] = {-1, -1};
+  std::atomic<bool> wakeup_pending_{false};
+  // fallback poll timeout in milliseconds
+  static constexpr long kRecvPollTimeoutMs = 100;
   bool standalone_;
+  // whether servers connect to each other, see PS_KEY_MIGRATION
+  bool connect_servers_ = false;
   std::unordered_map<int, std::unordered_map<Key, SArray<char>>> registered_buffs_;
+  int short_thresh_ = 0;
 
 };
 }  // namespace ps
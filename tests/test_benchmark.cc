@@ -1,5 +1,6 @@
 #include <chrono>
 #include <cmath>
+#include <mutex>
 #include <thread>
 #include <cstdlib>
 #include <unistd.h>
@@ -43,6 +44,10 @@ int num_gpu_server = 0;
 bool enable_cpu_server = 0;
 bool is_server = false;
 
+// sum of the goodput of all worker threads, in Gbps
+std::mutex aggregate_mu;
+double aggregate_goodput = 0;
+
 bool env2bool(const char* var, bool default_val) {
   auto env_str = Environment::Get()->find(var);
   bool val = env_str ? atoi(env_str) != 0 : default_val;
@@ -354,6 +359,7 @@ void push_pull(KVWorker<char>* kv,
   
   int cnt = 0;
   int total_cnt = 0;
+  auto run_start = std::chrono::high_resolution_clock::now();
   while (total_cnt < total_log_duration) {
     for (int key = 0; key < total_key_num; key++) {
       auto keys = server_keys[key];
@@ -394,6 +400,12 @@ void push_pull(KVWorker<char>* kv,
     cnt = 0;
     start = std::chrono::high_resolution_clock::now();
   }
+
+  auto run_time = (std::chrono::high_resolution_clock::now() - run_start).count();
+  int msgs_per_key = (mode == PUSH_PULL) ? 2 : 1;
+  std::lock_guard<std::mutex> lk(aggregate_mu);
+  aggregate_goodput += 8.0 * len * sizeof(char) * total_key_num * total_cnt
+                       * msgs_per_key / run_time;
 }
 
 void RunWorker(int argc, char *argv[], KVWorker<char>* kv, int tid) {
@@ -538,7 +550,10 @@ int main(int argc, char *argv[]) {
     std::vector<KVWorker<char>*> kvs;
     std::vector<std::thread> threads;
     for (int i = 0; i < nthread; ++i) {
-      KVWorker<char>* kv = new KVWorker<char>(0, 0, i);
+      // with DMLC_GROUP_SIZE > 1 every thread gets its own worker instance,
+      // otherwise the threads share the van through different customers
+      KVWorker<char>* kv = group_size > 1 ? new KVWorker<char>(0, 0, i)
+                                          : new KVWorker<char>(0, i);
       kvs.emplace_back(kv);
       threads.emplace_back(RunWorker, argc, argv, kv, threads.size());
     }
@@ -546,6 +561,10 @@ int main(int argc, char *argv[]) {
       threads[i].join();
       LOG(INFO) << "Thread " << i << " is done.";
     }
+    if (aggregate_goodput > 0) {
+      LL << "Aggregate goodput of " << nthread << " threads: "
+         << aggregate_goodput << " Gbps";
+    }
   }
   // stop system
   Finalize(0, role, true);
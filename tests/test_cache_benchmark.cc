@@ -0,0 +1,126 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+#include "ps/ps.h"
+
+using namespace ps;
+
+// a thread of every worker pushes increasing counters to its keys, while
+// another thread of the worker pulls them through the versioned cache. a
+// pull sent after a push was answered must see that push: a value cached
+// under the version of a later push would be taken for unchanged, and the
+// worker would read it again and again
+const int kValLen = 4;
+
+int env2int(const char* var, int default_val) {
+  auto env_str = Environment::Get()->find(var);
+  return env_str ? atoi(env_str) : default_val;
+}
+
+std::unordered_map<Key, SArray<int>> store;
+std::mutex store_mu;
+// how long a pull is answered after its values are read, which pushes
+// arriving meanwhile must not be tagged on
+int handle_us = 0;
+
+void CounterHandle(const KVMeta& req_meta, const KVPairs<int>& req_data,
+                   KVServer<int>* server) {
+  size_t n = req_data.keys.size();
+  KVPairs<int> res;
+  if (req_meta.push) {
+    CHECK_EQ(req_data.vals.size(), n * kValLen);
+    std::lock_guard<std::mutex> lk(store_mu);
+    for (size_t i = 0; i < n; ++i) {
+      store[req_data.keys[i]].CopyFrom(req_data.vals.data() + i * kValLen, kValLen);
+    }
+  } else {
+    res.keys = req_data.keys;
+    res.vals.resize(n * kValLen, 0);
+    std::lock_guard<std::mutex> lk(store_mu);
+    for (size_t i = 0; i < n; ++i) {
+      auto it = store.find(req_data.keys[i]);
+      if (it != store.end()) {
+        memcpy(res.vals.data() + i * kValLen, it->second.data(), kValLen * sizeof(int));
+      }
+    }
+  }
+  if (!req_meta.push && handle_us > 0) {
+    std::this_thread::sleep_for(std::chrono::microseconds(handle_us));
+  }
+  server->Response(req_meta, res);
+}
+
+void RunWorker(int count) {
+  auto krs = Postoffice::Get()->GetServerKeyRanges();
+  // one key per server and worker
+  SArray<Key> keys;
+  for (const auto& range : krs) keys.push_back(range.begin() + MyRank());
+  const size_t n = keys.size();
+  KVWorker<int> pusher(0, 0);
+  KVWorker<int> puller(0, 1);
+  puller.set_cache(1 << 20, -1);
+
+  // the last counter whose push was answered
+  std::atomic<int> acked{0};
+  std::thread push_thread([&]() {
+    SArray<int> vals(n * kValLen);
+    for (int i = 1; i <= count; ++i) {
+      for (auto& v : vals) v = i;
+      pusher.Wait(pusher.ZPush(keys, vals));
+      acked.store(i, std::memory_order_release);
+    }
+  });
+
+  size_t num_pulls = 0, num_fresh = 0;
+  // the counter last pulled of every key
+  std::vector<int> last(n, 0);
+  auto start = std::chrono::high_resolution_clock::now();
+  while (*std::min_element(last.begin(), last.end()) < count) {
+    int before = acked.load(std::memory_order_acquire);
+    SArray<int> vals;
+    puller.Wait(puller.CachedPull(keys, &vals));
+    CHECK_EQ(vals.size(), n * kValLen);
+    for (size_t i = 0; i < n; ++i) {
+      int counter = vals[i * kValLen];
+      CHECK_GE(counter, before) << "stale cached value of key " << keys[i];
+      CHECK_GE(counter, last[i]) << "key " << keys[i] << " went back";
+      num_fresh += counter != last[i];
+      last[i] = counter;
+    }
+    ++num_pulls;
+  }
+  auto end = std::chrono::high_resolution_clock::now();
+  push_thread.join();
+  double sec = std::chrono::duration<double>(end - start).count();
+  LL << "worker " << MyRank() << ": " << num_pulls << " cached pulls of " << n
+     << " keys, " << num_pulls / sec << " pulls/s, "
+     << 100.0 * num_fresh / (num_pulls * n) << "% of the values changed";
+}
+
+int main(int argc, char *argv[]) {
+  // the pushes of every worker
+  int count = (argc > 1) ? atoi(argv[1]) : 2000;
+  const char* val = CHECK_NOTNULL(Environment::Get()->find("DMLC_ROLE"));
+  std::string role_str(val);
+  Node::Role role = GetRole(role_str);
+  StartPS(0, role, -1, true);
+
+  if (IsServer()) {
+    auto server = new KVServer<int>(0);
+    server->set_request_handle(CounterHandle);
+    server->set_versioning(true);
+    // pushes and pulls of a key may then be queued behind each other
+    server->set_executor(env2int("BENCHMARK_SERVER_THREADS", 2));
+    handle_us = env2int("BENCHMARK_HANDLE_US", 100);
+    RegisterExitCallback([server]() { delete server; });
+  }
+  if (!IsServer() && !IsScheduler()) RunWorker(count);
+
+  Finalize(0, role, true);
+  return 0;
+}
@@ -0,0 +1,133 @@
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdlib>
+#include <memory>
+#include <mutex>
+#include <new>
+#include "ps/ps.h"
+
+using namespace ps;
+
+// every heap allocation of the process is counted. a copy of a data message
+// allocates at least its data vector and its meta.data_type vector, and bumps
+// the refcount of every SArray it holds, so allocations per message tell how
+// many times a message is copied between the van and the handler.
+std::atomic<int64_t> num_allocs{0};
+
+void* operator new(size_t size) {
+  num_allocs.fetch_add(1, std::memory_order_relaxed);
+  void* ptr = malloc(size ? size : 1);
+  if (!ptr) throw std::bad_alloc();
+  return ptr;
+}
+void operator delete(void* ptr) noexcept { free(ptr); }
+void operator delete(void* ptr, size_t) noexcept { free(ptr); }
+
+std::mutex done_mu;
+std::condition_variable done_cond;
+int num_done = 0;
+// references to the first data array as seen by the handler
+long handler_refs = 0;
+
+void Handle(const Message& msg) {
+  std::lock_guard<std::mutex> lk(done_mu);
+  handler_refs += msg.data[0].ptr().use_count();
+  if (++num_done % 1024 == 0) done_cond.notify_all();
+}
+
+// a push request as it comes out of Van::RecvMsg at a server
+Message PushRequest(int ts) {
+  Message msg;
+  msg.meta.app_id = 0;
+  msg.meta.customer_id = 0;
+  msg.meta.request = true;
+  msg.meta.push = true;
+  msg.meta.timestamp = ts;
+  msg.meta.sender = 9;
+  msg.meta.recver = 8;
+  SArray<Key> keys(1, ts);
+  SArray<float> vals(16);
+  SArray<int> lens(1, 16 * sizeof(float));
+  msg.AddData(keys);
+  msg.AddData(vals);
+  msg.AddData(lens);
+  return msg;
+}
+
+template <typename F>
+void Run(const std::string& name, int repeat, F dispatch) {
+  std::vector<Message> msgs;
+  msgs.reserve(repeat);
+  for (int i = 0; i < repeat; ++i) msgs.push_back(PushRequest(i));
+  {
+    std::lock_guard<std::mutex> lk(done_mu);
+    num_done = 0;
+    handler_refs = 0;
+  }
+
+  int64_t allocs = num_allocs.load();
+  auto start = std::chrono::high_resolution_clock::now();
+  for (auto& msg : msgs) dispatch(&msg);
+  {
+    std::unique_lock<std::mutex> lk(done_mu);
+    done_cond.wait(lk, [repeat]{ return num_done == repeat; });
+  }
+  auto end = std::chrono::high_resolution_clock::now();
+  allocs = num_allocs.load() - allocs;
+
+  LL << name << ":\t" << static_cast<double>(allocs) / repeat << " allocs/msg, "
+     << static_cast<double>(handler_refs) / repeat << " refs/array in handler, "
+     << std::chrono::duration<double, std::nano>(end - start).count() / repeat
+     << " ns/msg";
+}
+
+// the customer lookup done by the receive thread for every data message
+void RunLookup(const std::string& name, Postoffice* postoffice, int app_id,
+               int customer_id, int repeat) {
+  int64_t allocs = num_allocs.load();
+  auto start = std::chrono::high_resolution_clock::now();
+  int found = 0;
+  for (int i = 0; i < repeat; ++i) {
+    found += postoffice->GetCustomer(app_id, customer_id) != nullptr;
+  }
+  auto end = std::chrono::high_resolution_clock::now();
+  allocs = num_allocs.load() - allocs;
+  CHECK_EQ(found, repeat);
+
+  LL << name << ":\t" << static_cast<double>(allocs) / repeat << " allocs/lookup, "
+     << std::chrono::duration<double, std::nano>(end - start).count() / repeat
+     << " ns/lookup";
+}
+
+int main(int argc, char *argv[]) {
+  // multiple of 1024 so that the last notification is not lost
+  int repeat = (argc > 1) ? atoi(argv[1]) : 1 << 20;
+  repeat = std::max(1024, repeat / 1024 * 1024);
+
+  Postoffice::Init(Node::WORKER);
+  auto postoffice = Postoffice::GetWorker();
+  Customer customer(0, 0, Handle, postoffice);
+  // a worker usually has one customer per thread
+  std::vector<std::unique_ptr<Customer>> others;
+  for (int i = 1; i < 8; ++i) {
+    others.emplace_back(new Customer(0, i, Handle, postoffice));
+  }
+  others.emplace_back(new Customer(0, 1000, Handle, postoffice));
+
+  RunLookup("GetCustomer(0, 3)", postoffice, 0, 3, repeat);
+  RunLookup("GetCustomer(0, 1000)", postoffice, 0, 1000, repeat);
+
+  Run("Customer::Accept(const Message&)", repeat, [&](Message* msg) {
+    customer.Accept(*msg);
+  });
+  Run("Customer::Accept(Message&&)", repeat, [&](Message* msg) {
+    customer.Accept(std::move(*msg));
+  });
+  // what Van::ProcessDataMsg does for every received data message
+  Run("Van::ProcessDataMsg", repeat, [&](Message* msg) {
+    int app_id = msg->meta.app_id;
+    postoffice->GetCustomer(app_id, app_id, 5)->Accept(std::move(*msg));
+  });
+  return 0;
+}
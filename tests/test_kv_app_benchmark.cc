@@ -0,0 +1,274 @@
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <mutex>
+#include <random>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+#include "ps/ps.h"
+
+using namespace ps;
+
+// every worker calls the KVWorker methods on keys of its own, and checks the
+// values it gets back against the sums it pushed, then times the calls
+const int kValLen = 4;
+// the keys of all workers are spread over all the servers
+const int kNumKeys = 256;
+
+int env2int(const char* var, int default_val) {
+  auto env_str = Environment::Get()->find(var);
+  return env_str ? atoi(env_str) : default_val;
+}
+
+std::unordered_map<Key, SArray<int>> store;
+std::mutex store_mu;
+
+// adds the pushes to the stored values, and answers pulls, and push-pulls,
+// with them
+void SumHandle(const KVMeta& req_meta, const KVPairs<int>& req_data, KVServer<int>* server) {
+  size_t n = req_data.keys.size();
+  KVPairs<int> res;
+  std::lock_guard<std::mutex> lk(store_mu);
+  if (req_meta.push) {
+    CHECK_EQ(req_data.vals.size(), n * kValLen);
+    for (size_t i = 0; i < n; ++i) {
+      auto& stored = store[req_data.keys[i]];
+      if (stored.empty()) stored.resize(kValLen, 0);
+      for (int j = 0; j < kValLen; ++j) stored[j] += req_data.vals[i * kValLen + j];
+    }
+  }
+  if (!req_meta.push || req_meta.push_pull) {
+    res.keys = req_data.keys;
+    res.vals.resize(n * kValLen, 0);
+    for (size_t i = 0; i < n; ++i) {
+      auto it = store.find(req_data.keys[i]);
+      if (it == store.end()) continue;
+      memcpy(res.vals.data() + i * kValLen, it->second.data(), kValLen * sizeof(int));
+    }
+  }
+  server->Response(req_meta, res);
+}
+
+// the keys of this worker, sorted, and the sum pushed to every one of them
+struct Model {
+  Model() {
+    auto krs = Postoffice::Get()->GetServerKeyRanges();
+    for (int i = 0; i < kNumKeys; ++i) {
+      const Range& range = krs[i % krs.size()];
+      keys.push_back(range.begin() + (i / krs.size()) * NumWorkers() + MyRank());
+    }
+    std::sort(keys.begin(), keys.end());
+    for (Key key : keys) sums[key] = 0;
+  }
+  // the j-th value of a key is its sum times j+1
+  void Check(Key key, const int* vals) const {
+    for (int j = 0; j < kValLen; ++j) {
+      CHECK_EQ(vals[j], sums.at(key) * (j + 1)) << "key " << key << ", value " << j;
+    }
+  }
+  SArray<Key> keys;
+  std::unordered_map<Key, int> sums;
+};
+
+template <typename F>
+void Time(const std::string& name, int repeat, F f) {
+  auto start = std::chrono::high_resolution_clock::now();
+  for (int i = 0; i < repeat; ++i) f(i);
+  auto end = std::chrono::high_resolution_clock::now();
+  double sec = std::chrono::duration<double>(end - start).count();
+  LL << "worker " << MyRank() << ": " << name << "\t" << repeat / sec << " calls/s";
+}
+
+// keys drawn with duplicates and in any order, as the ids of an embedding
+// lookup batch
+SArray<Key> DrawKeys(const Model& model, std::mt19937* rng, size_t n) {
+  SArray<Key> keys(n);
+  // a few hot keys make sure of the duplicates
+  for (auto& key : keys) key = model.keys[(*rng)() % ((*rng)() % 2 ? 8 : kNumKeys)];
+  return keys;
+}
+
+// SparsePush sums the values of duplicate keys, and SparsePull copies the
+// value of a key to every position it appears at
+void CheckSparse(KVWorker<int>* kv, Model* model, int repeat) {
+  std::mt19937 rng(MyRank());
+  Time("SparsePush then SparsePull", repeat, [&](int i) {
+    SArray<Key> keys = DrawKeys(*model, &rng, 64);
+    SArray<int> vals(keys.size() * kValLen);
+    for (size_t k = 0; k < keys.size(); ++k) {
+      int delta = 1 + rng() % 5;
+      model->sums[keys[k]] += delta;
+      for (int j = 0; j < kValLen; ++j) vals[k * kValLen + j] = delta * (j + 1);
+    }
+    kv->Wait(kv->SparsePush(keys, vals));
+    keys = DrawKeys(*model, &rng, 64);
+    SArray<int> pulled;
+    // every other pull places the values as they arrive
+    if (i % 2) pulled.resize(keys.size() * kValLen, -1);
+    kv->Wait(kv->SparsePull(keys, &pulled));
+    CHECK_EQ(pulled.size(), keys.size() * kValLen);
+    for (size_t k = 0; k < keys.size(); ++k) model->Check(keys[k], pulled.data() + k * kValLen);
+  });
+}
+
+// ZPushPull answers with the values after its push. a few of them are in
+// flight on overlapping keys, which a server handles in the order they came,
+// so each gets the sums up to its own push. each starts at a later key than
+// the one before, which a server with set_executor may give to another thread
+void CheckPushPull(KVWorker<int>* kv, Model* model, int repeat) {
+  std::mt19937 rng(MyRank() + 100);
+  const int window = 4;
+  Time("ZPushPull", repeat, [&](int i) {
+    size_t first = rng() % kNumKeys;
+    size_t end = std::min<size_t>(kNumKeys, first + window + rng() % 32);
+    std::vector<SArray<Key>> runs(window);
+    std::vector<SArray<int>> vals(window), outs(window);
+    std::vector<std::unordered_map<Key, int>> expected(window);
+    std::vector<int> ts;
+    for (int w = 0; w < window; ++w) {
+      size_t begin = std::min(first + w, end - 1);
+      const SArray<Key>& keys = runs[w] = model->keys.segment(begin, end);
+      int delta = 1 + rng() % 5;
+      vals[w].resize(keys.size() * kValLen);
+      for (size_t k = 0; k < keys.size(); ++k) {
+        expected[w][keys[k]] = model->sums[keys[k]] += delta;
+        for (int j = 0; j < kValLen; ++j) vals[w][k * kValLen + j] = delta * (j + 1);
+      }
+      // every other one places the values as they arrive
+      if (i % 2) outs[w].resize(vals[w].size(), -1);
+      ts.push_back(kv->ZPushPull(keys, vals[w], &outs[w]));
+    }
+    kv->WaitAll(ts);
+    for (int w = 0; w < window; ++w) {
+      const SArray<Key>& keys = runs[w];
+      CHECK_EQ(outs[w].size(), keys.size() * kValLen);
+      for (size_t k = 0; k < keys.size(); ++k) {
+        for (int j = 0; j < kValLen; ++j) {
+          CHECK_EQ(outs[w][k * kValLen + j], expected[w][keys[k]] * (j + 1))
+              << "ZPushPull " << w << " of key " << keys[k];
+        }
+      }
+    }
+  });
+}
+
+// CachedPull takes the values of keys pulled in the current clock from the
+// cache, so it misses a push made meanwhile. after a Clock, it asks the
+// servers, which send back the values of the pushed keys only, and it returns
+// the new sums
+void CheckCached(KVWorker<int>* kv, Model* model, int repeat) {
+  std::mt19937 rng(MyRank() + 200);
+  kv->set_cache(1 << 20, 0);
+  Time("CachedPull, push, CachedPull, Clock, CachedPull", repeat, [&](int i) {
+    size_t begin = rng() % kNumKeys;
+    size_t end = std::min<size_t>(kNumKeys, begin + 1 + rng() % 32);
+    SArray<Key> keys = model->keys.segment(begin, end);
+    SArray<int> pulled;
+    kv->Wait(kv->CachedPull(keys, &pulled));
+    CHECK_EQ(pulled.size(), keys.size() * kValLen);
+    for (size_t k = 0; k < keys.size(); ++k) model->Check(keys[k], pulled.data() + k * kValLen);
+    // every other key of the run changes
+    std::unordered_map<Key, int> before = model->sums;
+    SArray<Key> pushed;
+    SArray<int> vals;
+    for (size_t k = i % 2; k < keys.size(); k += 2) {
+      int delta = 1 + rng() % 5;
+      model->sums[keys[k]] += delta;
+      pushed.push_back(keys[k]);
+      for (int j = 0; j < kValLen; ++j) vals.push_back(delta * (j + 1));
+    }
+    if (pushed.size()) kv->Wait(kv->ZPush(pushed, vals));
+    SArray<int> cached;
+    kv->Wait(kv->CachedPull(keys, &cached));
+    CHECK_EQ(cached.size(), keys.size() * kValLen);
+    for (size_t k = 0; k < keys.size(); ++k) {
+      for (int j = 0; j < kValLen; ++j) {
+        CHECK_EQ(cached[k * kValLen + j], before[keys[k]] * (j + 1))
+            << "key " << keys[k] << " was not taken from the cache";
+      }
+    }
+    kv->Wait(kv->Clock());
+    SArray<int> fresh;
+    kv->Wait(kv->CachedPull(keys, &fresh));
+    CHECK_EQ(fresh.size(), keys.size() * kValLen);
+    for (size_t k = 0; k < keys.size(); ++k) model->Check(keys[k], fresh.data() + k * kValLen);
+  });
+}
+
+// with set_staleness(s), a pull at clock c is held until every worker reached
+// clock c - s, so it sees the pushes every worker made before that. all the
+// workers push to the same keys and end an iteration with Clock, while the
+// last worker stalls now and then. a worker may push at most s + 1 iterations
+// past the clock of the slowest before its own pull is held
+void CheckStaleness(KVWorker<int>* kv, int staleness, int repeat) {
+  auto krs = Postoffice::Get()->GetServerKeyRanges();
+  SArray<Key> keys;
+  for (const auto& range : krs) keys.push_back(range.begin() + (1 << 20));
+  SArray<int> vals(keys.size() * kValLen);
+  for (size_t k = 0; k < keys.size(); ++k) {
+    for (int j = 0; j < kValLen; ++j) vals[k * kValLen + j] = j + 1;
+  }
+  const int n = NumWorkers();
+  int num_stale = 0;
+  Time("SSP push, Clock, pull", repeat, [&](int i) {
+    kv->Wait(kv->ZPush(keys, vals));
+    if (MyRank() == n - 1 && i % 16 == 0) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(2));
+    }
+    kv->Clock();
+    int clock = i + 1;
+    SArray<int> pulled;
+    kv->Wait(kv->ZPull(keys, &pulled));
+    CHECK_EQ(pulled.size(), vals.size());
+    // the pushes of this worker, and the fewest and most of the others
+    int least = clock + (n - 1) * std::max(0, clock - staleness);
+    int most = clock + (n - 1) * (clock + staleness + 1);
+    for (size_t k = 0; k < keys.size(); ++k) {
+      int pushes = pulled[k * kValLen];
+      CHECK_GE(pushes, least) << "a pull at clock " << clock << " was not held";
+      CHECK_LE(pushes, most) << "a worker ran past the bound at clock " << clock;
+      for (int j = 0; j < kValLen; ++j) CHECK_EQ(pulled[k * kValLen + j], pushes * (j + 1));
+      num_stale += pushes < n * clock;
+    }
+  });
+  LL << "worker " << MyRank() << ": " << num_stale << " of " << repeat * keys.size()
+     << " pulls missed pushes of the iteration, with staleness " << staleness;
+}
+
+int main(int argc, char *argv[]) {
+  // the calls of every check
+  int repeat = (argc > 1) ? atoi(argv[1]) : 1000;
+  const char* val = CHECK_NOTNULL(Environment::Get()->find("DMLC_ROLE"));
+  std::string role_str(val);
+  Node::Role role = GetRole(role_str);
+  StartPS(0, role, -1, true);
+
+  // the servers of app 1 hold back pulls by the clocks
+  const int staleness = env2int("BENCHMARK_STALENESS", 1);
+  if (IsServer()) {
+    auto server = new KVServer<int>(0);
+    server->set_request_handle(SumHandle);
+    server->set_versioning(true);
+    server->set_executor(env2int("BENCHMARK_SERVER_THREADS", 0));
+    auto ssp_server = new KVServer<int>(1);
+    ssp_server->set_request_handle(SumHandle);
+    ssp_server->set_staleness(staleness);
+    RegisterExitCallback([server, ssp_server]() {
+      delete server;
+      delete ssp_server;
+    });
+  }
+  if (!IsServer() && !IsScheduler()) {
+    KVWorker<int> kv(0, 0);
+    Model model;
+    CheckSparse(&kv, &model, repeat);
+    CheckPushPull(&kv, &model, repeat);
+    CheckCached(&kv, &model, repeat);
+    KVWorker<int> ssp_kv(1, 0);
+    CheckStaleness(&ssp_kv, staleness, repeat);
+  }
+
+  Finalize(0, role, true);
+  return 0;
+}
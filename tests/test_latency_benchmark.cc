@@ -0,0 +1,408 @@
+#include <sys/resource.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <random>
+#include <thread>
+#include <cstdlib>
+#include <unistd.h>
+#include "ps/ps.h"
+
+using namespace ps;
+
+enum MODE {
+    PUSH_ONLY = 0,
+    PULL_ONLY = 1,
+    PUSH_PULL = 2,
+    PUSH_THEN_PULL = 3
+};
+
+std::unordered_map<uint64_t, KVPairs<char> > mem_map;
+std::mutex mem_mu;
+// bytes pushed to or pulled from this server
+std::atomic<uint64_t> server_bytes{0};
+// request messages received by this server, a batch counts once
+std::atomic<uint64_t> server_msgs{0};
+
+// with BENCHMARK_SKEWED_KEYS, the keys of all threads are packed at the low
+// end of the key space, like encoded tensor ids, and the equal-sized default
+// ranges put all of them on the first server
+const Key kSkewedKeyStride = 1024;
+
+int env2int(const char* var, int default_val) {
+  auto env_str = Environment::Get()->find(var);
+  int val = env_str ? atoi(env_str) : default_val;
+  return val;
+}
+
+// user + system cpu time of this process, in seconds
+double CpuSeconds() {
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  return usage.ru_utime.tv_sec + usage.ru_stime.tv_sec +
+         (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1e6;
+}
+
+// every node sleeps for a while right after start and reports how much
+// cpu the ps-lite background threads burnt in the meantime
+void MeasureIdleCpu(const std::string& role) {
+  const int idle_sec = env2int("IDLE_SECONDS", 3);
+  if (idle_sec <= 0) return;
+  double cpu_start = CpuSeconds();
+  auto start = std::chrono::steady_clock::now();
+  std::this_thread::sleep_for(std::chrono::seconds(idle_sec));
+  double cpu = CpuSeconds() - cpu_start;
+  double wall = std::chrono::duration<double>(
+      std::chrono::steady_clock::now() - start).count();
+  LL << role << " idle cpu usage: " << 100.0 * cpu / wall << "% of one core";
+}
+
+template <typename Val>
+void LatencyHandler(const KVMeta &req_meta, const KVPairs<Val> &req_data, KVServer<Val> *server) {
+  uint64_t key = req_data.keys[0];
+  server_bytes += req_data.vals.size();
+  if (req_meta.batch_part <= 0) ++server_msgs;
+  if (req_meta.push) {
+    CHECK(req_data.lens.size());
+    KVPairs<char> res;
+    {
+      std::lock_guard<std::mutex> lk(mem_mu);
+      auto& stored = mem_map[key];
+      if (stored.vals.size() != req_data.vals.size()) {
+        stored.keys.CopyFrom(req_data.keys);
+        stored.lens.CopyFrom(req_data.lens);
+        stored.vals.CopyFrom(req_data.vals);
+      }
+      // the values after the push
+      if (req_meta.push_pull) res = stored;
+    }
+    server_bytes += res.vals.size();
+    server->Response(req_meta, res);
+  } else {
+    KVPairs<char> res;
+    {
+      std::lock_guard<std::mutex> lk(mem_mu);
+      auto iter = mem_map.find(key);
+      CHECK(iter != mem_map.end()) << "pull before push, key=" << key;
+      res = iter->second;
+    }
+    server_bytes += res.vals.size();
+    server->Response(req_meta, res);
+  }
+}
+
+// with BENCHMARK_REBALANCE_MS, the stored pairs move between the servers
+void ExportKeys(const Range& range, KVPairs<char>* kvs) {
+  std::lock_guard<std::mutex> lk(mem_mu);
+  std::vector<Key> keys;
+  for (const auto& kv : mem_map) {
+    if (kv.first >= range.begin() && kv.first < range.end()) keys.push_back(kv.first);
+  }
+  std::sort(keys.begin(), keys.end());
+  for (Key key : keys) {
+    auto& stored = mem_map[key];
+    CHECK_EQ(stored.keys.size(), 1U) << "only single-key requests can be moved";
+    kvs->keys.append(stored.keys);
+    kvs->lens.append(stored.lens);
+    kvs->vals.append(stored.vals);
+    mem_map.erase(key);
+  }
+}
+
+void ImportKeys(const KVPairs<char>& kvs) {
+  std::lock_guard<std::mutex> lk(mem_mu);
+  size_t offset = 0;
+  for (size_t i = 0; i < kvs.keys.size(); ++i) {
+    auto& stored = mem_map[kvs.keys[i]];
+    stored.keys.CopyFrom(kvs.keys.data() + i, 1);
+    stored.lens.CopyFrom(kvs.lens.data() + i, 1);
+    stored.vals.CopyFrom(kvs.vals.data() + offset, kvs.lens[i]);
+    offset += kvs.lens[i];
+  }
+}
+
+void RunWorker(int argc, char *argv[], KVWorker<char>* kv, int tid,
+               std::vector<double>* latencies) {
+  auto krs = ps::Postoffice::Get()->GetServerKeyRanges();
+  const int num_servers = krs.size();
+  CHECK_GT(num_servers, 0);
+
+  int len = (argc > 1) ? atoi(argv[1]) : 8;
+  int count = (argc > 2) ? atoi(argv[2]) : 10000;
+  MODE mode = (argc > 3) ? static_cast<MODE>(atoi(argv[3])) : PUSH_ONLY;
+
+  // one small key per server and thread
+  std::vector<SArray<Key>> keys(num_servers);
+  std::vector<SArray<char>> vals(num_servers);
+  std::vector<SArray<int>> lens(num_servers);
+  const bool skewed = env2int("BENCHMARK_SKEWED_KEYS", 0);
+  // with BENCHMARK_SYNC, every key is pulled before its first push, as
+  // workers fetching the initial model do. the pull waits for the first round
+  const bool sync = env2int("BENCHMARK_SYNC", 0);
+  for (int server = 0; server < num_servers; ++server) {
+    Key key = skewed ? server * kSkewedKeyStride + tid : krs[server].begin() + tid;
+    keys[server].CopyFrom(&key, 1);
+    vals[server].resize(len, 1);
+    lens[server].resize(1, len);
+    SArray<char> first_vals;
+    SArray<int> first_lens;
+    int first_pull = sync ? kv->ZPull(keys[server], &first_vals, &first_lens) : -1;
+    kv->Wait(kv->ZPush(keys[server], vals[server], lens[server]));
+    if (sync) {
+      kv->Wait(first_pull);
+      CHECK_EQ(first_lens[0], len);
+      // the sum of the first pushes of all workers
+      CHECK_EQ(first_vals[0], static_cast<char>(NumWorkers()));
+    }
+  }
+  if (env2int("BENCHMARK_ALL_SERVERS", 0)) {
+    // every request covers one key on each server instead
+    SArray<Key> all_keys;
+    SArray<char> all_vals;
+    SArray<int> all_lens;
+    for (int server = 0; server < num_servers; ++server) {
+      all_keys.append(keys[server]);
+      all_vals.append(vals[server]);
+      all_lens.append(lens[server]);
+    }
+    if (env2int("BENCHMARK_HASH_SLICER", 0)) {
+      // keys routed by hash need not be sorted
+      std::reverse(all_keys.begin(), all_keys.end());
+    }
+    keys.assign(1, all_keys);
+    vals.assign(1, all_vals);
+    lens.assign(1, all_lens);
+  }
+  const int num_requests = keys.size();
+  // with BENCHMARK_CACHE, pulls go through the versioned cache, and only
+  // carry values the servers changed
+  const bool cached = env2int("BENCHMARK_CACHE", 0);
+  if (cached) kv->set_cache(1 << 30, env2int("BENCHMARK_CACHE_STALENESS", -1));
+
+  latencies->reserve(count);
+  const int window = env2int("BENCHMARK_WINDOW", 1);
+  // with BENCHMARK_STALENESS, every request is an iteration, which may stall
+  // for BENCHMARK_STRAGGLER_US now and then, as a slow worker would
+  const bool clocked = env2int("BENCHMARK_STALENESS", -1) >= 0;
+  const int straggler_us = env2int("BENCHMARK_STRAGGLER_US", 0);
+  std::mt19937 rng(MyRank() * 1000 + tid);
+  if (window <= 1) {
+    for (int i = 0; i < count; ++i) {
+      int server = i % num_requests;
+      auto start = std::chrono::high_resolution_clock::now();
+      if (mode == PUSH_ONLY) {
+        kv->Wait(kv->ZPush(keys[server], vals[server], lens[server]));
+      } else if (mode == PULL_ONLY && cached) {
+        kv->Wait(kv->CachedPull(keys[server], &vals[server], &lens[server]));
+      } else if (mode == PULL_ONLY) {
+        kv->Wait(kv->ZPull(keys[server], &vals[server], &lens[server]));
+      } else if (mode == PUSH_PULL) {
+        kv->Wait(kv->ZPushPull(keys[server], vals[server], &vals[server], &lens[server]));
+      } else {
+        kv->Wait(kv->ZPush(keys[server], vals[server], lens[server]));
+        kv->Wait(kv->ZPull(keys[server], &vals[server], &lens[server]));
+      }
+      auto end = std::chrono::high_resolution_clock::now();
+      latencies->push_back(std::chrono::duration<double, std::micro>(end - start).count());
+      if (clocked) {
+        if (straggler_us > 0 && rng() % 10 == 0) {
+          std::this_thread::sleep_for(std::chrono::microseconds(straggler_us));
+        }
+        kv->Clock();
+      }
+    }
+    return;
+  }
+
+  // keep a window of requests in flight, each with its own pull buffers
+  CHECK_NE(mode, PUSH_THEN_PULL) << "not supported with BENCHMARK_WINDOW";
+  CHECK(!clocked) << "BENCHMARK_STALENESS is not supported with BENCHMARK_WINDOW";
+  std::vector<SArray<char>> pull_vals(window);
+  std::vector<SArray<int>> pull_lens(window);
+  std::vector<int> inflight;
+  std::unordered_map<int, std::pair<int, std::chrono::high_resolution_clock::time_point>> issued;
+  std::vector<int> free_slots;
+  for (int i = 0; i < window; ++i) free_slots.push_back(i);
+  auto complete = [&]() {
+    int ts = kv->WaitAny(inflight);
+    auto end = std::chrono::high_resolution_clock::now();
+    auto it = issued.find(ts);
+    latencies->push_back(std::chrono::duration<double, std::micro>(end - it->second.second).count());
+    free_slots.push_back(it->second.first);
+    issued.erase(it);
+    inflight.erase(std::find(inflight.begin(), inflight.end(), ts));
+  };
+  for (int i = 0; i < count; ++i) {
+    if (free_slots.empty()) complete();
+    int server = i % num_requests;
+    int slot = free_slots.back();
+    free_slots.pop_back();
+    auto start = std::chrono::high_resolution_clock::now();
+    int ts;
+    if (mode == PUSH_ONLY) {
+      ts = kv->ZPush(keys[server], vals[server], lens[server]);
+    } else if (mode == PULL_ONLY && cached) {
+      ts = kv->CachedPull(keys[server], &pull_vals[slot], &pull_lens[slot]);
+    } else if (mode == PULL_ONLY) {
+      ts = kv->ZPull(keys[server], &pull_vals[slot], &pull_lens[slot]);
+    } else {
+      // the lengths of the pushed values, and of the pulled ones
+      pull_lens[slot].CopyFrom(lens[server]);
+      ts = kv->ZPushPull(keys[server], vals[server], &pull_vals[slot], &pull_lens[slot]);
+    }
+    inflight.push_back(ts);
+    issued[ts] = std::make_pair(slot, start);
+  }
+  while (!inflight.empty()) complete();
+}
+
+void Report(int len, MODE mode, double seconds, std::vector<double>* latencies) {
+  auto& lat = *latencies;
+  CHECK(lat.size());
+  std::sort(lat.begin(), lat.end());
+  auto pct = [&lat](double p) {
+    size_t idx = std::min(lat.size() - 1, static_cast<size_t>(p * lat.size()));
+    return lat[idx];
+  };
+  const char* names[] = {"push", "pull", "push-pull", "push then pull"};
+  LL << names[mode] << " " << len << " bytes, "
+     << lat.size() << " requests, " << lat.size() / seconds << " req/s\t"
+     << "latency (us): p50=" << pct(0.5) << " p99=" << pct(0.99)
+     << " max=" << lat.back();
+}
+
+int main(int argc, char *argv[]) {
+  const char* val = CHECK_NOTNULL(Environment::Get()->find("DMLC_ROLE"));
+  std::string role_str(val);
+  Node::Role role = GetRole(role_str);
+  StartPS(0, role, -1, true);
+
+  const int rank = MyRank();
+  if (IsServer()) {
+    auto server = new KVServer<char>(0);
+    if (env2int("BENCHMARK_SYNC", 0)) {
+      // sum the pushes of all workers, and hold the pulls until every worker
+      // pushed, as synchronous training does
+      CHECK_EQ(env2int("BENCHMARK_REBALANCE_MS", 0), 0) << "the sums cannot be moved";
+      KVServerSyncHandle<char> sync(NumWorkers());
+      if (env2int("BENCHMARK_BATCH_HANDLE", 0)) {
+        // the requests queued meanwhile at once, the pushes to a key summed
+        // in one pass
+        using Requests = std::vector<std::pair<KVMeta, KVPairs<char>>>;
+        server->set_batch_request_handle([sync](const Requests& reqs,
+                                                KVServer<char>* server) mutable {
+          for (const auto& req : reqs) {
+            server_bytes += req.second.vals.size();
+            if (req.first.batch_part <= 0) ++server_msgs;
+          }
+          sync(reqs, server);
+        });
+      } else {
+        server->set_request_handle([sync](const KVMeta& req_meta, const KVPairs<char>& req_data,
+                                          KVServer<char>* server) mutable {
+          server_bytes += req_data.vals.size();
+          if (req_meta.batch_part <= 0) ++server_msgs;
+          sync(req_meta, req_data, server);
+        });
+      }
+    } else {
+      server->set_request_handle(LatencyHandler<char>);
+    }
+    if (env2int("BENCHMARK_REBALANCE_MS", 0) > 0) {
+      server->set_migrate_handle(ExportKeys, ImportKeys);
+    }
+    server->set_staleness(env2int("BENCHMARK_STALENESS", -1));
+    server->set_versioning(env2int("BENCHMARK_CACHE", 0));
+    // handle the requests of different keys on several threads
+    server->set_executor(env2int("BENCHMARK_SERVER_THREADS", 0),
+                         env2int("BENCHMARK_SERVER_FIRST_CORE", -1));
+    // handle the small requests on the receiving thread of the van
+    server->get_customer()->set_inline_handling(env2int("BENCHMARK_INLINE_BYTES", -1));
+  }
+  MeasureIdleCpu(role_str);
+
+  // with BENCHMARK_BARRIERS, every worker and server times that many barriers
+  // while the requests run, which a burst of data should not hold up
+  const int num_barriers = env2int("BENCHMARK_BARRIERS", 0);
+  std::thread barriers;
+  if (num_barriers > 0 && !IsScheduler()) {
+    barriers = std::thread([num_barriers, role_str]() {
+      std::vector<double> lat;
+      for (int i = 0; i < num_barriers; ++i) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(5));
+        auto start = std::chrono::high_resolution_clock::now();
+        Postoffice::Get()->Barrier(0, kWorkerGroup + kServerGroup);
+        auto end = std::chrono::high_resolution_clock::now();
+        lat.push_back(std::chrono::duration<double, std::micro>(end - start).count());
+      }
+      std::sort(lat.begin(), lat.end());
+      LL << role_str << " barrier latency (us): p50=" << lat[lat.size() / 2]
+         << " max=" << lat.back();
+    });
+  }
+
+  if (!IsServer() && !IsScheduler()) {
+    const int nthread = env2int("BENCHMARK_NTHREAD", 1);
+    int len = (argc > 1) ? atoi(argv[1]) : 8;
+    MODE mode = (argc > 3) ? static_cast<MODE>(atoi(argv[3])) : PUSH_ONLY;
+    std::vector<KVWorker<char>*> kvs;
+    std::vector<std::vector<double>> latencies(nthread);
+    std::vector<std::thread> threads;
+    // threads either share one worker, or have one each
+    const bool shared = env2int("BENCHMARK_SHARED_WORKER", 0);
+    for (int i = 0; i < nthread; ++i) {
+      kvs.push_back(shared && i ? kvs[0] : new KVWorker<char>(0, i));
+      if (env2int("BENCHMARK_HASH_SLICER", 0)) kvs.back()->set_hash_slicer();
+      if (env2int("BENCHMARK_COALESCE_US", 0) > 0 && !(shared && i)) {
+        kvs.back()->set_coalescing(env2int("BENCHMARK_COALESCE_US", 0));
+      }
+      // and the small responses
+      kvs.back()->get_customer()->set_inline_handling(env2int("BENCHMARK_INLINE_BYTES", -1));
+    }
+    if (env2int("BENCHMARK_SKEWED_KEYS", 0) && env2int("BENCHMARK_BALANCE_KEYS", 0)) {
+      // report the bytes every key will carry, so that the scheduler
+      // partitions the key space by load before the first request
+      std::vector<std::pair<Key, uint64_t>> load;
+      for (int server = 0; server < Postoffice::Get()->num_servers(); ++server) {
+        for (int i = 0; i < nthread; ++i) {
+          load.emplace_back(server * kSkewedKeyStride + i, len);
+        }
+      }
+      Postoffice::GetWorker()->PartitionServerKeyRanges(load);
+    }
+    auto start = std::chrono::high_resolution_clock::now();
+    for (int i = 0; i < nthread; ++i) {
+      threads.emplace_back(RunWorker, argc, argv, kvs[i], i, &latencies[i]);
+    }
+    // the first worker rebalances the servers by their load while the
+    // requests are running
+    const int rebalance_ms = env2int("BENCHMARK_REBALANCE_MS", 0);
+    std::thread rebalancer;
+    if (rebalance_ms > 0 && rank == 0) {
+      rebalancer = std::thread([&kvs, rebalance_ms]() {
+        std::this_thread::sleep_for(std::chrono::milliseconds(rebalance_ms));
+        auto start = std::chrono::high_resolution_clock::now();
+        kvs[0]->Rebalance();
+        auto end = std::chrono::high_resolution_clock::now();
+        LL << "rebalance took "
+           << std::chrono::duration<double, std::milli>(end - start).count() << " ms";
+      });
+    }
+    for (auto& t : threads) t.join();
+    auto end = std::chrono::high_resolution_clock::now();
+    if (rebalancer.joinable()) rebalancer.join();
+
+    std::vector<double> all;
+    for (auto& l : latencies) all.insert(all.end(), l.begin(), l.end());
+    Report(len, mode, std::chrono::duration<double>(end - start).count(), &all);
+  }
+
+  if (barriers.joinable()) barriers.join();
+  Finalize(0, role, true);
+  if (role == Node::SERVER) {
+    LL << "server " << rank << " handled " << server_bytes << " bytes in "
+       << server_msgs << " messages";
+  }
+  return 0;
+}
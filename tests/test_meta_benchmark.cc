@@ -0,0 +1,195 @@
+#include <chrono>
+#include <cstdlib>
+#include "ps/ps.h"
+
+using namespace ps;
+
+// exposes the meta codecs of the van, no network is involved
+class MetaCodec : public Van {
+ public:
+  MetaCodec() : Van(nullptr) {}
+  void Connect(const Node& node) override {}
+  int Bind(Node& node, int max_retry) override { return -1; }
+  int RecvMsg(Message* msg) override { return -1; }
+  int SendMsg(Message& msg) override { return -1; }
+  std::string GetType() const override { return "meta_benchmark"; }
+
+  using Van::GetPackMetaLen;
+  using Van::PackMeta;
+  using Van::UnpackMeta;
+  using Van::PackCompactMeta;
+  using Van::UnpackCompactMeta;
+  using Van::PeekCompactMeta;
+};
+
+// a push request as built by KVWorker::Send
+Meta PushRequest() {
+  Message msg;
+  msg.meta.app_id = 0;
+  msg.meta.customer_id = 0;
+  msg.meta.request = true;
+  msg.meta.push = true;
+  msg.meta.head = 0;
+  msg.meta.timestamp = 12345;
+  SArray<Key> keys(1, 1ull << 40);
+  SArray<float> vals(16);
+  SArray<int> lens(1, 16 * sizeof(float));
+  msg.meta.addr = reinterpret_cast<uint64_t>(vals.data());
+  msg.meta.val_len = vals.size() * sizeof(float);
+  msg.AddData(keys);
+  msg.AddData(vals);
+  msg.AddData(lens);
+  return msg.meta;
+}
+
+// a pull response as built by KVServer::Response
+Meta PullResponse() {
+  Meta meta = PushRequest();
+  meta.request = false;
+  meta.push = false;
+  meta.key = 1ull << 40;
+  return meta;
+}
+
+// an ADD_NODE control message with a few nodes
+Meta AddNode(int num_nodes) {
+  Meta meta;
+  meta.control.cmd = Control::ADD_NODE;
+  meta.timestamp = 3;
+  for (int i = 0; i < num_nodes; ++i) {
+    Node n;
+    n.role = Node::WORKER;
+    n.id = 9 + 2 * i;
+    n.hostname = "10.0.0." + std::to_string(i);
+    n.port = 10000 + i;
+    n.num_ports = 1;
+    n.ports.fill(0);
+    n.ports[0] = n.port;
+    n.dev_types.fill(0);
+    n.dev_ids.fill(0);
+    n.customer_id = 0;
+    n.endpoint_name_len = 0;
+    meta.control.node.push_back(n);
+  }
+  return meta;
+}
+
+void CheckSame(const Meta& a, const Meta& b) {
+  CHECK_EQ(a.head, b.head);
+  CHECK_EQ(a.app_id, b.app_id);
+  CHECK_EQ(a.customer_id, b.customer_id);
+  CHECK_EQ(a.timestamp, b.timestamp);
+  CHECK_EQ(a.request, b.request);
+  CHECK_EQ(a.push, b.push);
+  CHECK_EQ(a.simple_app, b.simple_app);
+  CHECK_EQ(a.body, b.body);
+  CHECK(a.data_type == b.data_type);
+  CHECK_EQ(a.src_dev_type, b.src_dev_type);
+  CHECK_EQ(a.src_dev_id, b.src_dev_id);
+  CHECK_EQ(a.dst_dev_type, b.dst_dev_type);
+  CHECK_EQ(a.dst_dev_id, b.dst_dev_id);
+  CHECK_EQ(a.control.cmd, b.control.cmd);
+  CHECK_EQ(a.control.node.size(), b.control.node.size());
+  for (size_t i = 0; i < a.control.node.size(); ++i) {
+    CHECK_EQ(a.control.node[i].DebugString(), b.control.node[i].DebugString());
+  }
+  CHECK_EQ(a.data_size, b.data_size);
+  CHECK_EQ(a.key, b.key);
+  CHECK_EQ(a.addr, b.addr);
+  CHECK_EQ(a.val_len, b.val_len);
+  CHECK_EQ(a.option, b.option);
+  CHECK_EQ(a.sid, b.sid);
+}
+
+template <typename F>
+double NsPerOp(int repeat, F f) {
+  auto start = std::chrono::high_resolution_clock::now();
+  for (int i = 0; i < repeat; ++i) f();
+  auto end = std::chrono::high_resolution_clock::now();
+  return std::chrono::duration<double, std::nano>(end - start).count() / repeat;
+}
+
+void Run(MetaCodec* codec, const std::string& name, const Meta& meta, int repeat) {
+  // legacy format, allocated per message as Van::PackMeta does
+  int legacy_size = 0;
+  char* legacy_buf = nullptr;
+  codec->PackMeta(meta, &legacy_buf, &legacy_size);
+  Meta decoded;
+  codec->UnpackMeta(legacy_buf, legacy_size, &decoded);
+  CheckSame(meta, decoded);
+  double legacy_pack = NsPerOp(repeat, [&]() {
+    char* buf = nullptr;
+    int size;
+    codec->PackMeta(meta, &buf, &size);
+    delete[] buf;
+  });
+  double legacy_unpack = NsPerOp(repeat, [&]() {
+    Meta m;
+    codec->UnpackMeta(legacy_buf, legacy_size, &m);
+  });
+  delete[] legacy_buf;
+
+  // compact format
+  int compact_size = 0;
+  const char* compact_buf = codec->PackCompactMeta(meta, &compact_size);
+  std::string compact(compact_buf, compact_size);
+  Meta compact_decoded;
+  CHECK_EQ(codec->UnpackCompactMeta(compact.data(), compact.size(), &compact_decoded),
+           compact_size);
+  CheckSame(meta, compact_decoded);
+  double compact_pack = NsPerOp(repeat, [&]() {
+    int size;
+    codec->PackCompactMeta(meta, &size);
+  });
+  double compact_unpack = NsPerOp(repeat, [&]() {
+    Meta m;
+    codec->UnpackCompactMeta(compact.data(), compact.size(), &m);
+  });
+  double compact_view = NsPerOp(repeat, [&]() {
+    MetaView view;
+    codec->UnpackCompactMeta(compact.data(), compact.size(), &view);
+  });
+
+  LL << name << "\tlegacy: " << legacy_size << " bytes, pack " << legacy_pack
+     << " ns, unpack " << legacy_unpack << " ns";
+  LL << name << "\tcompact: " << compact_size << " bytes, pack " << compact_pack
+     << " ns, unpack " << compact_unpack << " ns, unpack view " << compact_view << " ns";
+}
+
+// with PS_RECV_THREADS, the reading thread only peeks at the app and the
+// customer of a data message to pick its thread, which decodes the meta
+void RunPeek(MetaCodec* codec, const std::string& name, const Meta& meta, int repeat) {
+  int size = 0;
+  const char* buf = codec->PackCompactMeta(meta, &size);
+  std::string compact(buf, size);
+  int app_id = -1, customer_id = -1;
+  bool data = codec->PeekCompactMeta(compact.data(), compact.size(), &app_id, &customer_id);
+  CHECK_EQ(data, meta.control.empty());
+  if (!data) {
+    LL << name << "\tdecoded on the reading thread, which routes it by its control";
+    return;
+  }
+  CHECK_EQ(app_id, meta.app_id);
+  CHECK_EQ(customer_id, meta.customer_id);
+  double peek = NsPerOp(repeat, [&]() {
+    codec->PeekCompactMeta(compact.data(), compact.size(), &app_id, &customer_id);
+  });
+  double unpack = NsPerOp(repeat, [&]() {
+    Meta m;
+    codec->UnpackCompactMeta(compact.data(), compact.size(), &m);
+  });
+  LL << name << "\ton the reading thread: peek " << peek << " ns, instead of unpack "
+     << unpack << " ns";
+}
+
+int main(int argc, char *argv[]) {
+  int repeat = (argc > 1) ? atoi(argv[1]) : 1000000;
+  MetaCodec codec;
+  Run(&codec, "push request", PushRequest(), repeat);
+  Run(&codec, "pull response", PullResponse(), repeat);
+  Run(&codec, "add node (8)", AddNode(8), repeat / 10);
+  RunPeek(&codec, "push request", PushRequest(), repeat);
+  RunPeek(&codec, "pull response", PullResponse(), repeat);
+  RunPeek(&codec, "add node (8)", AddNode(8), repeat / 10);
+  return 0;
+}
@@ -0,0 +1,132 @@
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "ps/ps.h"
+#include "ps/internal/spsc_queue.h"
+
+using namespace ps;
+
+// the DMLC_LOCKLESS_QUEUE mode of ThreadsafeQueue before the MPSCQueue: a
+// bounded single producer single consumer queue with a mutex on either side,
+// polled by the consumer
+class LegacyLocklessQueue {
+ public:
+  LegacyLocklessQueue() : queue_(32768) {}
+
+  void Push(uint64_t value) {
+    std::lock_guard<std::mutex> lk(write_mu_);
+    queue_.push(value);
+  }
+
+  void WaitAndPop(uint64_t* value) {
+    auto t = std::chrono::high_resolution_clock::now() + std::chrono::nanoseconds(1000);
+    for (;;) {
+      read_mu_.lock();
+      if (queue_.front()) {
+        *value = *queue_.front();
+        queue_.pop();
+        read_mu_.unlock();
+        return;
+      }
+      read_mu_.unlock();
+      if (std::chrono::high_resolution_clock::now() < t) {
+        std::this_thread::yield();
+      } else {
+        std::this_thread::sleep_for(std::chrono::microseconds(1));
+      }
+    }
+  }
+
+  void PopBatch(std::vector<uint64_t>* values) {
+    uint64_t value;
+    WaitAndPop(&value);
+    values->push_back(value);
+    std::lock_guard<std::mutex> lk(read_mu_);
+    while (queue_.front()) {
+      values->push_back(*queue_.front());
+      queue_.pop();
+    }
+  }
+
+ private:
+  std::mutex read_mu_;
+  std::mutex write_mu_;
+  rigtorp::SPSCQueue<uint64_t> queue_;
+};
+
+// a ThreadsafeQueue in the given mode, which it reads from the environment
+std::unique_ptr<ThreadsafeQueue<uint64_t>> NewQueue(bool lockless) {
+  setenv("DMLC_LOCKLESS_QUEUE", lockless ? "1" : "0", 1);
+  return std::unique_ptr<ThreadsafeQueue<uint64_t>>(new ThreadsafeQueue<uint64_t>());
+}
+
+// num_producers threads push num_items values in total, tagged with the
+// producer and its sequence number, while this thread pops them one by one or
+// in batches. every value must arrive once, and in order per producer
+template <typename Q>
+void Run(const std::string& name, Q* queue, int num_producers, uint64_t num_items,
+         bool batch) {
+  uint64_t per_producer = num_items / num_producers;
+  uint64_t total = per_producer * num_producers;
+  std::vector<uint64_t> next(num_producers, 0);
+  size_t num_batches = 0;
+  auto start = std::chrono::high_resolution_clock::now();
+  std::vector<std::thread> producers;
+  for (int p = 0; p < num_producers; ++p) {
+    producers.emplace_back([queue, p, per_producer]() {
+      for (uint64_t i = 0; i < per_producer; ++i) {
+        queue->Push((static_cast<uint64_t>(p) << 40) | i);
+      }
+    });
+  }
+  auto check = [&](uint64_t value) {
+    int p = value >> 40;
+    CHECK_LT(p, num_producers);
+    CHECK_EQ(value & ((1ULL << 40) - 1), next[p]++) << "producer " << p;
+  };
+  std::vector<uint64_t> values;
+  for (uint64_t popped = 0; popped < total; ) {
+    if (batch) {
+      values.clear();
+      queue->PopBatch(&values);
+      for (uint64_t value : values) check(value);
+      popped += values.size();
+    } else {
+      uint64_t value;
+      queue->WaitAndPop(&value);
+      check(value);
+      ++popped;
+    }
+    ++num_batches;
+  }
+  auto end = std::chrono::high_resolution_clock::now();
+  for (auto& t : producers) t.join();
+  for (int p = 0; p < num_producers; ++p) CHECK_EQ(next[p], per_producer);
+  double sec = std::chrono::duration<double>(end - start).count();
+  LL << num_producers << " producers, " << name << (batch ? " PopBatch" : " WaitAndPop")
+     << ":\t" << total / sec / 1e6 << " M items/s, "
+     << static_cast<double>(total) / num_batches << " items/pop";
+}
+
+int main(int argc, char *argv[]) {
+  // the number of items pushed by all producers of a run
+  uint64_t num_items = (argc > 1) ? atoll(argv[1]) : 1 << 21;
+
+  for (int num_producers : {1, 2, 4, 8, 16, 32}) {
+    for (bool batch : {false, true}) {
+      auto cv = NewQueue(false);
+      Run("mutex and cv", cv.get(), num_producers, num_items, batch);
+      LegacyLocklessQueue legacy;
+      Run("spsc and mutexes", &legacy, num_producers, num_items, batch);
+      auto lockless = NewQueue(true);
+      Run("mpsc", lockless.get(), num_producers, num_items, batch);
+      CHECK_EQ(lockless->Size(), 0);
+    }
+  }
+  return 0;
+}
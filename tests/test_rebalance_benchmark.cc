@@ -0,0 +1,212 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <mutex>
+#include <random>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+#include "ps/ps.h"
+
+using namespace ps;
+
+// every thread of every worker pushes to keys of its own and pulls them back,
+// while the first worker rebalances the servers again and again. a pull must
+// return exactly the sum of the pushes the thread made, whichever servers
+// the pairs moved to meanwhile. the requests take random runs of the keys of
+// the thread, which are spread over all the servers once the ranges follow
+// the load, so they straddle the old and the new boundaries
+const int kValLen = 2;
+// the keys of all threads are packed at the low end of the key space, which
+// the default ranges put on the first server
+const Key kKeyStride = 1024;
+
+int env2int(const char* var, int default_val) {
+  auto env_str = Environment::Get()->find(var);
+  return env_str ? atoi(env_str) : default_val;
+}
+
+std::unordered_map<Key, SArray<int>> store;
+std::mutex store_mu;
+
+void SumHandle(const KVMeta& req_meta, const KVPairs<int>& req_data, KVServer<int>* server) {
+  size_t n = req_data.keys.size();
+  KVPairs<int> res;
+  std::lock_guard<std::mutex> lk(store_mu);
+  if (req_meta.push) {
+    CHECK_EQ(req_data.vals.size(), n * kValLen);
+    for (size_t i = 0; i < n; ++i) {
+      auto& stored = store[req_data.keys[i]];
+      if (stored.empty()) stored.resize(kValLen, 0);
+      for (int j = 0; j < kValLen; ++j) stored[j] += req_data.vals[i * kValLen + j];
+    }
+  } else {
+    res.keys = req_data.keys;
+    res.vals.resize(n * kValLen, 0);
+    for (size_t i = 0; i < n; ++i) {
+      auto it = store.find(req_data.keys[i]);
+      if (it == store.end()) continue;
+      memcpy(res.vals.data() + i * kValLen, it->second.data(), kValLen * sizeof(int));
+    }
+  }
+  server->Response(req_meta, res);
+}
+
+void ExportKeys(const Range& range, KVPairs<int>* kvs) {
+  std::lock_guard<std::mutex> lk(store_mu);
+  std::vector<Key> keys;
+  for (const auto& kv : store) {
+    if (kv.first >= range.begin() && kv.first < range.end()) keys.push_back(kv.first);
+  }
+  std::sort(keys.begin(), keys.end());
+  for (Key key : keys) {
+    kvs->keys.push_back(key);
+    kvs->vals.append(store[key]);
+    store.erase(key);
+  }
+}
+
+void ImportKeys(const KVPairs<int>& kvs) {
+  std::lock_guard<std::mutex> lk(store_mu);
+  CHECK_EQ(kvs.vals.size(), kvs.keys.size() * kValLen);
+  for (size_t i = 0; i < kvs.keys.size(); ++i) {
+    // a pair lives on one server at a time
+    CHECK(store.find(kvs.keys[i]) == store.end()) << "key " << kvs.keys[i] << " is here already";
+    store[kvs.keys[i]].CopyFrom(kvs.vals.data() + i * kValLen, kValLen);
+  }
+}
+
+// the values the thread expects for a run of its keys
+SArray<int> Expected(const std::vector<int>& sums, size_t begin, size_t end) {
+  SArray<int> vals((end - begin) * kValLen);
+  for (size_t i = begin; i < end; ++i) {
+    for (int j = 0; j < kValLen; ++j) vals[(i - begin) * kValLen + j] = sums[i] * (j + 1);
+  }
+  return vals;
+}
+
+void CheckPulled(const SArray<Key>& keys, const SArray<int>& vals, const SArray<int>& expected) {
+  CHECK_EQ(vals.size(), expected.size());
+  for (size_t i = 0; i < vals.size(); ++i) {
+    CHECK_EQ(vals[i], expected[i]) << "key " << keys[i / kValLen] << " after a rebalance";
+  }
+}
+
+// the server of a key by the ranges this worker uses now
+int ServerOf(Key key) {
+  const auto& ranges = Postoffice::Get()->GetKeyRangeTable().ranges;
+  for (size_t i = 0; i < ranges.size(); ++i) {
+    if (key >= ranges[i].begin() && key < ranges[i].end()) return i;
+  }
+  return -1;
+}
+
+void RunWorker(KVWorker<int>* kv, int tid, int nthread, int count, int num_rebalances,
+               std::atomic<int>* num_straddled) {
+  const int num_keys = env2int("BENCHMARK_NUM_KEYS", 64);
+  SArray<Key> keys(num_keys);
+  for (int i = 0; i < num_keys; ++i) {
+    keys[i] = ((static_cast<Key>(i) * NumWorkers() + MyRank()) * nthread + tid) * kKeyStride;
+  }
+  // the sum pushed to every key, the j-th value of a key gets it times j+1
+  std::vector<int> sums(num_keys, 0);
+  std::mt19937 rng(MyRank() * 1000 + tid);
+  // with BENCHMARK_STALENESS, every pull is an iteration
+  const bool clocked = env2int("BENCHMARK_STALENESS", -1) >= 0;
+  // until the last rebalance is seen, and at least count pulls were checked.
+  // clocked threads all stop at count, as the pulls of the others would be
+  // held forever by a thread which stopped earlier
+  for (int i = 0; i < count || (!clocked &&
+       Postoffice::Get()->GetKeyRangeTable().version < num_rebalances); ++i) {
+    size_t begin = rng() % num_keys;
+    size_t end = std::min<size_t>(num_keys, begin + 1 + rng() % num_keys);
+    SArray<Key> run = keys.segment(begin, end);
+    if (ServerOf(run.front()) != ServerOf(run.back())) ++*num_straddled;
+    int delta = 1 + rng() % 7;
+    for (size_t k = begin; k < end; ++k) sums[k] += delta;
+    SArray<int> push = Expected(std::vector<int>(num_keys, delta), begin, end);
+    kv->Wait(kv->ZPush(run, push));
+    SArray<int> vals;
+    kv->Wait(kv->ZPull(run, &vals));
+    CheckPulled(run, vals, Expected(sums, begin, end));
+    if (clocked) {
+      // the last worker stalls now and then, so the servers hold pulls of the
+      // others when the pairs move
+      if (MyRank() == NumWorkers() - 1 && i % 8 == 0) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(5));
+      }
+      kv->Clock();
+    }
+  }
+  SArray<int> vals;
+  kv->Wait(kv->ZPull(keys, &vals));
+  CheckPulled(keys, vals, Expected(sums, 0, num_keys));
+}
+
+int main(int argc, char *argv[]) {
+  // the pulls checked by every thread
+  int count = (argc > 1) ? atoi(argv[1]) : 2000;
+  // the servers connect to each other to move the pairs
+  setenv("PS_KEY_MIGRATION", "1", 1);
+  const char* val = CHECK_NOTNULL(Environment::Get()->find("DMLC_ROLE"));
+  std::string role_str(val);
+  Node::Role role = GetRole(role_str);
+  StartPS(0, role, -1, true);
+
+  const int num_rebalances = env2int("BENCHMARK_REBALANCES", 3);
+  if (IsServer()) {
+    auto server = new KVServer<int>(0);
+    server->set_request_handle(SumHandle);
+    server->set_migrate_handle(ExportKeys, ImportKeys);
+    server->set_executor(env2int("BENCHMARK_SERVER_THREADS", 0));
+    // the pulls held back are returned to the workers by a rebalance
+    server->set_staleness(env2int("BENCHMARK_STALENESS", -1));
+    RegisterExitCallback([server]() { delete server; });
+  }
+  if (!IsServer() && !IsScheduler()) {
+    const int nthread = env2int("BENCHMARK_NTHREAD", 4);
+    std::vector<std::unique_ptr<KVWorker<int>>> kvs;
+    for (int i = 0; i < nthread; ++i) {
+      kvs.emplace_back(new KVWorker<int>(0, i));
+      // the batches of requests are rejected and resent as a whole
+      if (env2int("BENCHMARK_COALESCE_US", 0) > 0) {
+        kvs.back()->set_coalescing(env2int("BENCHMARK_COALESCE_US", 0));
+      }
+    }
+    const std::vector<Range> initial = Postoffice::Get()->GetServerKeyRanges();
+    std::atomic<int> num_straddled{0};
+    auto start = std::chrono::high_resolution_clock::now();
+    std::vector<std::thread> threads;
+    for (int i = 0; i < nthread; ++i) {
+      threads.emplace_back(RunWorker, kvs[i].get(), i, nthread, count, num_rebalances,
+                           &num_straddled);
+    }
+    if (MyRank() == 0) {
+      const int interval_ms = env2int("BENCHMARK_REBALANCE_MS", 100);
+      for (int i = 0; i < num_rebalances; ++i) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(interval_ms));
+        auto begin = std::chrono::high_resolution_clock::now();
+        kvs[0]->Rebalance();
+        auto end = std::chrono::high_resolution_clock::now();
+        LL << "rebalance " << i << " took "
+           << std::chrono::duration<double, std::milli>(end - begin).count() << " ms";
+      }
+    }
+    for (auto& t : threads) t.join();
+    auto end = std::chrono::high_resolution_clock::now();
+    Postoffice::Get()->WaitKeyRangeVersion(num_rebalances);
+    // the low end of the key space was split between the servers
+    const auto& ranges = Postoffice::Get()->GetServerKeyRanges();
+    CHECK_EQ(Postoffice::Get()->GetKeyRangeTable().version, num_rebalances);
+    if (ranges.size() > 1 && num_rebalances > 0) {
+      CHECK_LT(ranges[0].end(), initial[0].end()) << "the pairs did not move";
+      CHECK_GT(num_straddled.load(), 0) << "no request crossed a boundary";
+    }
+    LL << "worker " << MyRank() << ": " << num_straddled << " requests across servers, "
+       << std::chrono::duration<double>(end - start).count() << " s";
+  }
+
+  Finalize(0, role, true);
+  return 0;
+}
@@ -0,0 +1,250 @@
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <random>
+#include <sstream>
+#include "ps/ps.h"
+
+using namespace ps;
+
+// the slicing done by KVWorker::DefaultSlicer before the boundary table: one
+// std::lower_bound per server over the remaining keys, then a scalar sum of
+// the value lengths of every server
+void LegacySlice(const SArray<Key>& keys, const SArray<int>& lens,
+                 const std::vector<Range>& ranges,
+                 std::vector<size_t>* pos, std::vector<size_t>* val_pos) {
+  size_t n = ranges.size();
+  pos->resize(n+1);
+  const Key* begin = keys.begin();
+  const Key* end = keys.end();
+  for (size_t i = 0; i < n; ++i) {
+    if (i == 0) {
+      (*pos)[0] = std::lower_bound(begin, end, ranges[0].begin()) - begin;
+      begin += (*pos)[0];
+    } else {
+      CHECK_EQ(ranges[i-1].end(), ranges[i].begin());
+    }
+    size_t len = std::lower_bound(begin, end, ranges[i].end()) - begin;
+    begin += len;
+    (*pos)[i+1] = (*pos)[i] + len;
+  }
+  if (lens.empty()) return;
+  val_pos->resize(n+1);
+  size_t val_end = 0;
+  (*val_pos)[0] = 0;
+  for (size_t i = 0; i < n; ++i) {
+    for (size_t j = (*pos)[i]; j < (*pos)[i+1]; ++j) val_end += lens[j];
+    (*val_pos)[i+1] = val_end;
+  }
+}
+
+void Slice(const KeySlicer& slicer, const SArray<Key>& keys,
+           const SArray<int>& lens,
+           std::vector<size_t>* pos, std::vector<size_t>* val_pos) {
+  size_t n = slicer.num_servers();
+  pos->resize(n+1);
+  slicer.FindKeyPositions(keys.data(), keys.size(), pos->data());
+  if (lens.empty()) return;
+  val_pos->resize(n+1);
+  slicer.FindValuePositions(lens.data(), pos->data(), val_pos->data());
+}
+
+// the share of the bytes every server gets, given the bytes of every key
+std::string ByteShare(const std::vector<Range>& ranges, const SArray<Key>& keys,
+                      const SArray<int>& lens) {
+  KeySlicer slicer(ranges);
+  std::vector<size_t> pos(ranges.size() + 1), val_pos(ranges.size() + 1);
+  slicer.FindKeyPositions(keys.data(), keys.size(), pos.data());
+  slicer.FindValuePositions(lens.data(), pos.data(), val_pos.data());
+  std::stringstream ss;
+  ss.precision(3);
+  for (size_t i = 0; i < ranges.size(); ++i) {
+    ss << " " << 100.0 * (val_pos[i+1] - val_pos[i]) / val_pos.back() << "%";
+  }
+  return ss.str();
+}
+
+// embedding ids drawn from a Zipf distribution, with the hot ids at the low
+// end of the key space, so the default ranges overload the first server
+void ReportByteShare(int num_servers, size_t num_keys) {
+  std::mt19937_64 rng(0);
+  std::vector<double> weights(num_keys);
+  for (size_t i = 0; i < num_keys; ++i) weights[i] = 1.0 / (i + 1);
+  std::discrete_distribution<size_t> zipf(weights.begin(), weights.end());
+  std::vector<int> bytes(num_keys, 0);
+  for (size_t i = 0; i < 100 * num_keys; ++i) bytes[zipf(rng)] += 4;
+
+  SArray<Key> keys(num_keys);
+  SArray<int> lens(num_keys);
+  std::vector<std::pair<Key, uint64_t>> load;
+  for (size_t i = 0; i < num_keys; ++i) {
+    keys[i] = i * (kMaxKey / num_keys);
+    lens[i] = bytes[i];
+    load.emplace_back(keys[i], bytes[i]);
+  }
+  LL << num_servers << " servers, zipf byte share with default ranges:"
+     << ByteShare(WeightedKeyRanges({}, num_servers), keys, lens);
+  LL << num_servers << " servers, zipf byte share with weighted ranges:"
+     << ByteShare(WeightedKeyRanges(load, num_servers), keys, lens);
+}
+
+template <typename F>
+double Time(int repeat, F slice) {
+  auto start = std::chrono::high_resolution_clock::now();
+  for (int i = 0; i < repeat; ++i) slice();
+  auto end = std::chrono::high_resolution_clock::now();
+  return std::chrono::duration<double, std::micro>(end - start).count() / repeat;
+}
+
+// embedding ids in no particular order and with duplicates, each with dim
+// values. range slicing needs the ids sorted first, and the values moved
+// along, while hashing scatters them as they are
+void CompareHashScatter(int num_servers, size_t num_keys, int dim) {
+  std::mt19937_64 rng(1);
+  std::vector<Key> keys(num_keys);
+  for (auto& key : keys) key = rng() % (num_keys * 4);
+  std::vector<float> vals(num_keys * dim);
+  for (size_t i = 0; i < vals.size(); ++i) vals[i] = i;
+  std::vector<Range> ranges;
+  for (int i = 0; i < num_servers; ++i) {
+    ranges.push_back(Range(num_keys * 4 / num_servers * i,
+                           i + 1 == num_servers ? kMaxKey : num_keys * 4 / num_servers * (i+1)));
+  }
+  KeySlicer slicer(ranges);
+  std::vector<size_t> pos(num_servers + 1), offsets(num_servers + 1);
+  std::vector<std::pair<Key, uint32_t>> order(num_keys);
+  std::vector<uint32_t> perm(num_keys);
+  std::vector<Key> out_keys(num_keys);
+  std::vector<float> out_vals(num_keys * dim);
+  auto gather = [&](const uint32_t* idx, size_t stride) {
+    for (size_t j = 0; j < num_keys; ++j) {
+      memcpy(out_vals.data() + j * dim, vals.data() + idx[j * stride] * dim,
+             dim * sizeof(float));
+    }
+  };
+
+  double sorted = Time(3, [&]() {
+    for (size_t i = 0; i < num_keys; ++i) order[i] = std::make_pair(keys[i], i);
+    std::sort(order.begin(), order.end());
+    for (size_t j = 0; j < num_keys; ++j) out_keys[j] = order[j].first;
+    gather(&order[0].second, sizeof(order[0]) / sizeof(uint32_t));
+    slicer.FindKeyPositions(out_keys.data(), num_keys, pos.data());
+  });
+  CHECK_EQ(pos.back(), num_keys);
+  double hashed = Time(3, [&]() {
+    HashScatterKeys(keys.data(), num_keys, num_servers, offsets.data(),
+                    perm.data(), out_keys.data());
+    gather(perm.data(), 1);
+  });
+  // every server gets its own keys in the request order, with their values
+  CHECK_EQ(offsets.back(), num_keys);
+  for (int s = 0; s < num_servers; ++s) {
+    for (size_t j = offsets[s]; j < offsets[s+1]; ++j) {
+      CHECK_EQ(out_keys[j], keys[perm[j]]);
+      CHECK_EQ(HashKeyToServer(out_keys[j], num_servers), static_cast<size_t>(s));
+      CHECK(j == offsets[s] || perm[j-1] < perm[j]);
+      CHECK_EQ(out_vals[j * dim], vals[perm[j] * dim]);
+    }
+  }
+  LL << num_servers << " servers, " << num_keys << " unsorted keys, dim " << dim
+     << ":\tsort and slice " << sorted << " us, hash scatter " << hashed
+     << " us, speedup " << sorted / hashed;
+}
+
+// a batch of embedding ids drawn from a Zipf distribution, so the hot ids
+// repeat many times. sorting and std::unique against the radix sort of
+// DedupKeys, which also maps every id to its distinct key
+void CompareDedup(size_t num_keys, size_t num_ids) {
+  std::mt19937_64 rng(2);
+  std::vector<double> weights(num_ids);
+  for (size_t i = 0; i < num_ids; ++i) weights[i] = 1.0 / (i + 1);
+  std::discrete_distribution<size_t> zipf(weights.begin(), weights.end());
+  std::vector<Key> keys(num_keys);
+  // scatter the ids over the low 40 bits, as a feature hash would
+  for (auto& key : keys) key = (zipf(rng) * 0x9E3779B97F4A7C15ULL) >> 24;
+
+  std::vector<Key> sorted(num_keys), unique(num_keys);
+  std::vector<uint32_t> index(num_keys);
+  size_t num_sorted = 0, num_unique = 0;
+  double sort = Time(3, [&]() {
+    sorted = keys;
+    std::sort(sorted.begin(), sorted.end());
+    num_sorted = std::unique(sorted.begin(), sorted.end()) - sorted.begin();
+    for (size_t i = 0; i < num_keys; ++i) {
+      index[i] = std::lower_bound(sorted.begin(), sorted.begin() + num_sorted, keys[i]) -
+                 sorted.begin();
+    }
+  });
+  std::vector<uint32_t> sort_index = index;
+  double radix = Time(3, [&]() {
+    num_unique = DedupKeys(keys.data(), num_keys, unique.data(), index.data());
+  });
+  CHECK_EQ(num_unique, num_sorted);
+  CHECK(std::equal(sorted.begin(), sorted.begin() + num_sorted, unique.begin()));
+  CHECK(index == sort_index);
+  LL << num_keys << " ids, " << num_unique << " distinct:\tsort and unique "
+     << sort << " us, radix dedup " << radix << " us, speedup " << sort / radix
+     << ", " << 100.0 * num_unique / num_keys << "% of the keys sent";
+}
+
+int main(int argc, char *argv[]) {
+  // the largest number of keys in a request
+  size_t max_keys = (argc > 1) ? atol(argv[1]) : 10000000;
+
+  std::mt19937_64 rng(0);
+  for (int num_servers : {1, 8, 64, 256, 1024}) {
+    std::vector<Range> ranges;
+    for (int i = 0; i < num_servers; ++i) {
+      ranges.push_back(Range(kMaxKey / num_servers * i,
+                             kMaxKey / num_servers * (i+1)));
+    }
+    KeySlicer slicer(ranges);
+
+    for (size_t num_keys = 1000; num_keys <= max_keys; num_keys *= 10) {
+      // sparse keys spread over the whole key space. small requests rotate
+      // over several key lists, otherwise the branch predictor learns the
+      // searches of a single list by heart
+      int num_lists = std::max<size_t>(1, std::min<size_t>(64, 1000000 / num_keys));
+      std::vector<SArray<Key>> keys(num_lists);
+      std::vector<SArray<int>> lens(num_lists);
+      for (int i = 0; i < num_lists; ++i) {
+        keys[i].resize(num_keys);
+        lens[i].resize(num_keys);
+        for (auto& key : keys[i]) key = rng() % kMaxKey;
+        std::sort(keys[i].begin(), keys[i].end());
+        for (auto& len : lens[i]) len = 1 + rng() % 16;
+      }
+      int repeat = std::max<size_t>(3, 10000000 / num_keys);
+
+      for (bool with_lens : {false, true}) {
+        std::vector<size_t> pos, val_pos, legacy_pos, legacy_val_pos;
+        int i = 0;
+        double legacy = Time(repeat, [&]() {
+          int list = i++ % num_lists;
+          LegacySlice(keys[list], with_lens ? lens[list] : SArray<int>(),
+                      ranges, &legacy_pos, &legacy_val_pos);
+        });
+        i = 0;
+        double table = Time(repeat, [&]() {
+          int list = i++ % num_lists;
+          Slice(slicer, keys[list], with_lens ? lens[list] : SArray<int>(),
+                &pos, &val_pos);
+        });
+        // both ended on the same list
+        CHECK(pos == legacy_pos);
+        CHECK(val_pos == legacy_val_pos);
+        LL << num_servers << " servers, " << num_keys << " keys"
+           << (with_lens ? " with lens" : "") << ":\tlower_bound "
+           << legacy << " us, boundary table " << table << " us, speedup "
+           << legacy / table;
+      }
+    }
+  }
+  for (int num_servers : {8, 64}) {
+    CompareHashScatter(num_servers, std::min<size_t>(max_keys, 1000000), 8);
+  }
+  CompareDedup(std::min<size_t>(max_keys, 1000000), 1000000);
+  ReportByteShare(8, 100000);
+  return 0;
+}